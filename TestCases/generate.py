@@ -0,0 +1,45 @@
+# random text inputs over a few entities and relations, so that the same instances are added,
+# deleted and dropped again and again; names share long prefixes, to get at the ordering of the
+# reports and the key prefixes of the instance index. model.py gives their outputs:
+#
+#   python3 TestCases/generate.py seed commands [entities] [relations] [diffs] > batch.in
+#
+# diffs is the share of the reports printed by reportdiff instead, none by default
+import random
+import sys
+
+# the share of each command, in order; report takes the rest
+WEIGHTS = [('addent', 0.15), ('delent', 0.05), ('addrel', 0.40), ('droprel', 0.04), ('delrel', 0.22)]
+
+
+def main():
+    seed, count = int(sys.argv[1]), int(sys.argv[2])
+    numEntities = int(sys.argv[3]) if len(sys.argv) > 3 else 12
+    numRelations = int(sys.argv[4]) if len(sys.argv) > 4 else 4
+    diffs = float(sys.argv[5]) if len(sys.argv) > 5 else 0
+    rng = random.Random(seed)
+    entities = ['"%s%d"' % (rng.choice(['abcdefg', 'abcdefgh', 'abcdefghi', 'abcdefg~', 'abcdef', '~~~~~~~~']), i)
+                for i in range(numEntities)]
+    relations = ['"%s%d"' % (rng.choice(['relation', 'relatio', 'relations', 'relation_', 'r']), i)
+                 for i in range(numRelations)]
+    for _ in range(count):
+        pick, op = rng.random(), 'report'
+        for name, weight in WEIGHTS:
+            if pick < weight:
+                op = name
+                break
+            pick -= weight
+        if op in ('addent', 'delent'):
+            print(op, rng.choice(entities))
+        elif op in ('addrel', 'delrel'):
+            print(op, rng.choice(entities), rng.choice(entities), rng.choice(relations))
+        elif op == 'droprel':
+            print(op, rng.choice(relations))
+        elif diffs > 0 and rng.random() < diffs:
+            print('reportdiff')
+        else:
+            print(op)
+    print('end')
+
+
+main()
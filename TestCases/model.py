@@ -0,0 +1,80 @@
+# the commands of the text input as plain Python sets, slow and obviously right: reads them on stdin
+# and prints what main prints, without the trailing spaces. Writes the .py.out of the inputs made by
+# generate.py:
+#
+#   python3 TestCases/model.py < TestCases/8_Droprel/batch8.1.in > TestCases/8_Droprel/batch8.1.py.out
+#
+# with --restore, the commands of that file are run first without printing anything, as if
+# restored from the snapshot it saves at its end; reportdiff starts from there
+#
+#   python3 TestCases/model.py --restore TestCases/10_Restore/batch10.1.in < TestCases/10_Restore/restore10.1.in
+import sys
+
+entities = set()
+relations = {}      # relation name -> set of (sender, recipient)
+previous = {}       # the report printed last, by report or reportdiff
+
+
+def run(command, out):
+    global previous
+    words = command.split()
+    if not words:
+        return
+    op, args = words[0], words[1:]
+    if op == 'addent':
+        entities.add(args[0])
+    elif op == 'delent':
+        if args[0] in entities:
+            entities.discard(args[0])
+            for pairs in relations.values():
+                pairs -= {pair for pair in pairs if args[0] in pair}
+    elif op == 'addrel':
+        if args[0] in entities and args[1] in entities:
+            relations.setdefault(args[2], set()).add((args[0], args[1]))
+    elif op == 'delrel':
+        relations.get(args[2], set()).discard((args[0], args[1]))
+    elif op == 'droprel':
+        relations.pop(args[0], None)
+    elif op == 'report':
+        previous = report()
+        out.append(' '.join(previous.values()) or 'none')
+    elif op == 'reportdiff':
+        current = report()
+        changed = [current[relation] if relation in current else relation + ' none;'
+                   for relation in sorted(set(current) | set(previous)) if current.get(relation) != previous.get(relation)]
+        previous = current
+        out.append(' '.join(changed) or 'none')
+
+
+def report():
+    """relation name -> its part of the report, for the relations with instances, in report order"""
+    parts = {}
+    for relation in sorted(relations):
+        counts = {}
+        for sender, recipient in relations[relation]:
+            counts[recipient] = counts.get(recipient, 0) + 1
+        if counts:
+            top = max(counts.values())
+            parts[relation] = ' '.join([relation] + sorted(r for r in counts if counts[r] == top) + ['%d;' % top])
+    return parts
+
+
+def runFile(lines, out):
+    for line in lines:
+        if line.split()[:1] == ['end']:
+            break
+        run(line, out)
+
+
+def main():
+    global previous
+    out = []
+    if sys.argv[1:2] == ['--restore']:
+        with open(sys.argv[2]) as saved:
+            runFile(saved, [])
+        previous = report()
+    runFile(sys.stdin, out)
+    print('\n'.join(out))
+
+
+main()
@@ -0,0 +1,132 @@
+// --- DB_NO_NAME TEST ---
+/*
+ * runs the same random commands on two databases, the second one also getting every command with
+ * DB_NO_NAME in each of the places it can go, which db.h says do nothing: the reports of the two
+ * have to stay the same. Then names holding a NUL byte, which are never interned. Runs once with
+ * each flag of db_open; prints the first difference and exits 1. test.sh builds it with the same
+ * flags as main, and again with -DWORKER_THREADS=4 for DB_SHARDS to queue the commands even on
+ * one CPU; a command that writes where it shouldn't is best caught with -fsanitize=address:
+ *
+ * gcc -std=gnu11 -O2 -pthread -o no_name_test TestCases/no_name_test.c db.c -lm
+ * ./no_name_test
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "../db.h"
+
+#define NUM_NAMES 16
+#define ROUNDS 200
+
+uint64_t nextRandom(uint64_t *state) {     //splitmix64
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/*
+ * each command with DB_NO_NAME for one of its names, the others real ones
+ */
+void applyMissing(db_t *database, const db_name_t *names, uint64_t *state) {
+    db_name_t a = names[nextRandom(state) % NUM_NAMES], b = names[nextRandom(state) % NUM_NAMES];
+    db_name_t r = names[nextRandom(state) % NUM_NAMES];
+
+    db_apply(database, DB_ADDENT, DB_NO_NAME, DB_NO_NAME, DB_NO_NAME);
+    db_apply(database, DB_DELENT, DB_NO_NAME, DB_NO_NAME, DB_NO_NAME);
+    db_apply(database, DB_ADDREL, DB_NO_NAME, b, r);
+    db_apply(database, DB_ADDREL, a, DB_NO_NAME, r);
+    db_apply(database, DB_ADDREL, a, b, DB_NO_NAME);
+    db_apply(database, DB_DELREL, DB_NO_NAME, b, r);
+    db_apply(database, DB_DELREL, a, DB_NO_NAME, r);
+    db_apply(database, DB_DELREL, a, b, DB_NO_NAME);
+    db_apply(database, DB_DROPREL, a, b, DB_NO_NAME);
+}
+
+bool runMissing(unsigned flags) {
+    db_t *plain = db_open(flags), *database = db_open(flags);
+    db_name_t plainNames[NUM_NAMES], names[NUM_NAMES];
+    uint64_t state = 11, missing = 5, r;
+    const char *expected, *got;
+    size_t expectedLen, gotLen;
+    char name[16];
+    db_op_t op;
+    int round, i, a, b, c;
+
+    for (i = 0; i < NUM_NAMES; i++) {
+        snprintf(name, sizeof(name), "n%d", i);
+        plainNames[i] = db_intern(plain, name, strlen(name));
+        names[i] = db_intern(database, name, strlen(name));
+    }
+    for (round = 0; round < ROUNDS; round++) {
+        for (i = 0; i < 16; i++) {
+            r = nextRandom(&state);
+            op = r % 8 < 2 ? DB_ADDENT : r % 8 < 5 ? DB_ADDREL : r % 8 < 6 ? DB_DELREL : r % 8 < 7 ? DB_DELENT : DB_DROPREL;
+            a = (int)((r >> 8) % NUM_NAMES);
+            b = (int)((r >> 16) % NUM_NAMES);
+            c = (int)((r >> 24) % NUM_NAMES);
+            db_apply(plain, op, plainNames[a], plainNames[b], plainNames[c]);
+            applyMissing(database, names, &missing);
+            db_apply(database, op, names[a], names[b], names[c]);
+        }
+        expected = round % 2 ? db_report(plain, &expectedLen) : db_reportdiff(plain, &expectedLen);
+        got = round % 2 ? db_report(database, &gotLen) : db_reportdiff(database, &gotLen);
+        if (gotLen != expectedLen || memcmp(got, expected, gotLen) != 0) {
+            printf("flags %u, round %d: %.*s expected, %.*s found\n", flags, round, (int)expectedLen, expected,
+                   (int)gotLen, got);
+            db_close(plain);
+            db_close(database);
+            return false;
+        }
+    }
+    db_close(plain);
+    db_close(database);
+    return true;
+}
+
+/*
+ * a name with a NUL byte in it is never interned, nor mistaken for the name before the NUL: the
+ * commands with it do nothing, and the database saved after them is restored
+ */
+bool runNul(unsigned flags, const char *path) {
+    db_t *database = db_open(flags);
+    db_name_t a = db_intern(database, "a", 1);
+    const char *report;
+    size_t len;
+    bool ok;
+
+    db_addent(database, "a", 1);
+    db_addent(database, "a\0", 2);
+    db_addent(database, "b\0c", 3);
+    db_addrel(database, "a", 1, "a\0", 2, "r", 1);
+    db_addrel(database, "a\0", 2, "a", 1, "r\0", 2);
+    db_addrel(database, "a", 1, "a", 1, "r", 1);
+    report = db_report(database, &len);
+    ok = db_intern(database, "a\0", 2) == DB_NO_NAME && db_find(database, "a\0", 2) == DB_NO_NAME &&
+         db_find(database, "a", 1) == a && db_names(database) == 2 && len == strlen("\"r\" \"a\" 1; \n") &&
+         memcmp(report, "\"r\" \"a\" 1; \n", len) == 0 && db_save(database, path) == 0;
+    db_close(database);
+    if (ok && (database = db_restore(path, flags)) != NULL)
+        db_close(database);
+    else
+        ok = false;
+    remove(path);
+    if (!ok)
+        printf("flags %u: a name with a NUL was interned, or the snapshot after it refused\n", flags);
+    return ok;
+}
+
+int main(void) {
+    const unsigned flags[] = {0, DB_BATCH, DB_SHARDS};
+    char path[64];
+    int i;
+
+    snprintf(path, sizeof(path), "/tmp/no_name_test.%d", (int)getpid());
+    for (i = 0; i < (int)(sizeof(flags) / sizeof(flags[0])); i++)
+        if (!runMissing(flags[i]) || !runNul(flags[i], path))
+            return 1;
+    return 0;
+}
@@ -0,0 +1,138 @@
+// --- PREFIX SCAN TEST ---
+/*
+ * adds and deletes entities named with a few letters, relations between them named the same way,
+ * and compares what db_scan_entities finds under random prefixes with the entities kept here, in
+ * the order strcmp gives. Relations aren't entities, and names deleted stay interned, so neither
+ * must be found. Runs once with each flag of db_open; prints the first difference and exits 1.
+ * test.sh builds it with the same flags as main:
+ *
+ * gcc -std=gnu11 -O2 -pthread -o scan_test TestCases/scan_test.c db.c -lm
+ * ./scan_test
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "../db.h"
+
+#define LETTERS 3
+#define MAX_LEN 4
+#define NUM_NAMES (LETTERS + LETTERS * LETTERS + LETTERS * LETTERS * LETTERS + LETTERS * LETTERS * LETTERS * LETTERS)
+#define ROUNDS 400
+
+typedef struct _found {
+    char names[NUM_NAMES][MAX_LEN + 1];
+    int count;
+    bool overflow;
+} t_found;
+
+char names[NUM_NAMES][MAX_LEN + 1];     //every word over the letters, in the order strcmp gives
+bool exists[NUM_NAMES];
+
+uint64_t nextRandom(uint64_t *state) {     //splitmix64
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+int compareWords(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+void collect(void *context, const char *name, size_t len) {
+    t_found *found = context;
+
+    if (found->count == NUM_NAMES || len > MAX_LEN) {
+        found->overflow = true;
+        return;
+    }
+    memcpy(found->names[found->count], name, len);
+    found->names[found->count++][len] = '\0';
+}
+
+/*
+ * the scan of prefix against the entities of exists; false after printing the difference
+ */
+bool checkScan(db_t *database, const char *prefix, unsigned flags, int round) {
+    static t_found found;
+    int i, expected = 0;
+
+    found.count = 0;
+    found.overflow = false;
+    db_scan_entities(database, prefix, strlen(prefix), collect, &found);
+    for (i = 0; i < NUM_NAMES; i++) {
+        if (!exists[i] || strncmp(names[i], prefix, strlen(prefix)) != 0)
+            continue;
+        if (found.overflow || expected >= found.count || strcmp(found.names[expected], names[i]) != 0) {
+            printf("flags %u, round %d, prefix \"%s\": \"%s\" expected, \"%s\" found\n", flags, round, prefix,
+                   names[i], found.overflow || expected >= found.count ? "" : found.names[expected]);
+            return false;
+        }
+        expected++;
+    }
+    if (found.count != expected) {
+        printf("flags %u, round %d, prefix \"%s\": \"%s\" found, not an entity\n", flags, round, prefix,
+               found.names[expected]);
+        return false;
+    }
+    return true;
+}
+
+bool runScans(unsigned flags) {
+    uint64_t state = 7, r;
+    db_t *database = db_open(flags);
+    char prefix[MAX_LEN + 1];
+    const char *a, *b, *c;
+    int round, i, len;
+
+    memset(exists, 0, sizeof(exists));
+    for (round = 0; round < ROUNDS; round++) {
+        for (i = 0; i < 16; i++) {
+            r = nextRandom(&state);
+            a = names[(r >> 8) % NUM_NAMES];
+            b = names[(r >> 24) % NUM_NAMES];
+            c = names[(r >> 40) % NUM_NAMES];
+            if (r % 4 == 0) {
+                db_addrel(database, a, strlen(a), b, strlen(b), c, strlen(c));
+            } else {
+                if (r % 4 == 1)
+                    db_delent(database, a, strlen(a));
+                else
+                    db_addent(database, a, strlen(a));
+                exists[(r >> 8) % NUM_NAMES] = r % 4 != 1;
+            }
+        }
+        for (i = 0; i < 4; i++) {
+            r = nextRandom(&state);
+            len = (int)(r % MAX_LEN);
+            strncpy(prefix, names[(r >> 8) % NUM_NAMES], len);
+            prefix[len] = '\0';
+            if (!checkScan(database, prefix, flags, round)) {
+                db_close(database);
+                return false;
+            }
+        }
+    }
+    db_close(database);
+    return true;
+}
+
+int main(void) {
+    const unsigned flags[] = {0, DB_BATCH, DB_SHARDS};
+    int count = 0, words, len, i, j, left;
+
+    for (len = 1, words = LETTERS; len <= MAX_LEN; len++, words *= LETTERS) {
+        for (i = 0; i < words; i++, count++) {  //the letters are the digits of i in base LETTERS
+            for (j = len - 1, left = i; j >= 0; j--, left /= LETTERS)
+                names[count][j] = (char)('a' + left % LETTERS);
+            names[count][len] = '\0';
+        }
+    }
+    qsort(names, NUM_NAMES, sizeof(names[0]), compareWords);
+    for (i = 0; i < (int)(sizeof(flags) / sizeof(flags[0])); i++)
+        if (!runScans(flags[i]))
+            return 1;
+    return 0;
+}
@@ -0,0 +1,204 @@
+// --- SNAPSHOT CORRUPTION FUZZER ---
+/*
+ * restores damaged copies of a snapshot, and uses whatever db_restore accepts: a few words or
+ * bytes are overwritten, in the header or anywhere, with small IDs, NO_ID, neighbours of what
+ * was there or random bytes. Most copies get their checksum computed again, so that the range
+ * checks behind it are the ones tried; the others have to be refused by the checksum. An
+ * accepted copy has its relations loaded, reports printed, a few commands run and is saved
+ * again. Nothing is checked there but that this doesn't crash, so build it with the sanitizers.
+ * Before that, each instance block is damaged in turn, and has to be found out when read: test.sh
+ * builds it like main for that, and runs a few trials. db.c is compiled in, to get at its checksum:
+ *
+ * gcc -std=gnu11 -g -O1 -fsanitize=address,undefined -pthread -o snapshot_fuzz TestCases/snapshot_fuzz.c -lm
+ * ./snapshot_fuzz snapshot [trials] [seed]
+ */
+#include "../db.c"
+
+uint64_t nextRandom(uint64_t *state) {     //splitmix64
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/*
+ * overwrites a byte or an aligned word of the copy, within its first limit bytes
+ */
+void damage(unsigned char *copy, size_t limit, uint32_t ids, uint64_t *state) {
+    uint64_t r = nextRandom(state);
+    size_t offset = (size_t)(r >> 16) % limit;
+    uint32_t word;
+
+    if (r % 4 == 0) {
+        copy[offset] = (unsigned char)(r >> 8);
+        return;
+    }
+    offset &= ~(size_t)3;
+    if (offset + 4 > limit)
+        return;
+    memcpy(&word, copy + offset, 4);
+    switch (r % 4) {
+        case 1: word = (uint32_t)((r >> 8) % (2 * (uint64_t)ids + 2)); break;
+        case 2: word = r & 256 ? NO_ID : 0; break;
+        default: word += r & 256 ? 1 : -1; break;
+    }
+    memcpy(copy + offset, &word, 4);
+}
+
+void countRelation(void *context, const char *relation, size_t relationLen, const char *recipient,
+                   size_t recipientLen, uint32_t count) {
+    const t_slice *name = context;
+
+    (void)recipient, (void)recipientLen, (void)count;
+    if (relationLen == name->len && memcmp(relation, name->ptr, relationLen) == 0)
+        ((t_slice*)context)->len = (size_t)-1;     //seen
+}
+
+/*
+ * each relation with instances in turn has a byte of its block flipped, the checksum of the header
+ * doesn't see it: the snapshot is restored, and once every relation is read the damaged one has
+ * to be missing from the report and gone in a reportdiff, and db_snapshot_error has to tell.
+ * Restored as it is, it has to tell nothing. Returns the relations that didn't go that way
+ */
+unsigned long checkBlocks(const unsigned char *file, size_t size, const char *path) {
+    const t_snapshotHeader *header = (const t_snapshotHeader*)file;
+    const t_storedRelation *records = (const t_storedRelation*)(file + header->relations);
+    unsigned char *copy = malloc(size);
+    unsigned long failed = 0;
+    const char *diff, *gone;
+    char expected[256];
+    db_t *database;
+    t_slice name;
+    size_t len;
+    uint32_t i;
+    FILE *out;
+
+    for (i = 0; i <= header->numRelations; i++) {
+        memcpy(copy, file, size);
+        if (i < header->numRelations) {
+            if (records[i].instancesSize == 0)
+                continue;
+            copy[records[i].instances + records[i].instancesSize / 2] ^= 0x20;
+        }
+        out = fopen(path, "wb");
+        fwrite(copy, 1, size, out);
+        fclose(out);
+        if ((database = db_restore(path, 0)) == NULL) {
+            failed++;
+            continue;
+        }
+        if (i == header->numRelations) {
+            db_report_iter(database, countRelation, &(t_slice){"", 0});
+            failed += db_snapshot_error(database) != 0;
+            db_close(database);
+            break;
+        }
+        name.ptr = db_name(database, records[i].name, &name.len);
+        snprintf(expected, sizeof(expected), "\"%.*s\" none; ", (int)name.len, name.ptr);
+        db_report_iter(database, countRelation, &name);
+        diff = db_reportdiff(database, &len);
+        gone = memmem(diff, len, expected, strlen(expected));
+        if (db_snapshot_error(database) != EBADMSG || name.len == (size_t)-1 || gone == NULL) {
+            printf("relation %u: damaged block %s\n", i, db_snapshot_error(database) != EBADMSG ? "not told" :
+                   name.len == (size_t)-1 ? "still reported" : "not gone in reportdiff");
+            failed++;
+        }
+        db_close(database);
+    }
+    free(copy);
+    return failed;
+}
+
+/*
+ * what a command line run would do with the database: every relation, the reports, a few
+ * deletions and additions over the names it has, and a save
+ */
+void useRestored(db_t *database, const char *savePath, uint64_t *state) {
+    size_t len, names = db_names(database), nameLen[3] = {0, 0, 0};
+    char name[3][64];
+    const char *stored;
+    int i, j;
+
+    db_report(database, &len);
+    db_reportdiff(database, &len);
+    for (i = 0; i < 32 && names > 0; i++) {
+        for (j = 0; j < 3; j++) {   //copied, the pool moves when a name is added
+            stored = db_name(database, (db_name_t)(nextRandom(state) % names), &nameLen[j]);
+            nameLen[j] = nameLen[j] < sizeof(name[j]) ? nameLen[j] : sizeof(name[j]);
+            memcpy(name[j], stored, nameLen[j]);
+        }
+        switch (i % 4) {
+            case 0: db_addrel(database, name[0], nameLen[0], name[1], nameLen[1], name[2], nameLen[2]); break;
+            case 1: db_delrel(database, name[0], nameLen[0], name[1], nameLen[1], name[2], nameLen[2]); break;
+            case 2: db_delent(database, name[0], nameLen[0]); break;
+            default: db_addent(database, name[0], nameLen[0]); break;
+        }
+        if (i % 8 == 7)
+            db_reportdiff(database, &len);
+    }
+    db_droprel(database, name[2], nameLen[2]);
+    db_report(database, &len);
+    db_save(database, savePath);
+}
+
+int main(int argc, char **argv) {
+    unsigned long trials = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000, trial, accepted = 0, signedCopies = 0;
+    uint64_t state = argc > 3 ? strtoull(argv[3], NULL, 10) : 1;
+    char path[64], savePath[64];
+    unsigned char *file, *copy;
+    t_snapshotHeader header;
+    db_t *database;
+    size_t size, limit;
+    uint32_t ids;
+    FILE *in;
+    int i, damages;
+
+    if (argc < 2 || (in = fopen(argv[1], "rb")) == NULL) {
+        fprintf(stderr, "usage: %s snapshot [trials] [seed]\n", argv[0]);
+        return 2;
+    }
+    fseek(in, 0, SEEK_END);
+    size = (size_t)ftell(in);
+    rewind(in);
+    file = malloc(size);
+    copy = malloc(size);
+    if (size < sizeof(header) || fread(file, 1, size, in) != size || !checkSnapshot(file, size)) {
+        fprintf(stderr, "%s: not a snapshot of this build\n", argv[1]);
+        return 2;
+    }
+    fclose(in);
+    memcpy(&header, file, sizeof(header));
+    ids = header.numNames > header.numEntities ? header.numNames : header.numEntities;
+    snprintf(path, sizeof(path), "/tmp/snapshot_fuzz.%d", (int)getpid());
+    snprintf(savePath, sizeof(savePath), "/tmp/snapshot_fuzz.%d.saved", (int)getpid());
+    if (checkBlocks(file, size, path) != 0) {
+        unlink(path);
+        return 1;
+    }
+
+    for (trial = 0; trial < trials; trial++) {
+        memcpy(copy, file, size);
+        limit = nextRandom(&state) % 2 ? sizeof(header) : size;
+        damages = 1 + (int)(nextRandom(&state) % 4);
+        for (i = 0; i < damages; i++)
+            damage(copy, limit, ids, &state);
+        if (nextRandom(&state) % 8 != 0 && checkBounds(copy, size)) {
+            ((t_snapshotHeader*)copy)->checksum = snapshotChecksum(copy);
+            signedCopies++;
+        }
+        in = fopen(path, "wb");
+        fwrite(copy, 1, size, in);
+        fclose(in);
+        if ((database = db_restore(path, trial % 3 == 0 ? DB_BATCH : 0)) == NULL)
+            continue;
+        accepted++;
+        useRestored(database, savePath, &state);
+        db_close(database);
+    }
+    unlink(path);
+    unlink(savePath);
+    printf("%lu copies, %lu with their checksum computed again, %lu accepted\n", trials, signedCopies, accepted);
+    free(file);
+    free(copy);
+    return 0;
+}
@@ -0,0 +1,162 @@
+// --- GENERIC AVL TREE ---
+/*
+ * An intrusive AVL tree, instantiated for a node type by AVL_TREE(name, type, keyType, compare).
+ * The node type must have the fields leftChild, rightChild (pointers to the type) and height
+ * (int, 1 for a leaf); what else it holds is up to the user, nodes are allocated and freed by
+ * the caller. compare(key, node) returns <0, 0 or >0 like strcmp, and is called once per level.
+ *
+ * Insertion and deletion are iterative: the descent records the address of every child pointer
+ * it goes through, and the rebalancing climbs back along it, stopping as soon as a subtree keeps
+ * its height. Nodes are never copied: a deleted node with two children is replaced by relinking
+ * its successor, so pointers to the other nodes stay valid.
+ *
+ * The instantiation defines:
+ *   name##Path                        where a missing key would go, filled by Locate
+ *   type *name##Find(root, key)       the node with the key, NULL if absent
+ *   type *name##Locate(&root, key, &path)
+ *                                     same as Find, but when the key is absent the path can be
+ *                                     passed to InsertAt: insert-or-find in a single descent
+ *   void name##InsertAt(&path, node)  links the node where Locate left off, then rebalances
+ *   type *name##Insert(&root, key, node)
+ *                                     links the node if the key is absent, returns the node that
+ *                                     has the key
+ *   type *name##Remove(&root, key)    unlinks the node with the key and returns it, NULL if absent
+ */
+#ifndef AVL_H
+#define AVL_H
+
+#include <stddef.h>
+
+#define AVL_MAX_HEIGHT 64   //an AVL tree this high would have more than 2^44 nodes
+#define AVL_HEIGHT(node) ((node) == NULL ? 0 : (node)->height)
+#define AVL_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define AVL_TREE(name, type, keyType, compare)                                                    \
+typedef struct {                                                                                  \
+    type **links[AVL_MAX_HEIGHT + 1];   /* links[depth] is the empty child pointer */             \
+    int depth;                                                                                    \
+} name##Path;                                                                                     \
+                                                                                                  \
+static inline type *name##RotateLeft(type *node) {                                                \
+    type *right = node->rightChild;                                                               \
+    node->rightChild = right->leftChild;                                                          \
+    right->leftChild = node;                                                                      \
+    node->height = AVL_MAX(AVL_HEIGHT(node->leftChild), AVL_HEIGHT(node->rightChild)) + 1;        \
+    right->height = AVL_MAX(node->height, AVL_HEIGHT(right->rightChild)) + 1;                     \
+    return right;                                                                                 \
+}                                                                                                 \
+                                                                                                  \
+static inline type *name##RotateRight(type *node) {                                               \
+    type *left = node->leftChild;                                                                 \
+    node->leftChild = left->rightChild;                                                           \
+    left->rightChild = node;                                                                      \
+    node->height = AVL_MAX(AVL_HEIGHT(node->leftChild), AVL_HEIGHT(node->rightChild)) + 1;        \
+    left->height = AVL_MAX(AVL_HEIGHT(left->leftChild), node->height) + 1;                        \
+    return left;                                                                                  \
+}                                                                                                 \
+                                                                                                  \
+/* fixes the node in *link, returns true if the height of the subtree changed */                  \
+static inline int name##Rebalance(type **link) {                                                  \
+    type *node = *link;                                                                           \
+    int height = node->height;                                                                    \
+    int left = AVL_HEIGHT(node->leftChild), right = AVL_HEIGHT(node->rightChild);                 \
+                                                                                                  \
+    if (left - right > 1) {                                                                       \
+        if (AVL_HEIGHT(node->leftChild->leftChild) < AVL_HEIGHT(node->leftChild->rightChild))     \
+            node->leftChild = name##RotateLeft(node->leftChild);                                  \
+        *link = name##RotateRight(node);                                                          \
+    }                                                                                             \
+    else if (right - left > 1) {                                                                  \
+        if (AVL_HEIGHT(node->rightChild->rightChild) < AVL_HEIGHT(node->rightChild->leftChild))   \
+            node->rightChild = name##RotateRight(node->rightChild);                               \
+        *link = name##RotateLeft(node);                                                           \
+    }                                                                                             \
+    else                                                                                          \
+        node->height = AVL_MAX(left, right) + 1;                                                  \
+    return (*link)->height != height;                                                             \
+}                                                                                                 \
+                                                                                                  \
+static inline type *name##Find(type *node, keyType key) {                                         \
+    int order;                                                                                    \
+                                                                                                  \
+    while (node != NULL && (order = compare(key, node)) != 0)                                     \
+        node = order < 0 ? node->leftChild : node->rightChild;                                    \
+    return node;                                                                                  \
+}                                                                                                 \
+                                                                                                  \
+static inline type *name##Locate(type **root, keyType key, name##Path *path) {                    \
+    type **link = root;                                                                           \
+    int order, depth = 0;                                                                         \
+                                                                                                  \
+    while (*link != NULL) {                                                                       \
+        if ((order = compare(key, *link)) == 0) {                                                 \
+            path->depth = depth;    /* unused when found, but never left unset */                 \
+            return *link;                                                                         \
+        }                                                                                         \
+        path->links[depth++] = link;                                                              \
+        link = order < 0 ? &(*link)->leftChild : &(*link)->rightChild;                            \
+    }                                                                                             \
+    path->links[depth] = link;                                                                    \
+    path->depth = depth;                                                                          \
+    return NULL;                                                                                  \
+}                                                                                                 \
+                                                                                                  \
+static inline void name##InsertAt(name##Path *path, type *node) {                                 \
+    int depth = path->depth;                                                                      \
+                                                                                                  \
+    node->leftChild = NULL;                                                                       \
+    node->rightChild = NULL;                                                                      \
+    node->height = 1;                                                                             \
+    *path->links[depth] = node;                                                                   \
+    while (--depth >= 0 && name##Rebalance(path->links[depth]))                                   \
+        ;                                                                                         \
+}                                                                                                 \
+                                                                                                  \
+static inline type *name##Insert(type **root, keyType key, type *node) {                          \
+    name##Path path;                                                                              \
+    type *found = name##Locate(root, key, &path);                                                 \
+                                                                                                  \
+    if (found != NULL)                                                                            \
+        return found;                                                                             \
+    name##InsertAt(&path, node);                                                                  \
+    return node;                                                                                  \
+}                                                                                                 \
+                                                                                                  \
+static inline type *name##Remove(type **root, keyType key) {                                      \
+    type **links[AVL_MAX_HEIGHT + 1];                                                             \
+    type **link = root, **next, *node, *successor;                                                \
+    int order, depth = 0, at;                                                                     \
+                                                                                                  \
+    while ((node = *link) != NULL && (order = compare(key, node)) != 0) {                         \
+        links[depth++] = link;                                                                    \
+        link = order < 0 ? &node->leftChild : &node->rightChild;                                  \
+    }                                                                                             \
+    if (node == NULL)                                                                             \
+        return NULL;                                                                              \
+                                                                                                  \
+    if (node->leftChild == NULL || node->rightChild == NULL)                                      \
+        *link = node->leftChild != NULL ? node->leftChild : node->rightChild;                     \
+    else {      /* the successor takes the place of the node */                                   \
+        at = depth;                                                                               \
+        links[depth++] = link;                                                                    \
+        next = &node->rightChild;                                                                 \
+        while ((*next)->leftChild != NULL) {                                                      \
+            links[depth++] = next;                                                                \
+            next = &(*next)->leftChild;                                                           \
+        }                                                                                         \
+        successor = *next;                                                                        \
+        *next = successor->rightChild;                                                            \
+        successor->leftChild = node->leftChild;                                                   \
+        successor->rightChild = node->rightChild;                                                 \
+        successor->height = node->height;                                                         \
+        *link = successor;                                                                        \
+        if (depth > at + 1)     /* the path went through the right child of the node */           \
+            links[at + 1] = &successor->rightChild;                                               \
+    }                                                                                             \
+                                                                                                  \
+    while (--depth >= 0 && name##Rebalance(links[depth]))                                         \
+        ;                                                                                         \
+    return node;                                                                                  \
+}
+
+#endif
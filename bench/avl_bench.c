@@ -0,0 +1,255 @@
+// --- AVL MICROBENCHMARK ---
+/*
+ * times the generic tree of avl.h against the recursive AVL code main.c used before it (one copy
+ * per node type, heights through helper calls, two comparisons per level on the way back up).
+ * Both trees hold the same keys, inserted, looked up and removed in the same random order;
+ * the result is the average time per operation.
+ *
+ * gcc -std=gnu11 -O2 -o avl_bench bench/avl_bench.c && ./avl_bench [nodes] [rounds]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "../avl.h"
+
+typedef struct _node {
+    struct _node *rightChild;
+    struct _node *leftChild;
+    int height;
+    uint64_t key;
+} t_node;
+
+int compareNode(uint64_t key, const t_node *node) {
+    return key < node->key ? -1 : key > node->key;
+}
+
+AVL_TREE(benchTree, t_node, uint64_t, compareNode)
+
+
+// --- RECURSIVE BASELINE ---
+
+int max(int x, int y) {
+    if (x > y)
+        return x;
+    return y;
+}
+
+int getHeight(t_node *node) {
+    if (node == NULL)
+        return 0;
+    return node->height;
+}
+
+int getBalance(t_node *node) {
+    if (node == NULL)
+        return 0;
+    return getHeight(node->leftChild) - getHeight(node->rightChild);
+}
+
+t_node *rotateLeft(t_node *node) {
+    t_node *ret = node->rightChild;
+    t_node *temp = ret->leftChild;
+    ret->leftChild = node;
+    node->rightChild = temp;
+    node->height = max(getHeight(node->leftChild), getHeight(node->rightChild)) + 1;
+    ret->height = max(getHeight(ret->leftChild), getHeight(ret->rightChild)) + 1;
+    return ret;
+}
+
+t_node *rotateRight(t_node *node) {
+    t_node *ret = node->leftChild;
+    t_node *temp = ret->rightChild;
+    ret->rightChild = node;
+    node->leftChild = temp;
+    node->height = max(getHeight(node->leftChild), getHeight(node->rightChild)) + 1;
+    ret->height = max(getHeight(ret->leftChild), getHeight(ret->rightChild)) + 1;
+    return ret;
+}
+
+t_node *minValueNode(t_node *node) {
+    while (node->leftChild != NULL)
+        node = node->leftChild;
+    return node;
+}
+
+t_node *addToTree(t_node *node, t_node *newNode) {
+    int cmp;
+
+    if (node == NULL) {
+        newNode->rightChild = NULL;
+        newNode->leftChild = NULL;
+        newNode->height = 1;
+        return newNode;
+    }
+    else if ((cmp = compareNode(newNode->key, node)) < 0)
+        node->leftChild = addToTree(node->leftChild, newNode);
+    else if (cmp > 0)
+        node->rightChild = addToTree(node->rightChild, newNode);
+    else
+        return node;
+
+    node->height = max(getHeight(node->rightChild), getHeight(node->leftChild)) + 1;
+
+    if (getBalance(node) > 1) {
+        if (compareNode(newNode->key, node->leftChild) < 0)
+            return rotateRight(node);
+        else {
+            node->leftChild = rotateLeft(node->leftChild);
+            return rotateRight(node);
+        }
+    }
+    else if (getBalance(node) < -1) {
+        if (compareNode(newNode->key, node->rightChild) > 0)
+            return rotateLeft(node);
+        else {
+            node->rightChild = rotateRight(node->rightChild);
+            return rotateLeft(node);
+        }
+    }
+    return node;
+}
+
+t_node *findInTree(t_node *node, uint64_t key) {
+    int cmp;
+
+    while (node != NULL && (cmp = compareNode(key, node)) != 0)
+        node = cmp < 0 ? node->leftChild : node->rightChild;
+    return node;
+}
+
+/*
+ * the nodes come from an array here, so deleting copies the key and leaves the node where it is
+ */
+t_node *delFromTree(t_node *node, uint64_t key) {
+    int cmp;
+
+    if (node == NULL)
+        return node;
+
+    if ((cmp = compareNode(key, node)) < 0)
+        node->leftChild = delFromTree(node->leftChild, key);
+    else if (cmp > 0)
+        node->rightChild = delFromTree(node->rightChild, key);
+    else {
+        if (node->leftChild == NULL || node->rightChild == NULL)
+            return node->leftChild ? node->leftChild : node->rightChild;
+        t_node *temp = minValueNode(node->rightChild);
+        node->key = temp->key;
+        node->rightChild = delFromTree(node->rightChild, temp->key);
+    }
+
+    node->height = max(getHeight(node->rightChild), getHeight(node->leftChild)) + 1;
+
+    if (getBalance(node) > 1) {
+        if (getBalance(node->leftChild) >= 0)
+            return rotateRight(node);
+        else {
+            node->leftChild = rotateLeft(node->leftChild);
+            return rotateRight(node);
+        }
+    }
+    else if (getBalance(node) < -1) {
+        if (getBalance(node->rightChild) <= 0)
+            return rotateLeft(node);
+        else {
+            node->rightChild = rotateRight(node->rightChild);
+            return rotateLeft(node);
+        }
+    }
+    return node;
+}
+
+
+// --- DRIVER ---
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+uint64_t nextRandom(uint64_t *state) {     //splitmix64
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+void shuffle(uint64_t *keys, size_t n, uint64_t *state) {
+    size_t i, j;
+    uint64_t temp;
+
+    for (i = n - 1; i > 0; i--) {
+        j = nextRandom(state) % (i + 1);
+        temp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = temp;
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 3;
+    t_node *nodes = malloc(n * sizeof(t_node));
+    uint64_t *keys = malloc(n * sizeof(uint64_t));
+    uint64_t state = 42, found = 0;
+    double start, times[2][3] = {{0}};
+    t_node *root;
+    size_t i;
+    int r;
+
+    for (i = 0; i < n; i++)
+        keys[i] = nextRandom(&state);
+
+    for (r = 0; r < rounds; r++) {
+        shuffle(keys, n, &state);
+        root = NULL;
+        start = now();
+        for (i = 0; i < n; i++) {
+            nodes[i].key = keys[i];
+            benchTreeInsert(&root, keys[i], &nodes[i]);
+        }
+        times[0][0] += now() - start;
+        shuffle(keys, n, &state);
+        start = now();
+        for (i = 0; i < n; i++)
+            found += benchTreeFind(root, keys[i]) != NULL;
+        times[0][1] += now() - start;
+        shuffle(keys, n, &state);
+        start = now();
+        for (i = 0; i < n; i++)
+            found += benchTreeRemove(&root, keys[i]) != NULL;
+        times[0][2] += now() - start;
+
+        shuffle(keys, n, &state);
+        root = NULL;
+        start = now();
+        for (i = 0; i < n; i++) {
+            nodes[i].key = keys[i];
+            root = addToTree(root, &nodes[i]);
+        }
+        times[1][0] += now() - start;
+        shuffle(keys, n, &state);
+        start = now();
+        for (i = 0; i < n; i++)
+            found += findInTree(root, keys[i]) != NULL;
+        times[1][1] += now() - start;
+        shuffle(keys, n, &state);
+        start = now();
+        for (i = 0; i < n; i++)
+            root = delFromTree(root, keys[i]);
+        times[1][2] += now() - start;
+    }
+
+    printf("%zu nodes, %d rounds (%llu found)\n", n, rounds, (unsigned long long)found);
+    printf("%-10s %10s %10s %10s\n", "ns/op", "insert", "find", "remove");
+    printf("%-10s %10.1f %10.1f %10.1f\n", "avl.h", times[0][0] * 1e9 / n / rounds,
+           times[0][1] * 1e9 / n / rounds, times[0][2] * 1e9 / n / rounds);
+    printf("%-10s %10.1f %10.1f %10.1f\n", "recursive", times[1][0] * 1e9 / n / rounds,
+           times[1][1] * 1e9 / n / rounds, times[1][2] * 1e9 / n / rounds);
+    free(nodes);
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,74 @@
+// --- INSTANCE INDEX BENCHMARK ---
+/*
+ * times the two instance indexes of the engine on a relation with a million recipients: lookups
+ * of random recipients, then reports of the bucket holding all of them, with the sorted cache and
+ * the rendered report dropped before each one so that every report rebuilds them. db.c is
+ * compiled in, to get at its internals, so build once per backend:
+ *
+ * gcc -std=gnu11 -O2 -DINSTANCE_INDEX=INSTANCE_INDEX_AVL -pthread -o instance_avl bench/instance_bench.c
+ * gcc -std=gnu11 -O2 -DINSTANCE_INDEX=INSTANCE_INDEX_BTREE -pthread -o instance_btree bench/instance_bench.c
+ * ./instance_avl [recipients] [lookups] [reports]
+ */
+#include "../db.c"
+#include <time.h>
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+uint64_t nextRandom(uint64_t *state) {     //splitmix64
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t lookups = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000000;
+    int reports = argc > 3 ? atoi(argv[3]) : 5;
+    t_id *recipients = malloc(n * sizeof(t_id));
+    db_t *database = db_open(0);
+    uint64_t state = 42, found = 0;
+    double start, insertTime, lookupTime, reportTime = 0;
+    char name[32];
+    t_id sender, rel;
+    size_t i, len;
+    int r;
+
+    sender = insertEntity(db_intern(database, "sender", 6));
+    rel = getRelation(db_intern(database, "follows", 7), true);
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "%016llx_user", (unsigned long long)nextRandom(&state));
+        recipients[i] = insertEntity(db_intern(database, name, strlen(name)));
+    }
+
+    start = now();
+    for (i = 0; i < n; i++)
+        linkEntities(rel, sender, recipients[i]);
+    insertTime = now() - start;
+
+    start = now();
+    for (i = 0; i < lookups; i++)
+        found += findInstance(RELATION(rel), recipients[nextRandom(&state) % n]) != NULL;
+    lookupTime = now() - start;
+
+    for (r = 0; r < reports; r++) {
+        RELATION(rel)->top->isSorted = false;
+        touchRelation(RELATION(rel));
+        start = now();
+        db_report(database, &len);
+        reportTime += now() - start;
+    }
+
+    fprintf(stderr, "%s index, %zu recipients (%llu found)\n",
+            INSTANCE_INDEX == INSTANCE_INDEX_BTREE ? "B+ tree" : "AVL", n, (unsigned long long)found);
+    fprintf(stderr, "insert %10.1f ns/op\n", insertTime * 1e9 / n);
+    fprintf(stderr, "lookup %10.2f M/s\n", lookups / lookupTime * 1e-6);
+    fprintf(stderr, "report %10.1f ms\n", reportTime * 1e3 / reports);
+    free(recipients);
+    db_close(database);
+    return 0;
+}
@@ -0,0 +1,118 @@
+// --- PIPELINE BENCHMARK ---
+/*
+ * times the whole program with and without --pipeline, on the files given and on a synthetic
+ * input of random entity and relation commands with a report every few thousand. main.c is
+ * compiled in with its main renamed, and each run is a child process of its own, fed through a
+ * pipe (where the parser thread overlaps the reads) and from the file itself (mapped, nothing to
+ * overlap but the parsing and the writes). The result is the best of the runs, in ms.
+ *
+ * gcc -std=gnu11 -O2 -pthread -o pipeline_bench bench/pipeline_bench.c db.c -lm
+ * ./pipeline_bench [commands] [runs] [files...]
+ */
+#define main mainCli
+#include "../main.c"
+#undef main
+#include <sys/wait.h>
+
+#define SYNTH_ENTITIES 200000
+#define SYNTH_RELATIONS 64
+#define SYNTH_REPORT_EVERY 20000
+
+uint64_t nextRandom(uint64_t *state) {     //splitmix64
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/*
+ * every entity added first, then mostly addrel, some delrel, a few entities deleted and added again
+ */
+void writeSynthetic(FILE *out, size_t commands) {
+    uint64_t state = 42, r;
+    size_t i;
+
+    for (i = 0; i < SYNTH_ENTITIES; i++)
+        fprintf(out, "addent \"%016llx_user\"\n", (unsigned long long)(i * 0x9E3779B97F4A7C15ull));
+    for (i = 0; i < commands; i++) {
+        r = nextRandom(&state);
+        if (i % SYNTH_REPORT_EVERY == SYNTH_REPORT_EVERY - 1)
+            fprintf(out, "report\n");
+        else if (r % 100 < 95)
+            fprintf(out, "%s \"%016llx_user\" \"%016llx_user\" \"rel_%llu\"\n", r % 100 < 70 ? "addrel" : "delrel",
+                    (unsigned long long)((r >> 8) % SYNTH_ENTITIES * 0x9E3779B97F4A7C15ull),
+                    (unsigned long long)((r >> 32) % SYNTH_ENTITIES * 0x9E3779B97F4A7C15ull),
+                    (unsigned long long)(r >> 56) % SYNTH_RELATIONS);
+        else
+            fprintf(out, "%s \"%016llx_user\"\n", r % 2 ? "delent" : "addent",
+                    (unsigned long long)((r >> 8) % SYNTH_ENTITIES * 0x9E3779B97F4A7C15ull));
+    }
+}
+
+/*
+ * one run of the program on the file, output to /dev/null; a feeder process writes the file into
+ * the pipe, a block at a time
+ */
+double runCli(const char *path, bool viaPipe, bool pipelined) {
+    char *args[] = {"main", pipelined ? "--pipeline" : NULL, NULL};
+    int fd, pipeFds[2], status;
+    char block[1 << 16];
+    ssize_t len;
+    double start = now();
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        fd = open(path, O_RDONLY);
+        if (viaPipe) {
+            if (pipe(pipeFds) < 0)
+                _exit(1);
+            if (fork() == 0) {
+                close(pipeFds[0]);
+                dup2(pipeFds[1], STDOUT_FILENO);
+                while ((len = read(fd, block, sizeof(block))) > 0)
+                    writeAll(block, len);
+                _exit(0);
+            }
+            close(pipeFds[1]);
+            close(fd);
+            fd = pipeFds[0];
+        }
+        dup2(fd, STDIN_FILENO);
+        dup2(open("/dev/null", O_WRONLY), STDOUT_FILENO);
+        exit(mainCli(pipelined ? 2 : 1, args));
+    }
+    waitpid(pid, &status, 0);
+    return now() - start;
+}
+
+void benchFile(const char *path, const char *label, int runs) {
+    double best[2][2] = {{1e9, 1e9}, {1e9, 1e9}}, time;
+    int r, viaPipe, pipelined;
+
+    for (r = 0; r < runs; r++)
+        for (viaPipe = 0; viaPipe < 2; viaPipe++)
+            for (pipelined = 0; pipelined < 2; pipelined++)
+                if ((time = runCli(path, viaPipe, pipelined)) < best[viaPipe][pipelined])
+                    best[viaPipe][pipelined] = time;
+    for (viaPipe = 0; viaPipe < 2; viaPipe++)
+        printf("%-32s %-6s %10.1f %10.1f %8.2fx\n", label, viaPipe ? "pipe" : "file", best[viaPipe][0] * 1e3,
+               best[viaPipe][1] * 1e3, best[viaPipe][0] / best[viaPipe][1]);
+}
+
+int main(int argc, char **argv) {
+    size_t commands = argc > 1 ? strtoul(argv[1], NULL, 10) : 5000000;
+    int runs = argc > 2 ? atoi(argv[2]) : 3;
+    char path[] = "/tmp/pipeline_benchXXXXXX";
+    int fd = mkstemp(path), i;
+    FILE *out = fdopen(fd, "w");
+
+    writeSynthetic(out, commands);
+    fclose(out);
+    printf("%d CPUs online\n", (int)sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-32s %-6s %10s %10s %9s\n", "input", "via", "ms", "pipeline", "speedup");
+    for (i = 3; i < argc; i++)
+        benchFile(argv[i], strrchr(argv[i], '/') != NULL ? strrchr(argv[i], '/') + 1 : argv[i], runs);
+    benchFile(path, "synthetic", runs);
+    unlink(path);
+    return 0;
+}
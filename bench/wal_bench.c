@@ -0,0 +1,153 @@
+// --- WRITE-AHEAD LOG BENCHMARK ---
+/*
+ * times the commands through the library with no log, then logged under each durability: every
+ * entity added, then mostly addrel, some delrel, a few entities deleted and added again, as
+ * pipeline_bench generates them, without the reports. Each setting starts from an empty
+ * directory and prints the commands per second, the groups written and the fsyncs per thousand
+ * commands, then the time db_recover takes on what it left behind: the whole log, or the last
+ * checkpoint and the log after it. DB_SYNC_ALWAYS only runs the first ALWAYS_COMMANDS commands.
+ * The directory should be on the disk the log would go to, tmpfs fsyncs for free.
+ *
+ * gcc -std=gnu11 -O2 -pthread -o wal_bench bench/wal_bench.c db.c -lm
+ * ./wal_bench [commands] [directory]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include "../db.h"
+
+#define SYNTH_ENTITIES 200000
+#define SYNTH_RELATIONS 64
+#define ALWAYS_COMMANDS 20000
+
+typedef struct _setting {
+    const char *label;
+    bool logged;
+    db_durability_t durability;
+} t_setting;
+
+const t_setting settings[] = {
+    {"no log", false, {0, 0, 0, 0}},
+    {"none, 64 KiB groups", true, {DB_SYNC_NONE, 1 << 16, 0, 0}},
+    {"group, 4 KiB", true, {DB_SYNC_GROUP, 1 << 12, 0, 0}},
+    {"group, 64 KiB", true, {DB_SYNC_GROUP, 1 << 16, 0, 0}},
+    {"group, 64 KiB or 2 ms", true, {DB_SYNC_GROUP, 1 << 16, 2000, 0}},
+    {"group, 64 KiB or 2 ms, ckpt 2 MiB", true, {DB_SYNC_GROUP, 1 << 16, 2000, 2 << 20}},
+    {"always", true, {DB_SYNC_ALWAYS, 0, 0, 0}},
+};
+
+char names[SYNTH_ENTITIES][24];
+char relations[SYNTH_RELATIONS][16];
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+uint64_t nextRandom(uint64_t *state) {     //splitmix64
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/*
+ * the same commands for every setting, the first count of them
+ */
+void runCommands(db_t *database, size_t count) {
+    uint64_t state = 42, r;
+    size_t i;
+    const char *sender, *recipient, *relation;
+
+    for (i = 0; i < SYNTH_ENTITIES && i < count; i++)
+        db_addent(database, names[i], strlen(names[i]));
+    for (; i < count; i++) {
+        r = nextRandom(&state);
+        sender = names[(r >> 8) % SYNTH_ENTITIES];
+        recipient = names[(r >> 32) % SYNTH_ENTITIES];
+        relation = relations[(r >> 56) % SYNTH_RELATIONS];
+        if (r % 100 < 70)
+            db_addrel(database, sender, strlen(sender), recipient, strlen(recipient), relation, strlen(relation));
+        else if (r % 100 < 95)
+            db_delrel(database, sender, strlen(sender), recipient, strlen(recipient), relation, strlen(relation));
+        else if (r % 2)
+            db_delent(database, sender, strlen(sender));
+        else
+            db_addent(database, sender, strlen(sender));
+    }
+}
+
+/*
+ * the counters of the log, from the line db_stats prints for them
+ */
+void logCounters(db_t *database, unsigned long long *groups, unsigned long long *syncs) {
+    char *text, *line;
+    size_t len;
+    FILE *out = open_memstream(&text, &len);
+
+    *groups = *syncs = 0;
+    db_stats(database, out);
+    fclose(out);
+    if ((line = strstr(text, "log: ")) != NULL)
+        sscanf(line, "log: %*u commands, %llu groups, %llu fsyncs", groups, syncs);
+    free(text);
+}
+
+void benchSetting(const t_setting *setting, size_t commands, const char *path, const char *logPath) {
+    unsigned long long groups = 0, syncs = 0;
+    double start, runTime, recoverTime = 0;
+    db_t *database;
+    size_t count = setting->durability.sync == DB_SYNC_ALWAYS && commands > ALWAYS_COMMANDS ? ALWAYS_COMMANDS : commands;
+
+    unlink(path);
+    unlink(logPath);
+    start = now();
+    database = setting->logged ? db_recover(path, 0, &setting->durability) : db_open(0);
+    if (database == NULL) {
+        perror(path);
+        exit(1);
+    }
+    runCommands(database, count);
+    if (setting->logged && db_sync(database) != 0) {
+        fprintf(stderr, "%s: the log failed\n", logPath);
+        exit(1);
+    }
+    runTime = now() - start;
+    logCounters(database, &groups, &syncs);
+    db_close(database);
+    if (setting->logged) {
+        start = now();
+        database = db_recover(path, 0, &setting->durability);
+        recoverTime = now() - start;
+        db_close(database);
+    }
+    printf("%-36s %10zu %12.0f %10.2f %10.2f %10.1f\n", setting->label, count, count / runTime,
+           groups * 1e3 / count, syncs * 1e3 / count, recoverTime * 1e3);
+    unlink(path);
+    unlink(logPath);
+}
+
+int main(int argc, char **argv) {
+    size_t commands = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+    const char *directory = argc > 2 ? argv[2] : ".";
+    char path[4096], logPath[4200];
+    size_t i;
+
+    snprintf(path, sizeof(path), "%s/wal_bench.db", directory);
+    snprintf(logPath, sizeof(logPath), "%s.wal", path);
+    for (i = 0; i < SYNTH_ENTITIES; i++)
+        snprintf(names[i], sizeof(names[i]), "%016llx_user", (unsigned long long)(i * 0x9E3779B97F4A7C15ull));
+    for (i = 0; i < SYNTH_RELATIONS; i++)
+        snprintf(relations[i], sizeof(relations[i]), "rel_%zu", i);
+    printf("%-36s %10s %12s %10s %10s %10s\n", "durability", "commands", "commands/s", "groups/k", "fsyncs/k",
+           "recover ms");
+    for (i = 0; i < sizeof(settings) / sizeof(settings[0]); i++)
+        benchSetting(&settings[i], commands, path, logPath);
+    return 0;
+}
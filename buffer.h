@@ -0,0 +1,72 @@
+// --- BYTE BUFFERS ---
+/*
+ * A growable array of bytes, shared by the engine (the rendered reports) and the command line
+ * (the output, the binary conversion). An empty buffer is all zeros; putBytes appends, doubling
+ * the capacity from 4 KiB when it has to, and size = 0 empties it keeping the memory. The varints
+ * of the binary input, of the snapshots and of the write-ahead log are written by putVarint and
+ * read back by getVarint.
+ */
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_VARINT_SIZE 5   //32-bit values
+
+typedef struct _byteBuffer {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+} t_byteBuffer;
+
+static inline void putBytes(t_byteBuffer *buffer, const void *data, size_t len) {
+    if (buffer->size + len > buffer->capacity) {
+        buffer->capacity = buffer->capacity == 0 ? 4096 : buffer->capacity;
+        while (buffer->size + len > buffer->capacity)
+            buffer->capacity *= 2;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->size, data, len);
+    buffer->size += len;
+}
+
+/*
+ * appends an unsigned LEB128 varint: 7 bits per byte, least significant group first
+ */
+static inline void putVarint(t_byteBuffer *buffer, uint32_t value) {
+    unsigned char bytes[MAX_VARINT_SIZE];
+    size_t len = 0;
+
+    while (value >= 0x80) {
+        bytes[len++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[len++] = (unsigned char)value;
+    putBytes(buffer, bytes, len);
+}
+
+/*
+ * decodes a varint, moving the cursor past it. Returns false if the value is truncated or doesn't
+ * fit in 32 bits
+ */
+static inline bool getVarint(const unsigned char **cursor, const unsigned char *end, uint32_t *value) {
+    uint32_t result = 0;
+    int shift;
+
+    for (shift = 0; *cursor < end && shift < 7 * MAX_VARINT_SIZE; shift += 7) {
+        unsigned char byte = *(*cursor)++;
+        if (shift == 28 && byte > 0x0f)     //the fifth byte only has 4 bits left
+            return false;
+        result |= (uint32_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
@@ -1,2 +1,3 @@
 #!/bin/bash
-/usr/bin/gcc -DEVAL -std=gnu11 -O2 -pipe -static -s -o main main.c -lm
+# extra arguments are passed to gcc, e.g. ./compile.sh -DSCAN_KERNEL=SCAN_KERNEL_SCALAR
+/usr/bin/gcc -DEVAL -std=gnu11 -O2 -pipe -static -s -o main main.c db.c -lm -pthread "$@"
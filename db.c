@@ -0,0 +1,5561 @@
+// --- LIBRARIES ---
+/*
+ * the engine, behind the interface of db.h: every table and tree lives in a t_db, and the
+ * functions work on the current one, db, which each call of the interface sets first (see useDb)
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/auxv.h>
+#include <libgen.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "avl.h"
+#include "buffer.h"
+#include "db.h"
+
+// --- CONSTANTS ---
+
+//name index of the string pool, pick one with -DNAME_INDEX=NAME_INDEX_xxx
+#define NAME_INDEX_HASH 0   //open-addressing hash table
+#define NAME_INDEX_ART 1    //adaptive radix tree, keeps the names sorted
+#ifndef NAME_INDEX
+#define NAME_INDEX NAME_INDEX_HASH
+#endif
+
+#define HASH_TABLE_SIZE 1024    //initial slots of the hash table, a power of 2
+#define HASH_MAX_LOAD 7         //eighths of the slots in use that start a resize
+#define HASH_MIGRATE_STEP 8     //slots moved to the grown table at each insertion
+#ifndef HASH_SEED
+#define HASH_SEED 0     //0 picks a random seed at each run
+#endif
+#ifndef COMPACT_BUDGET
+#define COMPACT_BUDGET 4    //records the compactor looks at after each command, 0 turns it off
+#endif
+#define NODE_ALLOCATOR_MALLOC 0    //a malloc for each node, to compare against
+#define NODE_ALLOCATOR_SLAB 1      //nodes carved from large chunks, one slab per node type
+#ifndef NODE_ALLOCATOR
+#define NODE_ALLOCATOR NODE_ALLOCATOR_SLAB
+#endif
+#define SLAB_CHUNK_SIZE (1 << 21)   //largest chunk of an arena, the size of a huge page
+#define ARENA_FIRST_CHUNK 4096      //the chunks of an arena double from here up to SLAB_CHUNK_SIZE
+#define INSTANCE_INDEX_AVL 0       //every instance is a node of a balanced tree
+#define INSTANCE_INDEX_BTREE 1     //a B+ tree of recipient keys, the instances hang off its leaves
+#ifndef INSTANCE_INDEX
+#define INSTANCE_INDEX INSTANCE_INDEX_BTREE
+#endif
+#define BTREE_KEYS 24       //keys of a B+ tree node, which then takes 504 bytes
+#define BTREE_MAX_DEPTH 16  //a tree this deep would hold more than 12^15 keys
+#define BTREE_SCAN_RATIO 4  //buckets holding over 1/4 of the instances are sorted by a leaf scan
+#define SENDER_INLINE 4     //senders an instance holds by itself, a bigger set gets containers
+#define CONTAINER_ARRAY_MAX 4096    //a container of more senders is a bitmap, one of fewer than half an array
+#define CONTAINER_WORDS 1024        //64-bit words of a bitmap container, one bit per 16-bit ID
+#define EDGES_FIRST 4       //edges an outgoing list starts with
+#define NO_ID UINT32_MAX
+#define ENTITY(id) (&db->entities[id])
+#define RELATION(id) (&db->relations[id])
+#define ENTITY_NAME(id) poolName(db->entities[id].name)
+#define RELATION_NAME(id) poolName(db->relations[id].name)
+#define RELATION_ID(rel) ((t_id)((rel) - db->relations))
+#define KEY_PREFIX_SIZE 8   //bytes of a name packed into a tree key, see makeKey
+
+//radix tree nodes, named after the number of children they can hold
+#define ART_NODE4 0
+#define ART_NODE16 1
+#define ART_NODE48 2
+#define ART_NODE256 3
+#define ART_MAX_PREFIX 8    //compressed path bytes stored in a node, longer paths are checked on a leaf
+//leaves are string IDs stored in the child pointer itself, tagged by the lowest bit
+#define ART_IS_LEAF(child) ((uintptr_t)(child) & 1)
+#define ART_LEAF(id) ((void*)(((uintptr_t)(id) << 1) | 1))
+#define ART_LEAF_ID(child) ((t_id)((uintptr_t)(child) >> 1))
+
+//threads of the worker pool, rendering reports and running --shards; 0 for one per online CPU, 1 for none
+#ifndef WORKER_THREADS
+#define WORKER_THREADS 0
+#endif
+//names a report must have to render before the threads are woken up for it
+#ifndef PARALLEL_RENDER_MIN
+#define PARALLEL_RENDER_MIN 4096
+#endif
+//relation shards of --shards, the tasks the worker pool runs at each barrier
+#ifndef COMMAND_SHARDS
+#define COMMAND_SHARDS 64
+#endif
+//commands queued in the shards for the threads to be woken up for them
+#ifndef PARALLEL_SHARD_MIN
+#define PARALLEL_SHARD_MIN 1024
+#endif
+
+//snapshot files, see saveSnapshot
+#define SNAPSHOT_MAGIC "\x89RDS"
+#define SNAPSHOT_VERSION 4
+#define SNAPSHOT_ALIGN 8    //every section starts at a multiple of it
+
+//write-ahead logs, see logCommand
+#define LOG_MAGIC "\x89RDW"
+#define LOG_VERSION 1
+#define LOG_HEADER_SIZE 16  //magic, version and generation
+#define LOG_FRAME_HEADER 8  //bytes of records of a group and their checksum
+#define LOG_NAME 0x01       //the opcodes of the binary input of main.c; payload: varint length, the name
+#define LOG_ADDENT 0x02     //payload: varint name ID
+#define LOG_DELENT 0x03
+#define LOG_ADDREL 0x04     //payload: varint name IDs of the sender, the recipient and the relation
+#define LOG_DELREL 0x05
+#define LOG_DROPREL 0x09    //payload: varint name ID
+
+
+// --- DATA TYPES DEFINITIONS ---
+
+typedef uint32_t t_id;      //index of a string, an entity or a relation
+
+typedef struct _slice {     //a name as given to the interface, not null-terminated
+    const char *ptr;
+    size_t len;
+} t_slice;
+
+typedef struct _nameSlot {
+    uint32_t hash;      //low bits of the hash of the name, also tell where its probe started
+    t_id name;          //NO_ID if the slot is free
+} t_nameSlot;
+
+typedef struct _nameTable {     //Robin Hood hashing: no slot is further from its start than the one it displaced
+    t_nameSlot *slots;
+    size_t mask;        //slots - 1
+    size_t count;
+} t_nameTable;
+
+typedef struct _indexStats {
+    size_t names;
+    size_t capacity;
+    double loadFactor;
+    double averageProbe;    //slots visited past the first one, over all the names
+    size_t maxProbe;
+    size_t pendingMigration;    //slots of the old table still to move, 0 if no resize is going on
+} t_indexStats;
+
+typedef struct _idStack {  //IDs of reclaimed records, reused before their array grows
+    t_id *ids;
+    t_id count;
+    t_id capacity;
+} t_idStack;
+
+typedef struct _batchName {     //what the pending batch did to a name, if batch is the current one
+    uint32_t batch;
+    uint32_t entityEpoch;       //delents of the entity in the batch, each voids the instances before it
+    uint32_t relationEpoch;     //droprels of the relation, same
+    bool existed;               //the entity existed before the batch
+    bool exists;                //and after the commands buffered so far
+} t_batchName;
+
+typedef struct _batchOp {       //the net effect of the batch on an instance
+    t_id sender;                //names, not entity IDs: entities come and go during the batch
+    t_id recipient;
+    t_id relation;
+    uint32_t senderEpoch;       //the epochs of the names when the instance was last written
+    uint32_t recipientEpoch;
+    uint32_t relationEpoch;
+    uint32_t slot;              //where it is in the hash table
+    bool missing;               //it can't have been there, one of its names was deleted or dropped first
+    bool after;
+} t_batchOp;
+
+typedef struct _batch {         //the commands buffered since the last report, see applyBatch
+    uint32_t serial;            //current batch, starting from 1
+    t_batchName *names;         //by string ID
+    t_id capacityNames;
+    t_idStack touched;          //the names with a t_batchName of this batch
+    t_batchOp *ops;
+    uint32_t numOps;
+    uint32_t capacityOps;
+    uint32_t *slots;            //open addressing on ops: index + 1, 0 if empty
+    uint32_t numSlots;          //power of 2, over twice numOps
+    size_t buffered;            //commands taken in
+    size_t applied;             //commands given to the engine, the rest cancelled out
+} t_batch;
+
+typedef struct _workerPool {    //the threads running the tasks of a round, see runRound
+    pthread_t *threads;
+    int numThreads;             //counting the main thread, which has no entry in threads; 0 until started
+    pthread_mutex_t lock;
+    pthread_cond_t start;       //a new round of tasks is there
+    pthread_cond_t done;        //the last thread finished the round
+    uint32_t round;
+    int working;                //threads still running tasks of this round
+    pthread_once_t started;     //see poolThreads
+    pthread_mutex_t busy;       //held by the thread running a round, databases on other threads wait for it
+    struct _db *db;             //the database of the round, the current one of the threads
+    void (*run)(t_id);          //called with the number of each task of the round
+    t_id numTasks;
+    atomic_uint next;           //first task not taken yet
+} t_workerPool;
+
+
+typedef struct _compactor {
+    t_id nextEntity;    //where the sweep goes on at the next command
+    t_id nextRelation;
+    unsigned long long scanned;     //records looked at
+    unsigned long long entities;    //entity records reclaimed
+    unsigned long long relations;   //relation records reclaimed
+    unsigned long long passes;      //complete sweeps over both arrays
+} t_compactor;
+
+typedef enum _slabType {
+    SLAB_INSTANCE,
+    SLAB_RELATION_TREE,
+    SLAB_BUCKET,
+    SLAB_BTREE_NODE,
+    NUM_SLABS
+} t_slabType;
+
+typedef struct _slab {
+    const char *name;
+    size_t size;        //of a node, freed nodes are linked through their first bytes
+} t_slab;
+
+typedef struct _chunk {
+    struct _chunk *next;
+    size_t size;
+    bool mapped;        //released with munmap rather than free
+} t_chunk;
+
+typedef struct _arena {    //where the nodes of a relation come from, released all at once
+    void *free[NUM_SLABS];      //freed nodes of each type, handed out again before the chunk is touched
+    size_t live[NUM_SLABS];
+    size_t freed[NUM_SLABS];    //nodes on the free lists
+    char *next[NUM_SLABS];      //the part of the last chunk of each type never handed out
+    char *end[NUM_SLABS];
+    size_t chunkSize[NUM_SLABS];    //of the last chunk of each type
+    t_chunk *chunks;
+    size_t reserved;    //bytes of all the chunks
+} t_arena;
+
+typedef struct _stringPool {
+    char *chars;        //every name once, null-terminated, one after the other
+    size_t size;
+    size_t capacity;
+    size_t *offsets;    //where each string ID starts in chars
+    t_id count;
+    t_id capacityIds;
+#if NAME_INDEX == NAME_INDEX_ART
+    void *root;         //radix tree of the names
+#else
+    t_nameTable table;  //where new names go
+    t_nameTable old;    //the table being moved into table while it grows, no slots otherwise
+    size_t migrated;    //slots of old already moved
+    uint64_t seed;
+#endif
+} t_stringPool;
+
+//called on each name found by a scan, with the context given to the scan
+typedef void (*t_nameVisitor)(t_id, void*);
+
+typedef struct _artNode {   //common header of the radix tree nodes
+    unsigned char type;
+    unsigned short int numChildren;
+    uint32_t prefixLen;     //bytes of the compressed path, only the first ART_MAX_PREFIX are stored
+    unsigned char prefix[ART_MAX_PREFIX];
+} t_artNode;
+
+typedef struct _artNode4 {  //keys sorted, same for t_artNode16
+    t_artNode header;
+    unsigned char keys[4];
+    void *children[4];
+} t_artNode4;
+
+typedef struct _artNode16 {
+    t_artNode header;
+    unsigned char keys[16];
+    void *children[16];
+} t_artNode16;
+
+typedef struct _artNode48 {
+    t_artNode header;
+    unsigned char index[256];   //slot + 1 of each key byte in children, 0 if absent
+    void *children[48];
+} t_artNode48;
+
+typedef struct _artNode256 {
+    t_artNode header;
+    void *children[256];
+} t_artNode256;
+
+typedef struct _entityScan {    //see scanEntities
+    t_nameVisitor visit;
+    void *context;
+} t_entityScan;
+
+typedef struct _prefixScan {    //see db_scan_entities
+    db_entity_fn visit;
+    void *context;
+} t_prefixScan;
+
+typedef struct _key {       //order-preserving summary of a name, compared before the name itself
+    uint64_t prefix;        //first KEY_PREFIX_SIZE bytes, big-endian, zero padded
+    uint32_t len;
+} t_key;
+
+typedef struct _treeKey {   //what the trees are searched by, the key prefix comes first
+    uint64_t prefix;
+    t_id id;                //of an entity or a relation
+} t_treeKey;
+
+typedef struct _entity {
+    t_id name;
+    t_key key;
+    unsigned short int version;   //even if valid, odd otherwise
+    struct _relationTree *relations;    //the relations where the entity has been a recipient
+    struct _edge *outgoing;     //the edges where the entity is the sender, some may be stale
+    t_id numOutgoing;
+    t_id capacityOutgoing;
+    t_id staleOutgoing;     //edges whose link has been removed since the last purge
+} t_entity;
+
+typedef struct _container {    //the senders of a set whose IDs share the upper 16 bits
+    uint16_t high;
+    bool bitmap;
+    uint32_t cardinality;   //kept up to date, never recounted
+    uint32_t capacity;      //of the array
+    union {
+        uint16_t *array;    //the lower 16 bits of the IDs, sorted
+        uint64_t *words;    //CONTAINER_WORDS of them
+    };
+} t_container;
+
+typedef struct _senderSet {     //roaring style: sorted by the upper 16 bits of the IDs, then by the rest
+    uint32_t size;
+    uint32_t numContainers;     //0 while the senders are inline
+    union {
+        t_id ids[SENDER_INLINE];    //sorted
+        struct {
+            t_container *containers;
+            uint32_t capacity;
+        };
+    };
+} t_senderSet;
+
+typedef struct _relInstance {
+#if INSTANCE_INDEX == INSTANCE_INDEX_AVL
+    struct _relInstance *rightChild;
+    struct _relInstance *leftChild;
+    int height;
+
+    uint64_t prefix;    //key prefix of the recipient
+#endif
+    t_id recipient;
+    t_senderSet senders;    //its size is the count the buckets go by
+    struct _countBucket *bucket;    //where the recipient is among the others, NULL if it has no senders
+    struct _relInstance *nextInBucket;
+    struct _relInstance *prevInBucket;
+} t_relInstance;
+
+typedef struct _btreeNode {    //the keys are the ones of the recipients, sorted like the AVL tree
+    int count;          //keys in use
+    bool leaf;
+    uint64_t prefix[BTREE_KEYS];
+    t_id id[BTREE_KEYS];
+    union {
+        struct _btreeNode *children[BTREE_KEYS + 1];   //inner nodes: the keys of children[i + 1] are >= key i
+        struct {
+            t_relInstance *instances[BTREE_KEYS];
+            struct _btreeNode *next;    //the leaves are chained in key order
+            struct _btreeNode *prev;
+        };
+    };
+} t_btreeNode;
+
+typedef struct _countBucket {   //the recipients of a relation having the same number of senders
+    int count;
+    t_relInstance *first;   //in no particular order, linked through the instances
+    t_id size;
+    t_id *sorted;           //the recipients by name, only built when the bucket gets printed
+    bool isSorted;          //false if the bucket changed since
+    struct _countBucket *higher;    //the bucket with the next greater count, NULL if this is the top
+    struct _countBucket *lower;
+} t_countBucket;
+
+typedef struct _relation {
+    t_id name;
+    t_key key;
+#if INSTANCE_INDEX == INSTANCE_INDEX_BTREE
+    t_btreeNode *root;
+#else
+    t_relInstance *root;
+#endif
+    t_id numInstances;
+    t_countBucket *top;     //the recipients with the most senders, what the report prints
+    t_countBucket *bottom;
+    t_byteBuffer fragment;  //the part of the report about the relation, as last printed
+    bool dirty;             //the top bucket changed since the fragment was rendered
+    bool changed;           //touched since the last report or reportdiff, in changedRelations
+    t_arena arena;      //instances, index nodes and buckets
+    const unsigned char *stored;    //its instances in the snapshot, NULL once loaded, see loadRelation
+    size_t storedSize;
+    uint64_t storedChecksum;
+} t_relation;
+
+typedef struct _edge {     //a recipient of the sender, still one if the sender is in its instance
+    t_id relation;
+    t_id recipient;
+} t_edge;
+
+typedef struct _senderStats {   //the memory of the sender sets, which is outside the arenas
+    size_t containers;
+    size_t bitmaps;
+    size_t bytes;
+} t_senderStats;
+
+typedef enum _shardEventType {
+    EVENT_ADD_EDGE,         //addEdge(entity, relation, recipient)
+    EVENT_STALE_EDGE,       //an edge of the entity went stale
+    EVENT_JOIN_RELATION,    //the entity got its first sender in the relation
+    EVENT_LEAVE_RELATION,   //and lost its last one
+    EVENT_SKIPPED           //an EVENT_ADD_EDGE whose link was gone by the end of the run
+} t_shardEventType;
+
+typedef struct _shardEvent {    //a change to an entity, which the shards share, made once they are done
+    t_shardEventType type;
+    t_id entity;
+    t_id relation;
+    t_id recipient;
+} t_shardEvent;
+
+typedef struct _shardCommand {
+    db_op_t op;             //DB_ADDREL or DB_DELREL
+    t_id relation;
+    t_id sender;
+    t_id recipient;
+} t_shardCommand;
+
+typedef struct _shard {         //the relations whose ID is the number of the shard, modulo COMMAND_SHARDS
+    t_shardCommand *commands;   //queued since the last barrier, in order
+    uint32_t numCommands;
+    uint32_t capacityCommands;
+    t_shardEvent *events;
+    uint32_t numEvents;
+    uint32_t capacityEvents;
+    t_idStack touched;          //relations touched by the commands, for changedRelations
+    t_senderStats stats;        //what the commands added to the sender sets, senderStats while they run
+} t_shard;
+
+typedef struct _snapshot {      //the file db_restore mapped, the relations not loaded yet point into it
+    void *map;
+    size_t size;
+    t_id pending;               //relations still to load, the file is unmapped after the last one
+} t_snapshot;
+
+typedef struct _snapshotHeader {    //the start of a snapshot file, the sections are at offsets from there
+    char magic[4];              //SNAPSHOT_MAGIC
+    uint32_t version;
+    uint32_t wordSize;          //of size_t, the pool offsets are stored as they are
+    uint32_t numNames;
+    uint64_t size;              //of the file, a shorter one has been cut
+    uint64_t poolSize;          //bytes of the names
+    uint64_t seed;              //of the hash table
+    uint32_t tableSlots;        //0 if the hash table isn't stored
+    uint32_t numEntities;
+    uint32_t numRelations;
+    uint32_t freeEntities;      //IDs on the free lists
+    uint32_t freeRelations;
+    uint64_t names, offsets, table, entityTable, relTable, entities, freeEntityIds, freeRelationIds, relations;
+    uint64_t logGeneration;     //the write-ahead log that goes on from the snapshot, see db_recover
+    uint64_t logOffset;         //and where in it, 0 if the database wasn't logged
+    uint64_t checksum;          //of the sections but the instance blocks, then of the header with 0 here
+} t_snapshotHeader;
+
+typedef struct _storedEntity {
+    t_id name;                  //NO_ID for a record the compactor reclaimed, always first: see checkFreeIds
+    uint32_t version;
+} t_storedEntity;
+
+typedef struct _storedRelation {
+    t_id name;                  //same
+    uint32_t fragmentSize;
+    uint64_t fragment;          //its part of the report, as the report prints it
+    uint64_t instances;         //see putInstances
+    uint64_t instancesSize;     //0 if it has none
+    uint64_t instancesChecksum; //of the instances, checked when they are loaded
+} t_storedRelation;
+
+typedef struct _log {           //the write-ahead log of db_recover, see logCommand
+    bool active;                //commands are logged
+    int fd;                     //-1 if there's no log
+    char *path;                 //of the checkpoints
+    char *logPath;              //path.wal
+    db_durability_t durability;
+    uint64_t generation;        //of the log file, one more at each checkpoint
+    uint64_t size;              //of the log file, where the group goes once written
+    t_byteBuffer group;         //the frame being filled: room for its header, then the records
+    uint64_t groupStart;        //when its first record came, in µs
+    t_id names;                 //names the log defines so far, the next ones come before a command uses them
+    bool unsynced;              //groups were written since the last fsync
+    int error;                  //of the first write or fsync that failed, nothing is logged after it
+    uint64_t commands, groups, syncs, checkpoints;
+    pthread_mutex_t lock;       //taken by the flusher, and by the database to fill or write the group
+    pthread_cond_t wake;        //a group started, or the flusher has to stop; on CLOCK_MONOTONIC
+    pthread_t flusher;          //writes a group once late, when no command comes to do it
+    bool flushing;              //the flusher runs
+    bool stopping;
+} t_log;
+
+typedef struct _relationTree {
+    struct _relationTree *rightChild;
+    struct _relationTree *leftChild;
+    int height;
+
+    uint64_t prefix;    //key prefix of the relation
+    t_id relation;
+} t_relationTree;
+
+typedef struct _db {            //a database of db.h: whatever the engine works on, but the worker pool and the slabs
+    unsigned flags;             //of db_open
+    t_stringPool pool;
+    t_id *entityTable;          //entity ID of each string ID, NO_ID if no entity has that name
+    t_id *relTable;             //same, for relations
+    t_entity *entities;
+    t_id numEntities, capacityEntities;
+    t_relation *relations;
+    t_id numRelations, capacityRelations;
+    t_relationTree *relRoot;
+    t_idStack freeEntities;
+    t_idStack freeRelations;
+    t_compactor compactor;
+    t_batch batch;
+    t_idStack renderList;       //the relations renderChanged hands out, costliest first
+    t_shard shards[COMMAND_SHARDS];
+    size_t queuedCommands;      //in the shards, since the last barrier
+    t_arena treeArena;          //the relation tree nodes, shared by relRoot and the entities
+    t_senderStats senderStats;
+    t_byteBuffer lastReport;    //what the next report prints, unless reportChanged
+    bool reportChanged;         //some fragment changed, or a relation left the report
+    t_idStack changedRelations;    //the relations reportdiff has to look at, see touchRelation
+    t_byteBuffer diffReport;       //what reportdiff prints
+    t_byteBuffer spareFragment;    //reportdiff renders into it, then swaps it with the fragment
+    t_snapshot snapshot;        //what db_restore mapped, until every relation is loaded
+    int snapshotError;          //EBADMSG once the instances of a relation failed their checksum
+    t_log log;
+} t_db;
+
+
+
+// --- GLOBAL VARIABLES ---
+
+static __thread t_db *db;          //the database the thread works on, see useDb
+static __thread t_senderStats *senderStats;    //where the sender sets count their memory: the one of db, or of a shard
+static __thread t_shard *currentShard;     //the shard the thread is running, NULL outside of runShard
+static t_workerPool workerPool = {.lock = PTHREAD_MUTEX_INITIALIZER, .start = PTHREAD_COND_INITIALIZER,
+                                  .done = PTHREAD_COND_INITIALIZER, .started = PTHREAD_ONCE_INIT,
+                                  .busy = PTHREAD_MUTEX_INITIALIZER};
+static t_slab slabs[NUM_SLABS] = {
+    [SLAB_INSTANCE] = {"relation instances", sizeof(t_relInstance)},
+    [SLAB_RELATION_TREE] = {"relation tree nodes", sizeof(t_relationTree)},
+    [SLAB_BUCKET] = {"count buckets", sizeof(t_countBucket)},
+    [SLAB_BTREE_NODE] = {"instance index nodes", sizeof(t_btreeNode)},
+};
+
+// --- FUNCTIONS PROTOTYPES ---
+
+//Library interface
+static void useDb(t_db*);
+static void settle(void);
+static void tick(void);
+static void visitRelations(t_relationTree*, db_report_fn, void*);
+static void visitScanned(t_id, void*);
+static void freeDb(void);
+
+//Command execution
+static void runCommand(db_op_t, t_id, t_id, t_id);
+static void renderReport(void);
+static void renderReportDiff(void);
+static int compareRelationIds(const void*, const void*);
+static void clearChanged(void);
+
+//Batching
+static void bufferCommand(db_op_t, t_id, t_id, t_id);
+static t_batchName *batchName(t_id);
+static t_batchOp *batchOp(t_id, t_id, t_id);
+static uint32_t batchSlot(t_id, t_id, t_id);
+static void growBatchSlots(void);
+static void applyBatch(void);
+static int compareBatchOps(const void*, const void*);
+static void printBatchStats(FILE*);
+
+//String pool
+static t_id internName(t_slice, bool);
+static const char *poolName(t_id);
+static size_t poolLength(t_id);
+static void scanNames(t_slice, t_nameVisitor, void*);
+static void scanEntities(t_slice, t_nameVisitor, void*);
+static void visitEntity(t_id, void*);
+static bool sameName(const char*, t_slice);
+static t_key makeKey(const char*);
+static int compareTails(const t_key*, const char*, const t_key*, const char*);
+static int compareEntities(uint64_t, t_id, uint64_t, t_id);
+static int compareRelations(uint64_t, t_id, uint64_t, t_id);
+
+//Radix tree name index
+#if NAME_INDEX == NAME_INDEX_ART
+static unsigned char keyByte(const char*, size_t, size_t);
+static t_artNode *artNewNode(unsigned char);
+static void **artFindChild(t_artNode*, unsigned char);
+static void artAddChild(void**, t_artNode*, unsigned char, void*);
+static void *artMinimum(void*);
+static size_t artMismatch(t_artNode*, const char*, size_t, size_t);
+static t_id artSearch(void*, t_slice);
+static void artInsert(void**, t_slice, t_id, size_t);
+static void artWalk(void*, t_nameVisitor, void*);
+static void artScanPrefix(void*, t_slice, t_nameVisitor, void*);
+static void artCountNodes(void*, size_t*);
+static void artFree(void*);
+#else
+static int compareNames(const void*, const void*);
+#endif
+
+//Hash table name index
+#if NAME_INDEX == NAME_INDEX_HASH
+static void initNameTable(t_nameTable*, size_t);
+static t_id tableLookup(t_nameTable*, uint32_t, t_slice);
+static void tableInsert(t_nameTable*, uint32_t, t_id);
+static void growNameTable(void);
+static void migrateNames(size_t);
+static size_t tableStats(t_nameTable*, size_t, t_indexStats*);
+static void getIndexStats(t_indexStats*);
+#endif
+static void printIndexStats(FILE*);
+
+//Relation insertion and deletion
+static t_id findEntity(t_id);
+static t_id insertEntity(t_id);
+static bool isValid(t_id);
+static void enableEntity(t_id);
+static void disableEntity(t_id);
+static void dropIncoming(t_id, t_relationTree*);
+static t_id getRelation(t_id, bool);
+static void linkEntities(t_id, t_id, t_id);
+static void unlinkEntities(t_id, t_id, t_id);
+static t_relInstance *newInstance(t_id, t_id);
+static void addInstanceSender(t_id, t_relInstance*, t_id);
+static void dropSender(t_relation*, t_relInstance*, t_id);
+static void dropRecipient(t_relation*, t_relInstance*);
+static void clearRelation(t_id);
+static void detachInstance(t_relation*, t_relInstance*);
+
+//Edges
+static void addEdge(t_id, t_id, t_id);
+static t_relInstance *edgeInstance(const t_edge*, t_id);
+static void purgeEdges(t_id);
+static int compareEdges(const void*, const void*);
+static void freeEdges(t_id);
+
+//Sender sets
+static bool addSender(t_senderSet*, t_id);
+static bool removeSender(t_senderSet*, t_id);
+static bool hasSender(const t_senderSet*, t_id);
+static void staleSenders(const t_senderSet*);
+static void freeSenders(t_senderSet*);
+static int findInline(const t_senderSet*, t_id);
+static t_container *findContainer(const t_senderSet*, uint16_t);
+static t_container *addContainer(t_senderSet*, uint16_t);
+static void removeContainer(t_senderSet*, t_container*);
+static void spillSenders(t_senderSet*);
+static void gatherSenders(t_senderSet*);
+static bool containerAdd(t_container*, uint16_t);
+static bool containerRemove(t_container*, uint16_t);
+static bool containerHas(const t_container*, uint16_t);
+static int containerSearch(const t_container*, uint16_t);
+static void arrayToBitmap(t_container*);
+static void bitmapToArray(t_container*);
+static void freeContainer(t_container*);
+
+//Instance index
+static t_relInstance *getInstance(t_id, t_id);
+static t_relInstance *findInstance(t_relation*, t_id);
+static void delInstance(t_relation*, t_relInstance*);
+static void detachInstances(t_relation*);
+#if INSTANCE_INDEX == INSTANCE_INDEX_BTREE
+static t_btreeNode *newBtreeNode(t_relation*, bool);
+static int btreeLowerBound(const t_btreeNode*, t_treeKey, bool*);
+static t_btreeNode *btreeInsert(t_id, t_btreeNode*, t_treeKey, t_relInstance**, t_treeKey*);
+static t_btreeNode *btreeFirstLeaf(t_btreeNode*);
+#if NODE_ALLOCATOR == NODE_ALLOCATOR_MALLOC
+static void btreeFree(t_arena*, t_btreeNode*);
+#endif
+static t_id scanBucket(t_relation*, t_countBucket*);
+#else
+static void detachInstanceTree(t_relation*, t_relInstance*);
+#endif
+
+//Count buckets
+static void updateBucket(t_relation*, t_relInstance*);
+static t_countBucket *newBucket(t_relation*, int, t_countBucket*, t_countBucket*);
+static void freeBucket(t_relation*, t_countBucket*);
+static void sortBucket(t_relation*, t_countBucket*);
+static int compareRecipients(const void*, const void*);
+
+//Compaction
+static void compact(int);
+static bool reclaimEntity(t_id);
+static bool reclaimRelation(t_id);
+static void releaseRelation(t_id);
+static void pushId(t_idStack*, t_id);
+static t_id popId(t_idStack*);
+static void printCompactionStats(FILE*);
+
+//Node allocation
+static void *allocNode(t_arena*, t_slabType);
+static void freeNode(t_arena*, t_slabType, void*);
+#if NODE_ALLOCATOR == NODE_ALLOCATOR_SLAB
+static void growArena(t_arena*, t_slabType);
+#endif
+static void releaseArena(t_arena*);
+static void printMemStats(FILE*);
+static size_t heldBytes(void);
+
+//Report printing and support
+static int printSingleReport(t_relation*);
+static int printRelations(t_relationTree*);
+static void renderRelation(t_relation*, t_byteBuffer*);
+static void touchRelation(t_relation*);
+
+//Worker pool
+static int poolThreads(void);
+static void startPool(void);
+static void runRound(void (*)(t_id), t_id);
+static void *poolWorker(void*);
+static void runTasks(void);
+static void renderChanged(void);
+static void renderTask(t_id);
+static int compareRenderCost(const void*, const void*);
+
+//Relation shards
+static void shardCommand(db_op_t, t_id, t_id, t_id);
+static void queueCommand(db_op_t, t_id, t_id, t_id);
+static void runShards(void);
+static void runShard(t_id);
+static void logShardEvent(t_shardEventType, t_id, t_id, t_id);
+static void mergeShards(void);
+
+//Snapshots
+static int saveSnapshot(const char*);
+static uint64_t putSection(FILE*, uint64_t*, const void*, size_t, uint64_t*);
+static void putInstances(t_byteBuffer*, t_relation*);
+static void putSenders(t_byteBuffer*, const t_senderSet*);
+static bool restoreSnapshot(void*, size_t);
+static bool checkSnapshot(const unsigned char*, size_t);
+static bool checkBounds(const unsigned char*, size_t);
+static uint64_t snapshotChecksum(const unsigned char*);
+static bool distinctNames(const char*, const size_t*, t_id, uint64_t);
+static bool checkNameTable(const t_snapshotHeader*, const unsigned char*);
+static size_t storedLength(const size_t*, t_id, uint64_t, t_id);
+static bool checkFreeIds(const t_id*, uint32_t, const unsigned char*, uint32_t, size_t);
+static uint64_t chainSection(uint64_t, const unsigned char*, uint64_t, size_t);
+static bool inSnapshot(uint64_t, uint64_t, size_t);
+static void *copySection(const unsigned char*, uint64_t, size_t);
+static void loadRelation(t_id);
+static void readInstances(t_id, const unsigned char*, const unsigned char*);
+static void loadRelations(void);
+static void closeSnapshot(void);
+
+//Write-ahead log
+static int recoverLog(void);
+static uint64_t replayLog(const unsigned char*, uint64_t, uint64_t);
+static bool replayGroup(const unsigned char*, size_t);
+static int startLog(void);
+static bool logCommand(db_op_t, t_id, t_id, t_id);
+static void logNames(void);
+static void writeGroup(t_log*, bool);
+static void *flushLog(void*);
+static int checkpointLog(void);
+static void closeLog(void);
+static void printLogStats(FILE*);
+static int syncDirectory(const char*);
+static uint64_t logClock(void);
+
+//Balanced trees
+static t_treeKey entityKey(t_id);
+static t_treeKey relationKey(t_id);
+#if INSTANCE_INDEX == INSTANCE_INDEX_AVL
+static int compareInstance(t_treeKey, const t_relInstance*);
+#endif
+static int compareRelationNode(t_treeKey, const t_relationTree*);
+static void addToRelTree(t_relationTree**, t_id);
+static void delFromRelTree(t_relationTree**, t_id);
+static t_relationTree *rel_delTree(t_relationTree*);
+static void putName(t_byteBuffer*, t_id);
+
+#if INSTANCE_INDEX == INSTANCE_INDEX_AVL
+AVL_TREE(instanceTree, t_relInstance, t_treeKey, compareInstance)      //instances by recipient
+#endif
+AVL_TREE(relationTree, t_relationTree, t_treeKey, compareRelationNode) //relRoot and the relations of an entity
+
+//misc
+static uint64_t mix(uint64_t, uint64_t);
+static uint64_t read64(const unsigned char*);
+static uint64_t read32(const unsigned char*);
+static uint64_t hash(t_slice, uint64_t);
+
+
+// --- FUNCTIONS IMPLEMENTATION ---
+
+//Library interface
+
+/*
+ * db_t* db_open(unsigned flags)
+ *
+ * --- DESCRIPTION ---
+ * a new empty database. Nothing is allocated until the first name comes, the tables grow from
+ * there; the worker pool, if DB_SHARDS or a big report needs it, is shared by every database of
+ * the process
+ *
+ * --- PARAMETERS ---
+ * flags: DB_BATCH, DB_SHARDS or 0, see db.h
+ *
+ * --- RETURN VALUES ---
+ * the database, NULL if there is no memory for it
+ */
+db_t *db_open(unsigned flags) {
+    t_db *database = calloc(1, sizeof(t_db));
+
+    if (database == NULL)
+        return NULL;
+    database->flags = flags;
+    database->batch.serial = 1;
+    database->reportChanged = true;
+    database->log.fd = -1;
+    return database;
+}
+
+/*
+ * db_t* db_restore(const char* path, unsigned flags)
+ *
+ * --- DESCRIPTION ---
+ * a database as db_save left it. The file is mapped, not read: the names and the records are
+ * copied from it, each relation keeps pointing to its instances there until it is loaded, see
+ * loadRelation, and the file is unmapped after the last one. The flags don't have to be the
+ * ones the database was saved with
+ *
+ * --- PARAMETERS ---
+ * path: the snapshot file
+ * flags: as for db_open
+ *
+ * --- RETURN VALUES ---
+ * the database, NULL with errno set if the file can't be mapped or isn't a whole snapshot (EINVAL)
+ */
+db_t *db_restore(const char *path, unsigned flags) {
+    t_db *database;
+    struct stat info;
+    void *map;
+    size_t size;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return NULL;
+    }
+    size = (size_t)info.st_size;
+    map = size >= sizeof(t_snapshotHeader) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    if (map == NULL) {      //too short for a header
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((database = db_open(flags)) != NULL) {
+        useDb(database);
+        if (restoreSnapshot(map, size))
+            return database;
+        free(database);     //nothing is allocated until the whole file has been checked
+        db = NULL;
+        senderStats = NULL;
+    }
+    munmap(map, size);
+    errno = database != NULL ? EINVAL : ENOMEM;
+    return NULL;
+}
+
+/*
+ * db_t* db_recover(const char* path, unsigned flags, const db_durability_t* durability)
+ *
+ * --- DESCRIPTION ---
+ * a database as the commands logged so far left it: the last checkpoint at path, restored as by
+ * db_restore, or an empty database if there's none yet, then the log path.wal replayed on top,
+ * see recoverLog. From there on the commands are logged as durability says
+ *
+ * --- PARAMETERS ---
+ * path: the checkpoint file, the log is next to it
+ * flags: as for db_open
+ * durability: when the log is written and fsynced, and checkpointed
+ *
+ * --- RETURN VALUES ---
+ * the database, NULL with errno set if the files can't be read or don't go together (EINVAL)
+ */
+db_t *db_recover(const char *path, unsigned flags, const db_durability_t *durability) {
+    t_db *database = db_restore(path, flags);
+    pthread_condattr_t attributes;
+    int error;
+
+    if (database == NULL && errno != ENOENT)
+        return NULL;
+    if (database == NULL && (database = db_open(flags)) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    useDb(database);
+    if ((db->log.path = strdup(path)) == NULL || asprintf(&db->log.logPath, "%s.wal", path) < 0) {
+        db->log.logPath = NULL;     //asprintf leaves it undefined
+        db_close(database);
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_init(&db->log.lock, NULL);
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&db->log.wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+    db->log.durability = *durability;
+    if ((error = recoverLog()) == 0 && durability->sync != DB_SYNC_ALWAYS && durability->groupMicros > 0 &&
+            (error = pthread_create(&db->log.flusher, NULL, flushLog, &db->log)) == 0)
+        db->log.flushing = true;
+    if (error != 0) {
+        db_close(database);
+        errno = error;
+        return NULL;
+    }
+    return database;
+}
+
+void db_close(db_t *database) {
+    if (database == NULL)
+        return;
+    useDb(database);
+    freeDb();
+    free(database);
+    db = NULL;
+    senderStats = NULL;
+}
+
+db_name_t db_intern(db_t *database, const char *name, size_t len) {
+    useDb(database);
+    return internName((t_slice){name, len}, true);
+}
+
+db_name_t db_find(db_t *database, const char *name, size_t len) {
+    useDb(database);
+    return internName((t_slice){name, len}, false);
+}
+
+const char *db_name(db_t *database, db_name_t name, size_t *len) {
+    useDb(database);
+    *len = poolLength(name);
+    return poolName(name);
+}
+
+size_t db_names(db_t *database) {
+    return database->pool.count;
+}
+
+/*
+ * void db_apply(db_t* database, db_op_t op, db_name_t first, db_name_t second, db_name_t relation)
+ *
+ * --- DESCRIPTION ---
+ * runs a command on interned names, the way the flags of the database say: buffered in the batch
+ * with DB_BATCH, queued in the shard of its relation with DB_SHARDS (when the pool has threads to
+ * run them), right away otherwise. Then the compactor gets its budget, unless commands are queued
+ * that point to what it could reclaim
+ *
+ * --- PARAMETERS ---
+ * op: the command
+ * first, second: the entity of addent and delent, the sender and the recipient of addrel and delrel
+ * relation: the relation of addrel, delrel and droprel
+ * names that aren't used are ignored, DB_NO_NAME makes the command do nothing
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+void db_apply(db_t *database, db_op_t op, db_name_t first, db_name_t second, db_name_t relation) {
+    bool checkpoint = false;
+
+    useDb(database);
+    if (db->log.active)
+        checkpoint = logCommand(op, first, second, relation);
+    if (db->flags & DB_BATCH)
+        bufferCommand(op, first, second, relation);
+    else if (db->flags & DB_SHARDS && poolThreads() > 1)
+        shardCommand(op, first, second, relation);
+    else
+        runCommand(op, first, second, relation);
+    tick();
+    if (checkpoint)
+        checkpointLog();
+}
+
+void db_addent(db_t *database, const char *name, size_t len) {
+    db_apply(database, DB_ADDENT, db_intern(database, name, len), DB_NO_NAME, DB_NO_NAME);
+}
+
+void db_delent(db_t *database, const char *name, size_t len) {
+    db_apply(database, DB_DELENT, db_find(database, name, len), DB_NO_NAME, DB_NO_NAME);
+}
+
+/*
+ * names not in the pool yet can't be entities, so the sender and the recipient aren't interned;
+ * the relation is, but only if the addrel can create it: a batch may create the entities first
+ */
+void db_addrel(db_t *database, const char *sender, size_t senderLen, const char *recipient, size_t recipientLen,
+               const char *relation, size_t relationLen) {
+    db_name_t first = db_find(database, sender, senderLen), second = db_find(database, recipient, recipientLen);
+    db_name_t name = DB_NO_NAME;
+
+    if (database->flags & DB_BATCH || (isValid(findEntity(first)) && isValid(findEntity(second))))
+        name = db_intern(database, relation, relationLen);
+    db_apply(database, DB_ADDREL, first, second, name);
+}
+
+void db_delrel(db_t *database, const char *sender, size_t senderLen, const char *recipient, size_t recipientLen,
+               const char *relation, size_t relationLen) {
+    db_apply(database, DB_DELREL, db_find(database, sender, senderLen), db_find(database, recipient, recipientLen),
+             db_find(database, relation, relationLen));
+}
+
+void db_droprel(db_t *database, const char *relation, size_t len) {
+    db_apply(database, DB_DROPREL, DB_NO_NAME, DB_NO_NAME, db_find(database, relation, len));
+}
+
+/*
+ * the report, as the report command prints it; the text is kept by the database and printed
+ * again as it is if nothing changed, see renderReport
+ */
+const char *db_report(db_t *database, size_t *len) {
+    useDb(database);
+    settle();
+    renderReport();
+    tick();
+    *len = db->lastReport.size;
+    return (const char*)db->lastReport.data;
+}
+
+const char *db_reportdiff(db_t *database, size_t *len) {
+    useDb(database);
+    settle();
+    renderReportDiff();
+    tick();
+    *len = db->diffReport.size;
+    return (const char*)db->diffReport.data;
+}
+
+/*
+ * void db_report_iter(db_t* database, db_report_fn visit, void* context)
+ *
+ * --- DESCRIPTION ---
+ * the report without its text: visit is called for each recipient of each relation in it, in the
+ * order the report prints them, with the names and the count of senders. Nothing is rendered and
+ * the report isn't kept, so the next report or reportdiff prints what it would have without this
+ * call. visit may use other databases, not this one
+ *
+ * --- PARAMETERS ---
+ * visit: called with context, the relation, the recipient and the count
+ * context: anything visit needs
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+void db_report_iter(db_t *database, db_report_fn visit, void *context) {
+    useDb(database);
+    settle();
+    visitRelations(db->relRoot, visit, context);
+    tick();
+}
+
+/*
+ * calls visit with the name of each entity starting with prefix, see scanEntities. Pending
+ * commands are applied first, like for a report
+ */
+void db_scan_entities(db_t *database, const char *prefix, size_t len, db_entity_fn visit, void *context) {
+    t_prefixScan scan = {visit, context};
+
+    useDb(database);
+    settle();
+    scanEntities((t_slice){prefix, len}, visitScanned, &scan);
+    tick();
+}
+
+static void visitScanned(t_id entity, void *context) {
+    t_prefixScan *scan = context;
+    t_id name = ENTITY(entity)->name;
+
+    scan->visit(scan->context, poolName(name), poolLength(name));
+}
+
+/*
+ * see heldBytes; commands not applied yet are left alone, unlike db_memstats
+ */
+size_t db_memory(db_t *database) {
+    useDb(database);
+    return heldBytes();
+}
+
+/*
+ * writes the database to path, see saveSnapshot; what the commands so far did is applied first,
+ * and logged, so that the snapshot can say where in the log it is. Returns 0, or the errno of
+ * what failed
+ */
+int db_save(db_t *database, const char *path) {
+    int error;
+
+    useDb(database);
+    if (db->log.active) {
+        pthread_mutex_lock(&db->log.lock);
+        logNames();
+        writeGroup(&db->log, true);
+        pthread_mutex_unlock(&db->log.lock);
+    }
+    settle();
+    error = saveSnapshot(path);     //the group stays empty, the flusher leaves the log alone
+    tick();
+    return error;
+}
+
+/*
+ * writes the group being filled and fsyncs the log: every command so far is on the disk
+ */
+int db_sync(db_t *database) {
+    int error = 0;
+
+    useDb(database);
+    if (db->log.active) {
+        pthread_mutex_lock(&db->log.lock);
+        writeGroup(&db->log, true);
+        error = db->log.error;
+        pthread_mutex_unlock(&db->log.lock);
+    }
+    return error;
+}
+
+int db_checkpoint(db_t *database) {
+    useDb(database);
+    return db->log.active ? checkpointLog() : EINVAL;
+}
+
+/*
+ * EBADMSG once the instances of a relation read from the snapshot failed their checksum, see
+ * loadRelation; the relations not loaded yet haven't been checked
+ */
+int db_snapshot_error(db_t *database) {
+    return database->snapshotError;
+}
+
+void db_memstats(db_t *database, FILE *out) {
+    useDb(database);
+    settle();
+    printMemStats(out);
+    tick();
+}
+
+/*
+ * what the name index, the compactor and the allocators have done so far
+ */
+void db_stats(db_t *database, FILE *out) {
+    useDb(database);
+    settle();
+    printIndexStats(out);
+    printCompactionStats(out);
+    if (db->log.active)
+        printLogStats(out);
+    printMemStats(out);
+}
+
+void db_batch_stats(db_t *database, FILE *out) {
+    useDb(database);
+    printBatchStats(out);
+}
+
+/*
+ * makes the database the one the engine works on, in this thread
+ */
+static void useDb(t_db *database) {
+    db = database;
+    senderStats = &database->senderStats;
+}
+
+/*
+ * brings the engine up to date with the commands taken in, before something looks at it
+ */
+static void settle() {
+    if (db->flags & DB_BATCH)
+        applyBatch();
+    else
+        runShards();
+}
+
+/*
+ * the compactor's share of a call, see compact; runShards gives it the share of the commands it queued
+ */
+static void tick() {
+    if (db->queuedCommands == 0)
+        compact(COMPACT_BUDGET);
+}
+
+static void visitRelations(t_relationTree *node, db_report_fn visit, void *context) {
+    t_db *self = db;
+    t_relation *rel;
+    t_id i;
+
+    if (node == NULL)
+        return;
+    visitRelations(node->leftChild, visit, context);
+    loadRelation(node->relation);   //the top bucket is needed, not the fragment
+    rel = RELATION(node->relation);
+    if (rel->top != NULL) {
+        sortBucket(rel, rel->top);
+        for (i = 0; i < rel->top->size; i++) {
+            visit(context, poolName(rel->name), poolLength(rel->name), ENTITY_NAME(rel->top->sorted[i]),
+                  poolLength(ENTITY(rel->top->sorted[i])->name), (uint32_t)rel->top->count);
+            useDb(self);    //visit may have used another database
+        }
+    }
+    visitRelations(node->rightChild, visit, context);
+}
+
+/*
+ * void freeDb()
+ *
+ * --- DESCRIPTION ---
+ * frees everything db holds, but the t_db itself. The relations are cleared first, which takes
+ * the instances and the sender sets with them and empties the relation trees of the entities;
+ * whatever is left comes from the arenas and the arrays of the database
+ *
+ * --- PARAMETERS ---
+ * none
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void freeDb() {
+    t_relation *rel;
+    t_id i;
+
+    runShards();
+    for (i = 0; i < db->numRelations; i++) {
+        if (RELATION(i)->name != NO_ID)
+            clearRelation(i);
+    }
+    while (db->relRoot != NULL)
+        delFromRelTree(&db->relRoot, db->relRoot->relation);
+    for (i = 0; i < db->numRelations; i++) {
+        rel = RELATION(i);
+        releaseArena(&rel->arena);
+        free(rel->fragment.data);
+    }
+    for (i = 0; i < db->numEntities; i++)
+        free(ENTITY(i)->outgoing);
+    releaseArena(&db->treeArena);
+    free(db->entities);
+    free(db->relations);
+    free(db->entityTable);
+    free(db->relTable);
+
+    free(db->pool.chars);
+    free(db->pool.offsets);
+#if NAME_INDEX == NAME_INDEX_ART
+    artFree(db->pool.root);
+#else
+    free(db->pool.table.slots);
+    free(db->pool.old.slots);
+#endif
+
+    free(db->freeEntities.ids);
+    free(db->freeRelations.ids);
+    free(db->renderList.ids);
+    free(db->changedRelations.ids);
+    free(db->batch.names);
+    free(db->batch.touched.ids);
+    free(db->batch.ops);
+    free(db->batch.slots);
+    for (i = 0; i < COMMAND_SHARDS; i++) {
+        free(db->shards[i].commands);
+        free(db->shards[i].events);
+        free(db->shards[i].touched.ids);
+    }
+    free(db->lastReport.data);
+    free(db->diffReport.data);
+    free(db->spareFragment.data);
+    closeSnapshot();
+    closeLog();
+}
+
+
+//Command execution
+
+/*
+ * void runCommand(db_op_t op, t_id first, t_id second, t_id relation)
+ *
+ * --- DESCRIPTION ---
+ * runs a command right away. An addent of a name that has never been an entity makes a new one,
+ * see insertEntity; a delent only marks the entity deleted, see disableEntity. addrel needs both
+ * entities to exist and creates the relation if needed; delrel and droprel do nothing on what
+ * doesn't exist
+ *
+ * --- PARAMETERS ---
+ * op: the command
+ * first, second, relation: string IDs of the names, as for db_apply; NO_ID if they aren't in the pool
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void runCommand(db_op_t op, t_id first, t_id second, t_id relation) {
+    t_id sender = findEntity(first), recipient = findEntity(second), rel;
+
+    switch (op) {
+        case DB_ADDENT:
+            if (first != NO_ID)
+                insertEntity(first);
+            break;
+        case DB_DELENT:
+            if (sender != NO_ID)    //element exists
+                disableEntity(sender);
+            break;
+        case DB_ADDREL:     //checks if the entities have been created, and not deleted
+            if (isValid(sender) && isValid(recipient) && relation != NO_ID)
+                linkEntities(getRelation(relation, true), sender, recipient);
+            break;
+        case DB_DELREL:
+            if (sender != NO_ID && recipient != NO_ID && relation != NO_ID && (rel = getRelation(relation, false)) != NO_ID)
+                unlinkEntities(rel, sender, recipient);
+            break;
+        case DB_DROPREL:
+            if (relation != NO_ID && (rel = getRelation(relation, false)) != NO_ID)
+                clearRelation(rel);
+            break;
+    }
+}
+
+/*
+ * void renderReport()
+ *
+ * --- DESCRIPTION ---
+ * each relation keeps the text of its part of the report, rendered again only if its top
+ * bucket changed since, see renderRelation; the report is the fragments in the order of the
+ * relations, see renderChanged for rendering them on several threads. The whole report is kept
+ * too, in lastReport: if no fragment changed and no relation left, it is
+ * printed again as it is, without walking the relations. What reportdiff compares with is
+ * now this report, so the relations touched so far are forgotten
+ *
+ * --- PARAMETERS ---
+ * none
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void renderReport() {
+    if (db->reportChanged) {
+        renderChanged();
+        db->lastReport.size = 0;
+        if (printRelations(db->relRoot) == 0)
+            putBytes(&db->lastReport, "none", 4);
+        putBytes(&db->lastReport, "\n", 1);
+        db->reportChanged = false;
+        clearChanged();
+    }
+}
+static int printRelations(t_relationTree *node) {
+    if (node == NULL)
+        return 0;
+    int count = 0;
+    count += printRelations(node->leftChild);
+
+    count += printSingleReport(RELATION(node->relation));
+    count += printRelations(node->rightChild);
+    return count;
+}
+
+/*
+ * void renderReportDiff()
+ *
+ * --- DESCRIPTION ---
+ * reportdiff, in diffReport: only what changed since the last report or reportdiff, in the same order
+ * and format as a report: the fragment of each relation that joined the report or whose top
+ * bucket changed, "name" none; for each relation that left it, "none" if there is nothing.
+ * The only relations looked at are the ones touched since, see touchRelation; the fragment of a
+ * relation is what was last printed for it, so one is rendered again and compared with it, and a
+ * top bucket that went back to what it was is left out
+ *
+ * --- PARAMETERS ---
+ * none
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void renderReportDiff() {
+    t_relation *rel;
+    t_byteBuffer swap;
+    int count = 0;
+    t_id i;
+
+    db->diffReport.size = 0;
+    if (db->changedRelations.count > 1)
+        qsort(db->changedRelations.ids, db->changedRelations.count, sizeof(t_id), compareRelationIds);
+    for (i = 0; i < db->changedRelations.count; i++) {
+        rel = RELATION(db->changedRelations.ids[i]);
+        if (rel->top == NULL) {
+            if (rel->fragment.size == 0)    //it wasn't printed last time either
+                continue;
+            rel->fragment.size = 0;
+            putName(&db->diffReport, rel->name);
+            putBytes(&db->diffReport, "none; ", 6);
+        }
+        else {
+            if (!rel->dirty)
+                continue;
+            renderRelation(rel, &db->spareFragment);
+            if (db->spareFragment.size == rel->fragment.size &&
+                memcmp(db->spareFragment.data, rel->fragment.data, db->spareFragment.size) == 0)
+                continue;
+            swap = rel->fragment;
+            rel->fragment = db->spareFragment;
+            db->spareFragment = swap;
+            putBytes(&db->diffReport, rel->fragment.data, rel->fragment.size);
+        }
+        count++;
+    }
+    clearChanged();
+    if (count == 0)
+        putBytes(&db->diffReport, "none", 4);
+    putBytes(&db->diffReport, "\n", 1);
+}
+static int compareRelationIds(const void *a, const void *b) {
+    t_id first = *(const t_id*)a, second = *(const t_id*)b;
+    return compareRelations(RELATION(first)->key.prefix, first, RELATION(second)->key.prefix, second);
+}
+
+/*
+ * the next reportdiff starts from here
+ */
+static void clearChanged() {
+    t_id i;
+
+    for (i = 0; i < db->changedRelations.count; i++)
+        RELATION(db->changedRelations.ids[i])->changed = false;
+    db->changedRelations.count = 0;
+}
+
+
+//Batching
+
+/*
+ * void bufferCommand(db_op_t op, t_id ent1, t_id ent2, t_id rel)
+ *
+ * --- DESCRIPTION ---
+ * adds a command to the batch, keeping only its net effect: whether each entity exists at the end,
+ * whether it was deleted on the way (its instances went with it), whether each relation was
+ * dropped and, for each instance, whether it is there at the end. The instances are keyed by
+ * their three names; a delent or droprel bumps the epoch of its name, which makes every instance
+ * buffered before with that name stale, without looking for them. A command that can't do
+ * anything, like an addrel of an entity that doesn't exist, leaves no trace
+ *
+ * --- PARAMETERS ---
+ * op: an addent, delent, addrel, delrel or droprel
+ * ent1, ent2: the string IDs of the entities, NO_ID if they aren't names
+ * rel: the string ID of the relation, same
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void bufferCommand(db_op_t op, t_id ent1, t_id ent2, t_id rel) {
+    t_batchName *name;
+
+    db->batch.buffered++;
+    switch (op) {
+        case DB_ADDENT:
+            if (ent1 != NO_ID)
+                batchName(ent1)->exists = true;
+            break;
+        case DB_DELENT:
+            if (ent1 == NO_ID)
+                break;
+            name = batchName(ent1);
+            if (name->exists) {
+                name->exists = false;
+                name->entityEpoch++;
+            }
+            break;
+        case DB_ADDREL:
+        case DB_DELREL:
+            if (ent1 == NO_ID || ent2 == NO_ID || rel == NO_ID)
+                break;
+            if (batchName(ent1)->exists && batchName(ent2)->exists)
+                batchOp(ent1, ent2, rel)->after = op == DB_ADDREL;
+            break;
+        case DB_DROPREL:
+            if (rel != NO_ID)
+                batchName(rel)->relationEpoch++;
+            break;
+    }
+}
+
+/*
+ * the record of the name for the current batch, started from the state of the engine
+ */
+static t_batchName *batchName(t_id name) {
+    t_batchName *record;
+    t_id old = db->batch.capacityNames;
+
+    if (name >= db->batch.capacityNames) {
+        db->batch.capacityNames = db->pool.capacityIds;
+        db->batch.names = realloc(db->batch.names, db->batch.capacityNames * sizeof(t_batchName));
+        memset(db->batch.names + old, 0, (db->batch.capacityNames - old) * sizeof(t_batchName));
+    }
+    record = &db->batch.names[name];
+    if (record->batch != db->batch.serial) {
+        record->batch = db->batch.serial;
+        record->entityEpoch = 0;
+        record->relationEpoch = 0;
+        record->existed = isValid(db->entityTable[name]);
+        record->exists = record->existed;
+        pushId(&db->batch.touched, name);
+    }
+    return record;
+}
+
+/*
+ * finds the instance in the batch, or adds it. The engine isn't asked whether it has it: addrel
+ * and delrel can be applied either way, the only ones skipped are the delrels of instances that
+ * were sure to be missing
+ */
+static t_batchOp *batchOp(t_id sender, t_id recipient, t_id rel) {
+    uint32_t senderEpoch = batchName(sender)->entityEpoch, recipientEpoch = batchName(recipient)->entityEpoch;
+    uint32_t relationEpoch = batchName(rel)->relationEpoch;
+    uint32_t slot;
+    t_batchOp *op;
+
+    if ((db->batch.numOps + 1) * 2 > db->batch.numSlots)
+        growBatchSlots();
+    slot = batchSlot(sender, recipient, rel);
+    for (; db->batch.slots[slot] != 0; slot = (slot + 1) & (db->batch.numSlots - 1)) {
+        op = &db->batch.ops[db->batch.slots[slot] - 1];
+        if (op->sender != sender || op->recipient != recipient || op->relation != rel)
+            continue;
+        if (op->senderEpoch != senderEpoch || op->recipientEpoch != recipientEpoch ||
+            op->relationEpoch != relationEpoch) {   //deleted since, along with what it was then
+            op->senderEpoch = senderEpoch;
+            op->recipientEpoch = recipientEpoch;
+            op->relationEpoch = relationEpoch;
+            op->missing = true;
+        }
+        return op;
+    }
+
+    if (db->batch.numOps == db->batch.capacityOps) {
+        db->batch.capacityOps = db->batch.capacityOps == 0 ? 64 : db->batch.capacityOps * 2;
+        db->batch.ops = realloc(db->batch.ops, db->batch.capacityOps * sizeof(t_batchOp));
+    }
+    op = &db->batch.ops[db->batch.numOps++];
+    db->batch.slots[slot] = db->batch.numOps;
+    op->slot = slot;
+    op->sender = sender;
+    op->recipient = recipient;
+    op->relation = rel;
+    op->senderEpoch = senderEpoch;
+    op->recipientEpoch = recipientEpoch;
+    op->relationEpoch = relationEpoch;
+    op->missing = (senderEpoch | recipientEpoch | relationEpoch) != 0;
+    return op;
+}
+
+/*
+ * the IDs are small and close together, the constants keep a multiply by them from folding to
+ * the same few values
+ */
+static uint32_t batchSlot(t_id sender, t_id recipient, t_id rel) {
+    uint64_t key = mix(((uint64_t)sender << 32 | recipient) ^ 0xa0761d6478bd642full, rel ^ 0xe7037ed1a0b428dbull);
+    return (uint32_t)(key ^ key >> 32) & (db->batch.numSlots - 1);
+}
+
+/*
+ * doubles the hash table of the instances and puts them back in it
+ */
+static void growBatchSlots() {
+    uint32_t i, slot;
+    t_batchOp *op;
+
+    db->batch.numSlots = db->batch.numSlots == 0 ? 256 : db->batch.numSlots * 2;
+    free(db->batch.slots);
+    db->batch.slots = calloc(db->batch.numSlots, sizeof(uint32_t));
+    for (i = 0; i < db->batch.numOps; i++) {
+        op = &db->batch.ops[i];
+        slot = batchSlot(op->sender, op->recipient, op->relation);
+        while (db->batch.slots[slot] != 0)
+            slot = (slot + 1) & (db->batch.numSlots - 1);
+        db->batch.slots[slot] = i + 1;
+        op->slot = slot;
+    }
+}
+
+/*
+ * void applyBatch()
+ *
+ * --- DESCRIPTION ---
+ * gives the net effect of the batch to the engine, before a command that prints. First the
+ * entities: a delent for each one that existed and was deleted in the batch, an addent for each
+ * one that exists at the end and didn't before or was deleted; then a droprel for each relation
+ * dropped. What those removed is what the batch removed, so what is left is the instances that
+ * aren't stale, less the delrels of instances that weren't there: they are sorted by relation,
+ * recipient and sender, so that the changes to a relation and its arena come one after the
+ * other, and applied. The reports only depend on which entities and instances exist, so they
+ * print the same as if every command had been run as it came
+ *
+ * --- PARAMETERS ---
+ * none
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void applyBatch() {
+    t_batchName *name;
+    t_batchOp *op;
+    uint32_t i, kept = 0;
+    t_id id, rel;
+
+    for (i = 0; i < db->batch.touched.count; i++) {
+        id = db->batch.touched.ids[i];
+        name = &db->batch.names[id];
+        if (name->entityEpoch > 0 && name->existed) {
+            disableEntity(db->entityTable[id]);
+            db->batch.applied++;
+        }
+        if (name->exists && (name->entityEpoch > 0 || !name->existed)) {
+            insertEntity(id);
+            db->batch.applied++;
+        }
+        if (name->relationEpoch > 0 && (rel = getRelation(id, false)) != NO_ID) {
+            clearRelation(rel);
+            db->batch.applied++;
+        }
+    }
+
+    for (i = 0; i < db->batch.numOps; i++) {
+        op = &db->batch.ops[i];
+        db->batch.slots[op->slot] = 0;     //the table may be much bigger than this batch, it isn't cleared whole
+        if ((op->after || !op->missing) && op->senderEpoch == db->batch.names[op->sender].entityEpoch &&
+            op->recipientEpoch == db->batch.names[op->recipient].entityEpoch &&
+            op->relationEpoch == db->batch.names[op->relation].relationEpoch)
+            db->batch.ops[kept++] = *op;
+    }
+    if (kept > 1)
+        qsort(db->batch.ops, kept, sizeof(t_batchOp), compareBatchOps);
+    for (i = 0; i < kept; i++) {
+        op = &db->batch.ops[i];
+        if (op->after)
+            linkEntities(getRelation(op->relation, true), db->entityTable[op->sender], db->entityTable[op->recipient]);
+        else if ((rel = getRelation(op->relation, false)) != NO_ID)
+            unlinkEntities(rel, db->entityTable[op->sender], db->entityTable[op->recipient]);
+        else
+            continue;
+        db->batch.applied++;
+    }
+
+    db->batch.serial++;
+    db->batch.touched.count = 0;
+    db->batch.numOps = 0;
+}
+static int compareBatchOps(const void *a, const void *b) {
+    const t_batchOp *first = a, *second = b;
+
+    if (first->relation != second->relation)
+        return first->relation < second->relation ? -1 : 1;
+    if (first->recipient != second->recipient)
+        return first->recipient < second->recipient ? -1 : 1;
+    return first->sender < second->sender ? -1 : first->sender > second->sender;
+}
+
+/*
+ * what --batch prints at the end. The commands still buffered then are never applied, nothing
+ * would print them, so they count as eliminated too
+ */
+static void printBatchStats(FILE *out) {
+    fprintf(out, "batching: %zu commands buffered, %zu applied, %zu eliminated\n", db->batch.buffered,
+            db->batch.applied, db->batch.buffered - db->batch.applied);
+}
+
+
+//String pool
+
+/*
+ * t_id internName(t_slice name, bool create)
+ *
+ * --- DESCRIPTION ---
+ * looks for a name in the string pool, where every name (of entities and relations alike) is
+ * stored once, with no length limit. Names are identified by their string ID, given in order of
+ * first appearance starting from 0; entityTable and relTable tell which entity and relation, if
+ * any, have that name
+ *
+ * --- PARAMETERS ---
+ * name: the name to look for
+ * create: if true, a name not found is added to the pool
+ *
+ * --- RETURN VALUES ---
+ * the string ID of the name, NO_ID if it isn't in the pool and create is false, or if it holds a
+ * NUL byte: the pool keeps the names null-terminated, and sorts and compares them as such
+ */
+static t_id internName(t_slice name, bool create) {
+    if (name.len > 0 && memchr(name.ptr, '\0', name.len) != NULL)
+        return NO_ID;
+#if NAME_INDEX == NAME_INDEX_ART
+    t_id temp = artSearch(db->pool.root, name);
+
+    if (temp != NO_ID || !create)
+        return temp;
+#else
+    uint32_t hashValue;
+    t_id temp;
+
+    if (db->pool.table.slots == NULL) {
+        db->pool.seed = HASH_SEED != 0 ? HASH_SEED : read64((const unsigned char*)getauxval(AT_RANDOM));
+        initNameTable(&db->pool.table, HASH_TABLE_SIZE);
+    }
+    hashValue = (uint32_t)hash(name, db->pool.seed);
+    temp = tableLookup(&db->pool.table, hashValue, name);
+    if (temp == NO_ID && db->pool.old.slots != NULL)   //not moved yet
+        temp = tableLookup(&db->pool.old, hashValue, name);
+    if (temp != NO_ID || !create)
+        return temp;
+#endif
+    if (db->pool.count == db->pool.capacityIds) {
+        db->pool.capacityIds = db->pool.capacityIds == 0 ? 1024 : db->pool.capacityIds * 2;
+        db->pool.offsets = realloc(db->pool.offsets, db->pool.capacityIds * sizeof(size_t));
+        db->entityTable = realloc(db->entityTable, db->pool.capacityIds * sizeof(t_id));
+        db->relTable = realloc(db->relTable, db->pool.capacityIds * sizeof(t_id));
+    }
+    if (db->pool.size + name.len + 1 > db->pool.capacity) {
+        db->pool.capacity = db->pool.capacity == 0 ? 65536 : db->pool.capacity;
+        while (db->pool.size + name.len + 1 > db->pool.capacity)
+            db->pool.capacity *= 2;
+        db->pool.chars = realloc(db->pool.chars, db->pool.capacity);
+    }
+
+    temp = db->pool.count++;
+    memcpy(db->pool.chars + db->pool.size, name.ptr, name.len);
+    db->pool.chars[db->pool.size + name.len] = '\0';
+    db->pool.offsets[temp] = db->pool.size;
+    db->pool.size += name.len + 1;
+#if NAME_INDEX == NAME_INDEX_ART
+    artInsert(&db->pool.root, name, temp, 0);
+#else
+    if (db->pool.old.slots != NULL)
+        migrateNames(HASH_MIGRATE_STEP);
+    else if ((db->pool.table.count + 1) * 8 > (db->pool.table.mask + 1) * HASH_MAX_LOAD)
+        growNameTable();
+    tableInsert(&db->pool.table, hashValue, temp);
+#endif
+    db->entityTable[temp] = NO_ID;
+    db->relTable[temp] = NO_ID;
+    return temp;
+}
+
+/*
+ * the pool may move when it grows, don't keep the pointer across insertions
+ */
+static const char *poolName(t_id name) {
+    return db->pool.chars + db->pool.offsets[name];
+}
+
+static size_t poolLength(t_id name) {
+    size_t end = name + 1 < db->pool.count ? db->pool.offsets[name + 1] : db->pool.size;
+    return end - db->pool.offsets[name] - 1;
+}
+
+/*
+ * void scanNames(t_slice prefix, t_nameVisitor visit, void *context)
+ *
+ * --- DESCRIPTION ---
+ * calls visit on every name of the pool starting with prefix, in the order strcmp gives. With the
+ * radix tree index only the subtree below the prefix is walked; the hash index has no order, so
+ * the whole pool is filtered and sorted
+ *
+ * --- PARAMETERS ---
+ * prefix: the names to visit start with these bytes, an empty prefix visits the whole pool
+ * visit: called with the string ID of each name and context
+ * context: passed as is to visit
+ */
+static void scanNames(t_slice prefix, t_nameVisitor visit, void *context) {
+#if NAME_INDEX == NAME_INDEX_ART
+    artScanPrefix(db->pool.root, prefix, visit, context);
+#else
+    t_id *found = malloc((db->pool.count + 1) * sizeof(t_id));
+    t_id i, numFound = 0;
+
+    for (i = 0; i < db->pool.count; i++) {
+        if (poolLength(i) >= prefix.len && strncmp(poolName(i), prefix.ptr, prefix.len) == 0)
+            found[numFound++] = i;
+    }
+    qsort(found, numFound, sizeof(t_id), compareNames);
+    for (i = 0; i < numFound; i++)
+        visit(found[i], context);
+    free(found);
+#endif
+}
+
+/*
+ * same as scanNames, visit gets the ID of each valid entity whose name starts with prefix
+ */
+static void scanEntities(t_slice prefix, t_nameVisitor visit, void *context) {
+    t_entityScan scan = {visit, context};
+    scanNames(prefix, visitEntity, &scan);
+}
+
+static void visitEntity(t_id name, void *context) {
+    t_entityScan *scan = context;
+    if (isValid(db->entityTable[name]))
+        scan->visit(db->entityTable[name], scan->context);
+}
+
+/*
+ * compares a stored, null-terminated name with a name taken from the input, which internName made
+ * sure holds no NUL: strncmp stops at the end of the shorter one
+ */
+static bool sameName(const char *name, t_slice other) {
+    return strncmp(name, other.ptr, other.len) == 0 && name[other.len] == '\0';
+}
+
+/*
+ * packs the first KEY_PREFIX_SIZE bytes of the name into an integer, most significant byte first:
+ * comparing two prefixes as numbers gives the same result strcmp would give on those bytes, and
+ * names shorter than the prefix are padded with zeros, just like their terminator would compare
+ */
+static t_key makeKey(const char *name) {
+    t_key key = {0, 0};
+    int i;
+
+    for (i = 0; i < KEY_PREFIX_SIZE && name[i] != '\0'; i++)
+        key.prefix |= (uint64_t)(unsigned char)name[i] << (8 * (KEY_PREFIX_SIZE - 1 - i));
+    key.len = strlen(name);
+    return key;
+}
+
+/*
+ * orders two names whose prefixes tie: if one of them fits in the prefix it is also a prefix
+ * of the other, so the shorter comes first; otherwise only the remaining bytes need strcmp
+ */
+static int compareTails(const t_key *keyA, const char *nameA, const t_key *keyB, const char *nameB) {
+    if (keyA->len <= KEY_PREFIX_SIZE || keyB->len <= KEY_PREFIX_SIZE)
+        return (keyA->len > keyB->len) - (keyA->len < keyB->len);
+    return strcmp(nameA + KEY_PREFIX_SIZE, nameB + KEY_PREFIX_SIZE);
+}
+
+/*
+ * same result as strcmp on the entity names; the records (and the pool) are only touched when
+ * the prefixes tie
+ */
+static int compareEntities(uint64_t prefixA, t_id a, uint64_t prefixB, t_id b) {
+    if (prefixA != prefixB)
+        return prefixA < prefixB ? -1 : 1;
+    if (a == b)     //names are unique
+        return 0;
+    return compareTails(&ENTITY(a)->key, ENTITY_NAME(a), &ENTITY(b)->key, ENTITY_NAME(b));
+}
+
+static int compareRelations(uint64_t prefixA, t_id a, uint64_t prefixB, t_id b) {
+    if (prefixA != prefixB)
+        return prefixA < prefixB ? -1 : 1;
+    if (a == b)
+        return 0;
+    return compareTails(&RELATION(a)->key, RELATION_NAME(a), &RELATION(b)->key, RELATION_NAME(b));
+}
+
+
+//Radix tree name index
+
+#if NAME_INDEX == NAME_INDEX_ART
+/*
+ * the names are keyed by their bytes followed by the terminator, so no key is a prefix of another
+ * and every name ends up in a leaf
+ */
+static unsigned char keyByte(const char *name, size_t len, size_t depth) {
+    return depth < len ? (unsigned char)name[depth] : 0;
+}
+
+static t_artNode *artNewNode(unsigned char type) {
+    static const size_t sizes[] = {sizeof(t_artNode4), sizeof(t_artNode16), sizeof(t_artNode48), sizeof(t_artNode256)};
+    t_artNode *node = calloc(1, sizes[type]);
+    node->type = type;
+    return node;
+}
+
+/*
+ * returns where the child reached through key is stored, NULL if there is none
+ */
+static void **artFindChild(t_artNode *node, unsigned char key) {
+    int i;
+
+    switch (node->type) {
+        case ART_NODE4: {
+            t_artNode4 *n = (t_artNode4*)node;
+            for (i = 0; i < node->numChildren; i++) {
+                if (n->keys[i] == key)
+                    return &n->children[i];
+            }
+            return NULL;
+        }
+        case ART_NODE16: {
+            t_artNode16 *n = (t_artNode16*)node;
+#if defined(__SSE2__)
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8((char)key),
+                                                        _mm_loadu_si128((const __m128i*)n->keys)));
+            mask &= (1 << node->numChildren) - 1;
+            return mask != 0 ? &n->children[__builtin_ctz(mask)] : NULL;
+#else
+            for (i = 0; i < node->numChildren; i++) {
+                if (n->keys[i] == key)
+                    return &n->children[i];
+            }
+            return NULL;
+#endif
+        }
+        case ART_NODE48: {
+            t_artNode48 *n = (t_artNode48*)node;
+            return n->index[key] != 0 ? &n->children[n->index[key] - 1] : NULL;
+        }
+        default: {
+            t_artNode256 *n = (t_artNode256*)node;
+            return n->children[key] != NULL ? &n->children[key] : NULL;
+        }
+    }
+}
+
+/*
+ * void artAddChild(void **ref, t_artNode *node, unsigned char key, void *child)
+ *
+ * --- DESCRIPTION ---
+ * adds a child to a node which doesn't have one for key yet. A full node is replaced by a copy of
+ * the next size up, so the pointer the parent keeps is updated too
+ *
+ * --- PARAMETERS ---
+ * ref: where the parent (or the pool) keeps node
+ * node: the node to add the child to
+ * key: the byte leading to the child
+ * child: a node or a leaf
+ */
+static void artAddChild(void **ref, t_artNode *node, unsigned char key, void *child) {
+    int i;
+
+    switch (node->type) {
+        case ART_NODE4:
+        case ART_NODE16: {  //same layout, only the capacity changes
+            unsigned char *keys = node->type == ART_NODE4 ? ((t_artNode4*)node)->keys : ((t_artNode16*)node)->keys;
+            void **children = node->type == ART_NODE4 ? ((t_artNode4*)node)->children : ((t_artNode16*)node)->children;
+            int capacity = node->type == ART_NODE4 ? 4 : 16;
+
+            if (node->numChildren < capacity) {
+                for (i = node->numChildren; i > 0 && keys[i - 1] > key; i--) {    //keeps the keys sorted
+                    keys[i] = keys[i - 1];
+                    children[i] = children[i - 1];
+                }
+                keys[i] = key;
+                children[i] = child;
+                node->numChildren++;
+            }
+            else if (node->type == ART_NODE4) {
+                t_artNode16 *bigger = (t_artNode16*)artNewNode(ART_NODE16);
+                bigger->header = *node;
+                bigger->header.type = ART_NODE16;
+                memcpy(bigger->keys, keys, 4);
+                memcpy(bigger->children, children, 4 * sizeof(void*));
+                free(node);
+                *ref = bigger;
+                artAddChild(ref, &bigger->header, key, child);
+            }
+            else {
+                t_artNode48 *bigger = (t_artNode48*)artNewNode(ART_NODE48);
+                bigger->header = *node;
+                bigger->header.type = ART_NODE48;
+                for (i = 0; i < 16; i++) {
+                    bigger->index[keys[i]] = i + 1;
+                    bigger->children[i] = children[i];
+                }
+                free(node);
+                *ref = bigger;
+                artAddChild(ref, &bigger->header, key, child);
+            }
+            break;
+        }
+        case ART_NODE48: {
+            t_artNode48 *n = (t_artNode48*)node;
+            if (node->numChildren < 48) {   //names are never removed, so the used slots are the first ones
+                n->children[node->numChildren] = child;
+                n->index[key] = ++node->numChildren;
+            }
+            else {
+                t_artNode256 *bigger = (t_artNode256*)artNewNode(ART_NODE256);
+                bigger->header = *node;
+                bigger->header.type = ART_NODE256;
+                for (i = 0; i < 256; i++) {
+                    if (n->index[i] != 0)
+                        bigger->children[i] = n->children[n->index[i] - 1];
+                }
+                free(node);
+                *ref = bigger;
+                artAddChild(ref, &bigger->header, key, child);
+            }
+            break;
+        }
+        default:
+            ((t_artNode256*)node)->children[key] = child;
+            node->numChildren++;
+            break;
+    }
+}
+
+/*
+ * the leaf with the smallest name below node, used to read the bytes of a compressed path
+ * longer than ART_MAX_PREFIX
+ */
+static void *artMinimum(void *node) {
+    int i;
+
+    while (!ART_IS_LEAF(node)) {
+        t_artNode *n = node;
+        switch (n->type) {
+            case ART_NODE4:
+                node = ((t_artNode4*)n)->children[0];
+                break;
+            case ART_NODE16:
+                node = ((t_artNode16*)n)->children[0];
+                break;
+            case ART_NODE48:
+                for (i = 0; ((t_artNode48*)n)->index[i] == 0; i++);
+                node = ((t_artNode48*)n)->children[((t_artNode48*)n)->index[i] - 1];
+                break;
+            default:
+                for (i = 0; ((t_artNode256*)n)->children[i] == NULL; i++);
+                node = ((t_artNode256*)n)->children[i];
+                break;
+        }
+    }
+    return node;
+}
+
+/*
+ * how many bytes of the compressed path of node match the key from depth on
+ */
+static size_t artMismatch(t_artNode *node, const char *key, size_t len, size_t depth) {
+    size_t i, stored = node->prefixLen < ART_MAX_PREFIX ? node->prefixLen : ART_MAX_PREFIX;
+    t_id leaf;
+
+    for (i = 0; i < stored; i++) {
+        if (node->prefix[i] != keyByte(key, len, depth + i))
+            return i;
+    }
+    if (node->prefixLen > ART_MAX_PREFIX) { //the rest of the path is the same for every leaf below
+        leaf = ART_LEAF_ID(artMinimum(node));
+        for (; i < node->prefixLen; i++) {
+            if (keyByte(poolName(leaf), poolLength(leaf), depth + i) != keyByte(key, len, depth + i))
+                return i;
+        }
+    }
+    return i;
+}
+
+/*
+ * returns the string ID of the name, NO_ID if it hasn't been inserted
+ */
+static t_id artSearch(void *node, t_slice name) {
+    size_t depth = 0, i, stored;
+    void **child;
+
+    while (node != NULL) {
+        if (ART_IS_LEAF(node))  //the skipped bytes of the paths still have to be checked
+            return sameName(poolName(ART_LEAF_ID(node)), name) ? ART_LEAF_ID(node) : NO_ID;
+
+        t_artNode *n = node;
+        stored = n->prefixLen < ART_MAX_PREFIX ? n->prefixLen : ART_MAX_PREFIX;
+        for (i = 0; i < stored; i++) {
+            if (n->prefix[i] != keyByte(name.ptr, name.len, depth + i))
+                return NO_ID;
+        }
+        depth += n->prefixLen;
+        if (depth > name.len)
+            return NO_ID;
+        child = artFindChild(n, keyByte(name.ptr, name.len, depth));
+        node = child != NULL ? *child : NULL;
+        depth++;
+    }
+    return NO_ID;
+}
+
+/*
+ * void artInsert(void **ref, t_slice name, t_id id, size_t depth)
+ *
+ * --- DESCRIPTION ---
+ * adds a name which isn't in the tree yet. A leaf met on the way is split into a node holding the
+ * bytes both names share, and so is a compressed path the name leaves halfway
+ *
+ * --- PARAMETERS ---
+ * ref: where the parent (or the pool) keeps the subtree
+ * name: the name to add
+ * id: its string ID, the name must already be in the pool
+ * depth: bytes of the name already matched above the subtree
+ */
+static void artInsert(void **ref, t_slice name, t_id id, size_t depth) {
+    void *node = *ref;
+    t_artNode *newNode;
+    void **child;
+    size_t i;
+
+    if (node == NULL) {
+        *ref = ART_LEAF(id);
+        return;
+    }
+
+    if (ART_IS_LEAF(node)) {
+        const char *other = poolName(ART_LEAF_ID(node));
+        size_t otherLen = poolLength(ART_LEAF_ID(node));
+
+        newNode = artNewNode(ART_NODE4);
+        for (i = depth; keyByte(name.ptr, name.len, i) == keyByte(other, otherLen, i); i++);
+        newNode->prefixLen = i - depth;
+        memcpy(newNode->prefix, name.ptr + depth, newNode->prefixLen < ART_MAX_PREFIX ? newNode->prefixLen : ART_MAX_PREFIX);
+        artAddChild(ref, newNode, keyByte(other, otherLen, i), node);
+        artAddChild(ref, newNode, keyByte(name.ptr, name.len, i), ART_LEAF(id));
+        *ref = newNode;
+        return;
+    }
+
+    t_artNode *n = node;
+    if (n->prefixLen > 0) {
+        i = artMismatch(n, name.ptr, name.len, depth);
+        if (i < n->prefixLen) { //the name leaves the path after i bytes
+            newNode = artNewNode(ART_NODE4);
+            newNode->prefixLen = i;
+            memcpy(newNode->prefix, n->prefix, i < ART_MAX_PREFIX ? i : ART_MAX_PREFIX);
+
+            if (n->prefixLen <= ART_MAX_PREFIX) {
+                artAddChild(ref, newNode, n->prefix[i], n);
+                n->prefixLen -= i + 1;
+                memmove(n->prefix, n->prefix + i + 1, n->prefixLen);
+            }
+            else {  //the bytes that stay with the old node are only on its leaves
+                t_id leaf = ART_LEAF_ID(artMinimum(n));
+                const char *leafName = poolName(leaf);
+                artAddChild(ref, newNode, (unsigned char)leafName[depth + i], n);
+                n->prefixLen -= i + 1;
+                memcpy(n->prefix, leafName + depth + i + 1, n->prefixLen < ART_MAX_PREFIX ? n->prefixLen : ART_MAX_PREFIX);
+            }
+            artAddChild(ref, newNode, keyByte(name.ptr, name.len, depth + i), ART_LEAF(id));
+            *ref = newNode;
+            return;
+        }
+        depth += n->prefixLen;
+    }
+
+    child = artFindChild(n, keyByte(name.ptr, name.len, depth));
+    if (child != NULL)
+        artInsert(child, name, id, depth + 1);
+    else
+        artAddChild(ref, n, keyByte(name.ptr, name.len, depth), ART_LEAF(id));
+}
+
+/*
+ * visits every name below node in order, the terminator sorts before any other byte so shorter
+ * names come first, as with strcmp
+ */
+static void artWalk(void *node, t_nameVisitor visit, void *context) {
+    int i;
+
+    if (node == NULL)
+        return;
+    if (ART_IS_LEAF(node)) {
+        visit(ART_LEAF_ID(node), context);
+        return;
+    }
+
+    t_artNode *n = node;
+    switch (n->type) {
+        case ART_NODE4:
+            for (i = 0; i < n->numChildren; i++)
+                artWalk(((t_artNode4*)n)->children[i], visit, context);
+            break;
+        case ART_NODE16:
+            for (i = 0; i < n->numChildren; i++)
+                artWalk(((t_artNode16*)n)->children[i], visit, context);
+            break;
+        case ART_NODE48:
+            for (i = 0; i < 256; i++) {
+                if (((t_artNode48*)n)->index[i] != 0)
+                    artWalk(((t_artNode48*)n)->children[((t_artNode48*)n)->index[i] - 1], visit, context);
+            }
+            break;
+        default:
+            for (i = 0; i < 256; i++)
+                artWalk(((t_artNode256*)n)->children[i], visit, context);
+            break;
+    }
+}
+
+/*
+ * descends along prefix and walks the subtree where it ends
+ */
+static void artScanPrefix(void *node, t_slice prefix, t_nameVisitor visit, void *context) {
+    size_t depth = 0, i;
+    void **child;
+
+    while (node != NULL) {
+        if (ART_IS_LEAF(node)) {
+            t_id leaf = ART_LEAF_ID(node);
+            if (poolLength(leaf) >= prefix.len && strncmp(poolName(leaf), prefix.ptr, prefix.len) == 0)
+                visit(leaf, context);
+            return;
+        }
+        if (depth == prefix.len) {
+            artWalk(node, visit, context);
+            return;
+        }
+
+        t_artNode *n = node;
+        i = artMismatch(n, prefix.ptr, prefix.len, depth);
+        if (depth + i >= prefix.len) {  //the prefix ends inside the path
+            artWalk(node, visit, context);
+            return;
+        }
+        if (i < n->prefixLen)
+            return;
+        depth += n->prefixLen;
+        child = artFindChild(n, (unsigned char)prefix.ptr[depth]);
+        node = child != NULL ? *child : NULL;
+        depth++;
+    }
+}
+
+/*
+ * adds the nodes below node to counts, one counter per node type
+ */
+static void artCountNodes(void *node, size_t *counts) {
+    int i;
+
+    if (node == NULL || ART_IS_LEAF(node))
+        return;
+
+    t_artNode *n = node;
+    counts[n->type]++;
+    switch (n->type) {
+        case ART_NODE4:
+            for (i = 0; i < n->numChildren; i++)
+                artCountNodes(((t_artNode4*)n)->children[i], counts);
+            break;
+        case ART_NODE16:
+            for (i = 0; i < n->numChildren; i++)
+                artCountNodes(((t_artNode16*)n)->children[i], counts);
+            break;
+        case ART_NODE48:
+            for (i = 0; i < n->numChildren; i++)
+                artCountNodes(((t_artNode48*)n)->children[i], counts);
+            break;
+        default:
+            for (i = 0; i < 256; i++)
+                artCountNodes(((t_artNode256*)n)->children[i], counts);
+            break;
+    }
+}
+
+/*
+ * frees the node and the ones below it, for db_close
+ */
+static void artFree(void *node) {
+    void **children;
+    int i, count;
+
+    if (node == NULL || ART_IS_LEAF(node))
+        return;
+
+    t_artNode *n = node;
+    switch (n->type) {
+        case ART_NODE4:
+            children = ((t_artNode4*)n)->children;
+            count = n->numChildren;
+            break;
+        case ART_NODE16:
+            children = ((t_artNode16*)n)->children;
+            count = n->numChildren;
+            break;
+        case ART_NODE48:
+            children = ((t_artNode48*)n)->children;
+            count = n->numChildren;
+            break;
+        default:
+            children = ((t_artNode256*)n)->children;
+            count = 256;
+            break;
+    }
+    for (i = 0; i < count; i++)
+        artFree(children[i]);
+    free(n);
+}
+#else
+static int compareNames(const void *a, const void *b) {
+    return strcmp(poolName(*(const t_id*)a), poolName(*(const t_id*)b));
+}
+#endif
+
+
+//Hash table name index
+
+#if NAME_INDEX == NAME_INDEX_HASH
+static void initNameTable(t_nameTable *table, size_t size) {
+    table->slots = malloc(size * sizeof(t_nameSlot));
+    memset(table->slots, 0xff, size * sizeof(t_nameSlot));  //all NO_ID
+    table->mask = size - 1;
+    table->count = 0;
+}
+
+/*
+ * t_id tableLookup(t_nameTable *table, uint32_t hashValue, t_slice name)
+ *
+ * --- DESCRIPTION ---
+ * probes the slots from the one the hash points to. Since a name never sits further from its
+ * start than the names it went past, the probe stops as soon as it meets a name closer to its
+ * own start than the probe has gone; the name is only compared when the stored hash matches
+ *
+ * --- PARAMETERS ---
+ * table: the table to look in
+ * hashValue: the hash of the name
+ * name: the name to look for
+ *
+ * --- RETURN VALUES ---
+ * the string ID of the name, NO_ID if it isn't in the table
+ */
+static t_id tableLookup(t_nameTable *table, uint32_t hashValue, t_slice name) {
+    size_t pos = hashValue & table->mask, distance = 0;
+    t_nameSlot *slot;
+
+    while (true) {
+        slot = &table->slots[pos];
+        if (slot->name == NO_ID || ((pos - slot->hash) & table->mask) < distance)
+            return NO_ID;
+        if (slot->hash == hashValue && sameName(poolName(slot->name), name))
+            return slot->name;
+        pos = (pos + 1) & table->mask;
+        distance++;
+    }
+}
+
+/*
+ * adds a name known not to be in the table: whenever the name being placed is further from its
+ * start than the one in the slot, they swap and the probe goes on with the other one
+ */
+static void tableInsert(t_nameTable *table, uint32_t hashValue, t_id name) {
+    t_nameSlot entry = {hashValue, name}, temp;
+    size_t pos = hashValue & table->mask, distance = 0, other;
+
+    while (table->slots[pos].name != NO_ID) {
+        other = (pos - table->slots[pos].hash) & table->mask;
+        if (other < distance) {
+            temp = table->slots[pos];
+            table->slots[pos] = entry;
+            entry = temp;
+            distance = other;
+        }
+        pos = (pos + 1) & table->mask;
+        distance++;
+    }
+    table->slots[pos] = entry;
+    table->count++;
+}
+
+/*
+ * starts moving to a table twice as big: the current one is kept for lookups, and its names are
+ * moved a few at a time by the following insertions (see migrateNames), so no insertion pays for
+ * a whole rehash. The new table can take all the moved names and more than the insertions
+ * needed to move them before it has to grow again
+ */
+static void growNameTable(void) {
+    db->pool.old = db->pool.table;
+    db->pool.migrated = 0;
+    initNameTable(&db->pool.table, (db->pool.old.mask + 1) * 2);
+}
+
+static void migrateNames(size_t steps) {
+    t_nameSlot *slot;
+
+    for (; steps > 0 && db->pool.migrated <= db->pool.old.mask; steps--, db->pool.migrated++) {
+        slot = &db->pool.old.slots[db->pool.migrated];
+        if (slot->name != NO_ID)
+            tableInsert(&db->pool.table, slot->hash, slot->name);
+    }
+    if (db->pool.migrated > db->pool.old.mask) {
+        free(db->pool.old.slots);
+        db->pool.old.slots = NULL;
+    }
+}
+
+/*
+ * adds the probe lengths of the names stored from slot first on to stats, returns how many they are
+ */
+static size_t tableStats(t_nameTable *table, size_t first, t_indexStats *stats) {
+    size_t pos, distance, count = 0;
+
+    for (pos = first; pos <= table->mask; pos++) {
+        if (table->slots[pos].name == NO_ID)
+            continue;
+        distance = (pos - table->slots[pos].hash) & table->mask;
+        stats->averageProbe += distance;
+        if (distance > stats->maxProbe)
+            stats->maxProbe = distance;
+        count++;
+    }
+    return count;
+}
+
+/*
+ * during a resize, the names still in the old table are counted there, where lookups find them
+ */
+static void getIndexStats(t_indexStats *stats) {
+    size_t counted;
+
+    memset(stats, 0, sizeof(t_indexStats));
+    stats->names = db->pool.count;
+    if (db->pool.table.slots == NULL)
+        return;
+    stats->capacity = db->pool.table.mask + 1;
+    stats->loadFactor = (double)db->pool.count / stats->capacity;     //moving names included
+    counted = tableStats(&db->pool.table, 0, stats);
+    if (db->pool.old.slots != NULL) {
+        stats->pendingMigration = db->pool.old.mask + 1 - db->pool.migrated;
+        counted += tableStats(&db->pool.old, db->pool.migrated, stats);
+    }
+    if (counted > 0)
+        stats->averageProbe /= counted;
+}
+#endif
+
+static void printIndexStats(FILE *out) {
+#if NAME_INDEX == NAME_INDEX_ART
+    size_t counts[4] = {0, 0, 0, 0};
+
+    artCountNodes(db->pool.root, counts);
+    fprintf(out, "index: radix tree\nnames: %u\nnodes: %zu node4, %zu node16, %zu node48, %zu node256\n",
+            db->pool.count, counts[ART_NODE4], counts[ART_NODE16], counts[ART_NODE48], counts[ART_NODE256]);
+#else
+    t_indexStats stats;
+
+    getIndexStats(&stats);
+    fprintf(out, "index: hash table\nnames: %zu\nslots: %zu\nload factor: %.3f\n"
+            "average probe length: %.3f\nmax probe length: %zu\nslots left to migrate: %zu\n",
+            stats.names, stats.capacity, stats.loadFactor, stats.averageProbe, stats.maxProbe,
+            stats.pendingMigration);
+#endif
+}
+
+
+//Relation insertion and deletion
+
+/*
+ * the entity of the interned name, NO_ID if the name isn't in the pool or has never been one
+ */
+static t_id findEntity(t_id name) {
+    return name == NO_ID ? NO_ID : db->entityTable[name];
+}
+
+/*
+ * makes the interned name an entity: a new record is added if it has never been one (or the
+ * compactor reclaimed it), a deleted entity becomes valid again
+ */
+static t_id insertEntity(t_id name) {
+    t_entity *newEnt;
+    t_id entity;
+
+    if (db->entityTable[name] != NO_ID) {   //element already exists
+        enableEntity(db->entityTable[name]);
+        return db->entityTable[name];
+    }
+
+    if ((entity = popId(&db->freeEntities)) == NO_ID) {
+        if (db->numEntities == db->capacityEntities) {
+            db->capacityEntities = db->capacityEntities == 0 ? 1024 : db->capacityEntities * 2;
+            db->entities = realloc(db->entities, db->capacityEntities * sizeof(t_entity));
+        }
+        entity = db->numEntities++;
+    }
+    newEnt = ENTITY(entity);
+    newEnt->name = name;
+    newEnt->key = makeKey(poolName(name));
+    newEnt->version = 0;
+    newEnt->relations = NULL;
+    newEnt->outgoing = NULL;
+    newEnt->numOutgoing = 0;
+    newEnt->capacityOutgoing = 0;
+    newEnt->staleOutgoing = 0;
+    db->entityTable[name] = entity;
+    return entity;
+}
+
+/*
+ * an entity can be part of a new relation only if it exists and has not been deleted
+ */
+static bool isValid(t_id entity) {
+    return entity != NO_ID && ENTITY(entity)->version % 2 == 0;
+}
+
+static void enableEntity(t_id entity) {
+    if (ENTITY(entity)->version % 2 != 0)
+        ENTITY(entity)->version++;
+}
+
+/*
+ * void disableEntity(t_id entity)
+ *
+ * --- DESCRIPTION ---
+ * deletes the entity and every edge it is part of. Its outgoing edges lead to the instances it
+ * sends to, the stale ones are skipped; the instances where it is the recipient are found through
+ * the relations it has been a recipient in. The cost is proportional to the degree of the entity,
+ * every count is updated on the spot and the memory of the edges is freed
+ *
+ * --- PARAMETERS ---
+ * entity: the entity to delete
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void disableEntity(t_id entity) {
+    t_relInstance *instance;
+    t_edge *edge;
+    t_id i;
+
+    if (ENTITY(entity)->version % 2 == 0) {
+        loadRelations();    //its edges and relations are only known once they are all loaded
+        ENTITY(entity)->version++;
+        for (i = 0; i < ENTITY(entity)->numOutgoing; i++) {
+            edge = &ENTITY(entity)->outgoing[i];
+            if ((instance = edgeInstance(edge, entity)) != NULL)
+                dropSender(RELATION(edge->relation), instance, entity);
+        }
+        dropIncoming(entity, ENTITY(entity)->relations);
+        ENTITY(entity)->relations = rel_delTree(ENTITY(entity)->relations);
+        freeEdges(entity);     //after dropIncoming, which may count one of them as stale
+    }
+}
+static void dropIncoming(t_id entity, t_relationTree *node) {
+    if (node == NULL)
+        return;
+
+    t_relation *rel = RELATION(node->relation);
+    t_relInstance *instance = findInstance(rel, entity);
+    if (instance != NULL)
+        dropRecipient(rel, instance);
+
+    dropIncoming(entity, node->leftChild);
+    dropIncoming(entity, node->rightChild);
+}
+
+/*
+ * returns the relation with the interned name, loaded if it was still in the snapshot; if absent
+ * and create is true, adds it to the table and to the tree used by the report
+ */
+static t_id getRelation(t_id name, bool create) {
+    t_relation *newRel;
+    t_id rel;
+
+    if ((rel = db->relTable[name]) != NO_ID) {
+        loadRelation(rel);
+        return rel;
+    }
+    if (!create)
+        return NO_ID;
+
+    if ((rel = popId(&db->freeRelations)) == NO_ID) {
+        if (db->numRelations == db->capacityRelations) {
+            db->capacityRelations = db->capacityRelations == 0 ? 64 : db->capacityRelations * 2;
+            db->relations = realloc(db->relations, db->capacityRelations * sizeof(t_relation));
+        }
+        rel = db->numRelations++;
+    }
+    newRel = RELATION(rel);
+    newRel->name = name;
+    newRel->key = makeKey(poolName(name));
+    newRel->root = NULL;
+    newRel->numInstances = 0;
+    newRel->top = NULL;
+    newRel->bottom = NULL;
+    memset(&newRel->fragment, 0, sizeof(t_byteBuffer));
+    newRel->dirty = true;
+    newRel->changed = false;
+    memset(&newRel->arena, 0, sizeof(t_arena));
+    newRel->stored = NULL;
+    newRel->storedSize = 0;
+    db->relTable[name] = rel;
+    addToRelTree(&db->relRoot, rel);
+    return rel;
+}
+
+/*
+ * a new instance has no senders yet, an existing one at least one
+ */
+static void linkEntities(t_id rel, t_id sender, t_id recipient) {
+    t_relInstance *instance = getInstance(rel, recipient);
+
+    if (instance->senders.size == 0) {
+        if (currentShard != NULL)
+            logShardEvent(EVENT_JOIN_RELATION, recipient, rel, NO_ID);
+        else
+            addToRelTree(&ENTITY(recipient)->relations, rel);
+    }
+    addInstanceSender(rel, instance, sender);
+}
+
+static void unlinkEntities(t_id rel, t_id sender, t_id recipient) {
+    t_relInstance *instance = findInstance(RELATION(rel), recipient);
+
+    if (instance != NULL)
+        dropSender(RELATION(rel), instance, sender);
+}
+
+/*
+ * an instance with no senders yet, the caller links it to the index
+ */
+static t_relInstance *newInstance(t_id relId, t_id recipient) {
+    t_relInstance *instance = allocNode(&RELATION(relId)->arena, SLAB_INSTANCE);
+
+#if INSTANCE_INDEX == INSTANCE_INDEX_AVL
+    instance->prefix = ENTITY(recipient)->key.prefix;
+#endif
+    RELATION(relId)->numInstances++;
+    instance->recipient = recipient;
+    instance->senders.size = 0;
+    instance->senders.numContainers = 0;
+    instance->bucket = NULL;
+    instance->nextInBucket = NULL;
+    instance->prevInBucket = NULL;
+    return instance;
+}
+
+/*
+ * adds the sender to the instance, if it wasn't there already, and moves the recipient to the
+ * bucket of its new count
+ */
+static void addInstanceSender(t_id relId, t_relInstance *instance, t_id sender) {
+    if (!addSender(&instance->senders, sender))     //already a sender
+        return;
+    addEdge(sender, relId, instance->recipient);
+    updateBucket(RELATION(relId), instance);
+}
+/*
+ * removes sender from the instance, if it is there, and the instance itself when it is left with
+ * no senders. The recipient then forgets the relation too, so the relations of an entity are
+ * exactly the ones it still receives. The edge of the sender is left behind, see addEdge
+ */
+static void dropSender(t_relation *rel, t_relInstance *instance, t_id sender) {
+    t_id recipient = instance->recipient;
+
+    if (!removeSender(&instance->senders, sender))
+        return;
+    if (currentShard != NULL)
+        logShardEvent(EVENT_STALE_EDGE, sender, NO_ID, NO_ID);
+    else
+        ENTITY(sender)->staleOutgoing++;
+    updateBucket(rel, instance);
+    if (instance->senders.size == 0) {
+        delInstance(rel, instance);
+        if (currentShard != NULL)
+            logShardEvent(EVENT_LEAVE_RELATION, recipient, RELATION_ID(rel), NO_ID);
+        else
+            delFromRelTree(&ENTITY(recipient)->relations, RELATION_ID(rel));
+    }
+}
+/*
+ * removes the instance with all its senders, their edges go stale
+ */
+static void dropRecipient(t_relation *rel, t_relInstance *instance) {
+    staleSenders(&instance->senders);
+    freeSenders(&instance->senders);
+    updateBucket(rel, instance);
+    delInstance(rel, instance);
+}
+/*
+ * void clearRelation(t_id relation)
+ *
+ * --- DESCRIPTION ---
+ * droprel: deletes every instance of the relation at once. Its nodes all come from its arena,
+ * so they aren't freed one by one: the walk only frees the sender sets and removes the relation
+ * from the trees of the recipients; the edges of the senders go stale, the senders are only told
+ * how many. Then the arena is released
+ * as a whole and the record goes back to the free list, as if the compactor had found it empty;
+ * unless reportdiff has yet to say the relation is gone, then the compactor will get it later
+ *
+ * --- PARAMETERS ---
+ * relation: the relation to delete
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void clearRelation(t_id relation) {
+    t_relation *rel = RELATION(relation);
+    t_countBucket *bucket, *lower;
+
+    if (rel->top != NULL)
+        touchRelation(rel);
+    detachInstances(rel);
+    for (bucket = rel->top; bucket != NULL; bucket = lower) {
+        lower = bucket->lower;
+        free(bucket->sorted);
+#if NODE_ALLOCATOR == NODE_ALLOCATOR_MALLOC
+        freeNode(&rel->arena, SLAB_BUCKET, bucket);
+#endif
+    }
+    rel->root = NULL;
+    rel->numInstances = 0;
+    rel->top = NULL;
+    rel->bottom = NULL;
+    if (rel->changed)
+        releaseArena(&rel->arena);
+    else
+        releaseRelation(relation);
+}
+
+/*
+ * cuts the links to the instance from outside the relation
+ */
+static void detachInstance(t_relation *rel, t_relInstance *instance) {
+    delFromRelTree(&ENTITY(instance->recipient)->relations, RELATION_ID(rel));
+    staleSenders(&instance->senders);
+    freeSenders(&instance->senders);
+#if NODE_ALLOCATOR == NODE_ALLOCATOR_MALLOC     //no arena to release, each node goes back on its own
+    freeNode(&rel->arena, SLAB_INSTANCE, instance);
+#endif
+}
+
+//Edges
+
+/*
+ * void addEdge(t_id sender, t_id rel, t_id recipient)
+ *
+ * --- DESCRIPTION ---
+ * the edges of a sender are an array of (relation, recipient) pairs, appended to by every addrel
+ * that adds the sender to an instance. Nothing else touches them: delrel, droprel and the deletion
+ * of a recipient leave them stale, only counting them, and delent of the sender checks each one
+ * against the sender set of its instance, see edgeInstance. A full array is purged if at least
+ * half of it is stale, and grows otherwise: each edge a purge looks at is paid for by an append
+ * since the last one, and no edge is looked up while the links of the sender stay in place
+ *
+ * --- PARAMETERS ---
+ * sender: the entity the edge goes out of
+ * rel: the relation of the instance
+ * recipient: the recipient of the instance
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void addEdge(t_id sender, t_id rel, t_id recipient) {
+    t_entity *ent = ENTITY(sender);
+
+    if (currentShard != NULL) {     //the array is shared by all the relations of the sender
+        logShardEvent(EVENT_ADD_EDGE, sender, rel, recipient);
+        return;
+    }
+    if (ent->numOutgoing == ent->capacityOutgoing && ent->capacityOutgoing > 0
+            && ent->staleOutgoing * 2 >= ent->capacityOutgoing)
+        purgeEdges(sender);
+    if (ent->numOutgoing == ent->capacityOutgoing) {    //mergeShards can count stale edges not added yet
+        ent->capacityOutgoing = ent->capacityOutgoing == 0 ? EDGES_FIRST : ent->capacityOutgoing * 2;
+        ent->outgoing = realloc(ent->outgoing, ent->capacityOutgoing * sizeof(t_edge));
+    }
+    ent->outgoing[ent->numOutgoing].relation = rel;
+    ent->outgoing[ent->numOutgoing++].recipient = recipient;
+}
+
+/*
+ * the instance the edge stands for, if the sender is still in it; NULL for a stale edge. The
+ * relation and the recipient may have been deleted, and their records reused by others: then
+ * the instance the edge finds, if any, is one the sender was added to later, with an edge of
+ * its own, and the answer is still right
+ */
+static t_relInstance *edgeInstance(const t_edge *edge, t_id sender) {
+    t_relInstance *instance;
+
+    if (!isValid(edge->recipient))  //a deleted recipient has no instances, a reclaimed one no name
+        return NULL;
+    instance = findInstance(RELATION(edge->relation), edge->recipient);
+    return instance != NULL && hasSender(&instance->senders, sender) ? instance : NULL;
+}
+
+/*
+ * drops the stale edges of the sender. An edge deleted and added again is there twice, counted
+ * once as stale: the copies are sorted next to each other and only one is kept
+ */
+static void purgeEdges(t_id sender) {
+    t_entity *ent = ENTITY(sender);
+    t_id i, kept = 0;
+
+    for (i = 0; i < ent->numOutgoing; i++)
+        if (edgeInstance(&ent->outgoing[i], sender) != NULL)
+            ent->outgoing[kept++] = ent->outgoing[i];
+    qsort(ent->outgoing, kept, sizeof(t_edge), compareEdges);
+    ent->numOutgoing = 0;
+    for (i = 0; i < kept; i++)
+        if (i == 0 || compareEdges(&ent->outgoing[i - 1], &ent->outgoing[i]) != 0)
+            ent->outgoing[ent->numOutgoing++] = ent->outgoing[i];
+    ent->staleOutgoing = 0;
+}
+
+static int compareEdges(const void *a, const void *b) {
+    const t_edge *edgeA = a, *edgeB = b;
+
+    if (edgeA->relation != edgeB->relation)
+        return edgeA->relation < edgeB->relation ? -1 : 1;
+    return (edgeA->recipient > edgeB->recipient) - (edgeA->recipient < edgeB->recipient);
+}
+
+static void freeEdges(t_id entity) {
+    free(ENTITY(entity)->outgoing);
+    ENTITY(entity)->outgoing = NULL;
+    ENTITY(entity)->numOutgoing = 0;
+    ENTITY(entity)->capacityOutgoing = 0;
+    ENTITY(entity)->staleOutgoing = 0;
+}
+
+//Sender sets
+
+/*
+ * bool addSender(t_senderSet* set, t_id sender)
+ *
+ * --- DESCRIPTION ---
+ * the senders of an instance. Up to SENDER_INLINE of them are kept in the instance itself; past
+ * that they go to containers, one for each value of the upper 16 bits of their IDs. A container
+ * is a sorted array of the lower 16 bits while it is small, a bitmap of all 65536 once it holds
+ * more than CONTAINER_ARRAY_MAX, and goes back to an array when it falls under half of that.
+ * Entity IDs are dense, so most sets have a single container. Every container caches its
+ * cardinality and the set its size: adding, removing and counting senders never walk the set
+ *
+ * --- PARAMETERS ---
+ * set: the sender set
+ * sender: the entity to add
+ *
+ * --- RETURN VALUES ---
+ * true if the sender was added, false if it was already there
+ */
+static bool addSender(t_senderSet *set, t_id sender) {
+    t_container *container;
+    int i;
+
+    if (set->numContainers == 0) {
+        i = findInline(set, sender);
+        if (i < (int)set->size && set->ids[i] == sender)
+            return false;
+        if (set->size < SENDER_INLINE) {
+            memmove(&set->ids[i + 1], &set->ids[i], (set->size - i) * sizeof(t_id));
+            set->ids[i] = sender;
+            set->size++;
+            return true;
+        }
+        spillSenders(set);
+    }
+    if ((container = findContainer(set, sender >> 16)) == NULL)
+        container = addContainer(set, sender >> 16);
+    if (!containerAdd(container, sender & 0xFFFF))
+        return false;
+    set->size++;
+    return true;
+}
+
+/*
+ * removes the sender, if it is there; a set down to half of SENDER_INLINE goes back inline
+ */
+static bool removeSender(t_senderSet *set, t_id sender) {
+    t_container *container;
+    int i;
+
+    if (set->numContainers == 0) {
+        i = findInline(set, sender);
+        if (i == (int)set->size || set->ids[i] != sender)
+            return false;
+        memmove(&set->ids[i], &set->ids[i + 1], (set->size - i - 1) * sizeof(t_id));
+        set->size--;
+        return true;
+    }
+    container = findContainer(set, sender >> 16);
+    if (container == NULL || !containerRemove(container, sender & 0xFFFF))
+        return false;
+    if (container->cardinality == 0)
+        removeContainer(set, container);
+    if (--set->size <= SENDER_INLINE / 2)
+        gatherSenders(set);
+    return true;
+}
+
+static bool hasSender(const t_senderSet *set, t_id sender) {
+    const t_container *container;
+    int i;
+
+    if (set->numContainers == 0) {
+        i = findInline(set, sender);
+        return i < (int)set->size && set->ids[i] == sender;
+    }
+    container = findContainer(set, sender >> 16);
+    return container != NULL && containerHas(container, sender & 0xFFFF);
+}
+
+/*
+ * the instance of the set is going away: each sender has one more stale edge. The bitmaps are
+ * read a word at a time
+ */
+static void staleSenders(const t_senderSet *set) {
+    const t_container *container;
+    uint32_t i, j;
+    uint64_t word;
+
+    if (set->numContainers == 0) {
+        for (i = 0; i < set->size; i++)
+            ENTITY(set->ids[i])->staleOutgoing++;
+        return;
+    }
+    for (container = set->containers; container < set->containers + set->numContainers; container++) {
+        if (container->bitmap) {
+            for (i = 0; i < CONTAINER_WORDS; i++)
+                for (word = container->words[i]; word != 0; word &= word - 1)
+                    ENTITY((t_id)container->high << 16 | i << 6 | __builtin_ctzll(word))->staleOutgoing++;
+        }
+        else
+            for (j = 0; j < container->cardinality; j++)
+                ENTITY((t_id)container->high << 16 | container->array[j])->staleOutgoing++;
+    }
+}
+
+/*
+ * empties the set, giving back the containers
+ */
+static void freeSenders(t_senderSet *set) {
+    uint32_t i;
+
+    if (set->numContainers > 0) {
+        for (i = 0; i < set->numContainers; i++)
+            freeContainer(&set->containers[i]);
+        free(set->containers);
+        senderStats->bytes -= set->capacity * sizeof(t_container);
+    }
+    set->numContainers = 0;
+    set->size = 0;
+}
+
+/*
+ * where the sender is, or would go, among the inline ones
+ */
+static int findInline(const t_senderSet *set, t_id sender) {
+    int i = 0;
+
+    while (i < (int)set->size && set->ids[i] < sender)
+        i++;
+    return i;
+}
+
+static t_container *findContainer(const t_senderSet *set, uint16_t high) {
+    uint32_t low = 0, top = set->numContainers, middle;
+
+    while (low < top) {
+        middle = (low + top) / 2;
+        if (set->containers[middle].high == high)
+            return &set->containers[middle];
+        if (set->containers[middle].high < high)
+            low = middle + 1;
+        else
+            top = middle;
+    }
+    return NULL;
+}
+
+/*
+ * a new empty array container, in its place among the others
+ */
+static t_container *addContainer(t_senderSet *set, uint16_t high) {
+    uint32_t i = 0;
+    t_container *container;
+
+    if (set->numContainers == set->capacity) {
+        senderStats->bytes += set->capacity * sizeof(t_container);
+        set->capacity *= 2;
+        set->containers = realloc(set->containers, set->capacity * sizeof(t_container));
+    }
+    while (i < set->numContainers && set->containers[i].high < high)
+        i++;
+    memmove(&set->containers[i + 1], &set->containers[i], (set->numContainers - i) * sizeof(t_container));
+    set->numContainers++;
+    container = &set->containers[i];
+    container->high = high;
+    container->bitmap = false;
+    container->cardinality = 0;
+    container->capacity = SENDER_INLINE;
+    container->array = malloc(container->capacity * sizeof(uint16_t));
+    senderStats->containers++;
+    senderStats->bytes += container->capacity * sizeof(uint16_t);
+    return container;
+}
+
+static void removeContainer(t_senderSet *set, t_container *container) {
+    uint32_t i = container - set->containers;
+
+    freeContainer(container);
+    memmove(&set->containers[i], &set->containers[i + 1], (set->numContainers - i - 1) * sizeof(t_container));
+    set->numContainers--;
+}
+
+/*
+ * moves the inline senders to containers, the set is full
+ */
+static void spillSenders(t_senderSet *set) {
+    t_id ids[SENDER_INLINE];
+    uint32_t i;
+
+    memcpy(ids, set->ids, sizeof(ids));
+    set->capacity = 1;
+    set->containers = malloc(sizeof(t_container));
+    senderStats->bytes += sizeof(t_container);
+    for (i = 0; i < SENDER_INLINE; i++) {
+        if (set->numContainers == 0 || set->containers[set->numContainers - 1].high != ids[i] >> 16)
+            addContainer(set, ids[i] >> 16);
+        containerAdd(&set->containers[set->numContainers - 1], ids[i] & 0xFFFF);
+    }
+}
+
+/*
+ * the opposite of spillSenders: the few senders left are all in array containers
+ */
+static void gatherSenders(t_senderSet *set) {
+    t_id ids[SENDER_INLINE];
+    uint32_t i, j, count = 0;
+
+    for (i = 0; i < set->numContainers; i++)
+        for (j = 0; j < set->containers[i].cardinality; j++)
+            ids[count++] = (t_id)set->containers[i].high << 16 | set->containers[i].array[j];
+    freeSenders(set);
+    memcpy(set->ids, ids, count * sizeof(t_id));
+    set->size = count;
+}
+
+static bool containerAdd(t_container *container, uint16_t low) {
+    int i;
+
+    if (container->bitmap) {
+        if (container->words[low >> 6] & (1ull << (low & 63)))
+            return false;
+        container->words[low >> 6] |= 1ull << (low & 63);
+        container->cardinality++;
+        return true;
+    }
+    i = containerSearch(container, low);
+    if (i < (int)container->cardinality && container->array[i] == low)
+        return false;
+    if (container->cardinality == CONTAINER_ARRAY_MAX) {
+        arrayToBitmap(container);
+        return containerAdd(container, low);
+    }
+    if (container->cardinality == container->capacity) {
+        senderStats->bytes += container->capacity * sizeof(uint16_t);
+        container->capacity *= 2;
+        container->array = realloc(container->array, container->capacity * sizeof(uint16_t));
+    }
+    memmove(&container->array[i + 1], &container->array[i], (container->cardinality - i) * sizeof(uint16_t));
+    container->array[i] = low;
+    container->cardinality++;
+    return true;
+}
+
+static bool containerRemove(t_container *container, uint16_t low) {
+    int i;
+
+    if (container->bitmap) {
+        if (!(container->words[low >> 6] & (1ull << (low & 63))))
+            return false;
+        container->words[low >> 6] &= ~(1ull << (low & 63));
+        if (--container->cardinality < CONTAINER_ARRAY_MAX / 2)
+            bitmapToArray(container);
+        return true;
+    }
+    i = containerSearch(container, low);
+    if (i == (int)container->cardinality || container->array[i] != low)
+        return false;
+    memmove(&container->array[i], &container->array[i + 1], (container->cardinality - i - 1) * sizeof(uint16_t));
+    container->cardinality--;
+    return true;
+}
+
+static bool containerHas(const t_container *container, uint16_t low) {
+    int i;
+
+    if (container->bitmap)
+        return (container->words[low >> 6] >> (low & 63)) & 1;
+    i = containerSearch(container, low);
+    return i < (int)container->cardinality && container->array[i] == low;
+}
+
+/*
+ * the first position of the array not less than low
+ */
+static int containerSearch(const t_container *container, uint16_t low) {
+    int first = 0, last = container->cardinality, middle;
+
+    while (first < last) {
+        middle = (first + last) / 2;
+        if (container->array[middle] < low)
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    return first;
+}
+
+static void arrayToBitmap(t_container *container) {
+    uint64_t *words = calloc(CONTAINER_WORDS, sizeof(uint64_t));
+    uint32_t i;
+
+    for (i = 0; i < container->cardinality; i++)
+        words[container->array[i] >> 6] |= 1ull << (container->array[i] & 63);
+    senderStats->bytes += CONTAINER_WORDS * sizeof(uint64_t) - container->capacity * sizeof(uint16_t);
+    senderStats->bitmaps++;
+    free(container->array);
+    container->words = words;
+    container->bitmap = true;
+}
+
+/*
+ * the set bits are read a word at a time, lowest first, so the array comes out sorted. There are
+ * fewer than CONTAINER_ARRAY_MAX / 2 of them
+ */
+static void bitmapToArray(t_container *container) {
+    uint16_t *array = malloc(CONTAINER_ARRAY_MAX / 2 * sizeof(uint16_t));
+    uint32_t i, count = 0;
+    uint64_t word;
+
+    for (i = 0; i < CONTAINER_WORDS; i++)
+        for (word = container->words[i]; word != 0; word &= word - 1)
+            array[count++] = i << 6 | __builtin_ctzll(word);
+    senderStats->bytes -= CONTAINER_WORDS * sizeof(uint64_t) - CONTAINER_ARRAY_MAX / 2 * sizeof(uint16_t);
+    senderStats->bitmaps--;
+    free(container->words);
+    container->array = array;
+    container->capacity = CONTAINER_ARRAY_MAX / 2;
+    container->bitmap = false;
+}
+
+static void freeContainer(t_container *container) {
+    if (container->bitmap) {
+        senderStats->bytes -= CONTAINER_WORDS * sizeof(uint64_t);
+        senderStats->bitmaps--;
+        free(container->words);
+    }
+    else {
+        senderStats->bytes -= container->capacity * sizeof(uint16_t);
+        free(container->array);
+    }
+    senderStats->containers--;
+}
+
+//Instance index
+
+#if INSTANCE_INDEX == INSTANCE_INDEX_AVL
+/*
+ * the instance of the recipient, added in the same descent if it wasn't there
+ */
+static t_relInstance *getInstance(t_id rel, t_id recipient) {
+    instanceTreePath path;
+    t_relInstance *instance = instanceTreeLocate(&RELATION(rel)->root, entityKey(recipient), &path);
+
+    if (instance == NULL) {
+        instance = newInstance(rel, recipient);
+        instanceTreeInsertAt(&path, instance);
+    }
+    return instance;
+}
+
+static t_relInstance *findInstance(t_relation *rel, t_id recipient) {
+    return instanceTreeFind(rel->root, entityKey(recipient));
+}
+
+/*
+ * removes the instance from the tree and frees it. The tree relinks nodes rather than copying
+ * them, edges and buckets keep pointing to the right instances
+ */
+static void delInstance(t_relation *rel, t_relInstance *instance) {
+    instanceTreeRemove(&rel->root, entityKey(instance->recipient));
+    rel->numInstances--;
+    freeNode(&rel->arena, SLAB_INSTANCE, instance);
+}
+
+static void detachInstances(t_relation *rel) {
+    detachInstanceTree(rel, rel->root);
+}
+
+static void detachInstanceTree(t_relation *rel, t_relInstance *node) {
+    if (node == NULL)
+        return;
+    detachInstanceTree(rel, node->leftChild);
+    detachInstanceTree(rel, node->rightChild);
+    detachInstance(rel, node);
+}
+
+#else
+/*
+ * t_relInstance *getInstance(t_id rel, t_id recipient)
+ *
+ * --- DESCRIPTION ---
+ * the B+ tree backend of the instances: the keys of the recipients are stored in the nodes, a
+ * few hundred bytes each, so a lookup touches a handful of cache lines rather than one per level.
+ * The instances themselves stay where they were allocated, only the pointers in the leaves move
+ * when a node splits. A full node splits in two on the way back from the insertion; the tree is
+ * never rebalanced on deletion, a node is only freed once it is empty
+ *
+ * --- PARAMETERS ---
+ * rel: the relation
+ * recipient: the entity to find the instance of
+ *
+ * --- RETURN VALUES ---
+ * the instance of the recipient, added if it wasn't there
+ */
+static t_relInstance *getInstance(t_id rel, t_id recipient) {
+    t_relation *relation = RELATION(rel);
+    t_btreeNode *split, *root;
+    t_relInstance *instance;
+    t_treeKey separator;
+
+    if (relation->root == NULL)
+        relation->root = newBtreeNode(relation, true);
+    split = btreeInsert(rel, relation->root, entityKey(recipient), &instance, &separator);
+    if (split != NULL) {    //the tree grows by one level
+        root = newBtreeNode(relation, false);
+        root->count = 1;
+        root->prefix[0] = separator.prefix;
+        root->id[0] = separator.id;
+        root->children[0] = relation->root;
+        root->children[1] = split;
+        relation->root = root;
+    }
+    return instance;
+}
+
+static t_relInstance *findInstance(t_relation *rel, t_id recipient) {
+    t_treeKey key = entityKey(recipient);
+    t_btreeNode *node = rel->root;
+    bool found;
+    int i;
+
+    if (node == NULL)
+        return NULL;
+    while (!node->leaf) {
+        i = btreeLowerBound(node, key, &found);
+        node = node->children[found ? i + 1 : i];
+    }
+    i = btreeLowerBound(node, key, &found);
+    return found ? node->instances[i] : NULL;
+}
+
+/*
+ * removes the key of the instance from its leaf and frees the instance. A leaf left empty is
+ * unchained and freed, and so is every ancestor it leaves without children. A key that is also
+ * a separator higher up is replaced there by the next one: a separator naming a deleted entity
+ * would compare against whatever record the compactor reuses its ID for
+ */
+static void delInstance(t_relation *rel, t_relInstance *instance) {
+    t_btreeNode *path[BTREE_MAX_DEPTH], *node = rel->root, *parent, *next, *holder = NULL;
+    t_treeKey key = entityKey(instance->recipient);
+    int index[BTREE_MAX_DEPTH], depth = 0, i, k, at = 0;
+    bool found;
+
+    while (!node->leaf) {
+        i = btreeLowerBound(node, key, &found);
+        if (found) {
+            holder = node;
+            at = i++;
+        }
+        path[depth] = node;
+        index[depth++] = i;
+        node = node->children[i];
+    }
+    i = btreeLowerBound(node, key, &found);
+    memmove(&node->prefix[i], &node->prefix[i + 1], (node->count - i - 1) * sizeof(uint64_t));
+    memmove(&node->id[i], &node->id[i + 1], (node->count - i - 1) * sizeof(t_id));
+    memmove(&node->instances[i], &node->instances[i + 1], (node->count - i - 1) * sizeof(t_relInstance*));
+    node->count--;
+    rel->numInstances--;
+    freeNode(&rel->arena, SLAB_INSTANCE, instance);
+    if (node->count > 0) {
+        if (holder != NULL) {
+            holder->prefix[at] = node->prefix[0];
+            holder->id[at] = node->id[0];
+        }
+        return;
+    }
+
+    next = node->next;
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+    freeNode(&rel->arena, SLAB_BTREE_NODE, node);
+    while (depth > 0) {
+        parent = path[--depth];
+        if (parent->count == 0) {   //that was its only child
+            freeNode(&rel->arena, SLAB_BTREE_NODE, parent);
+            continue;
+        }
+        i = index[depth];
+        k = i > 0 ? i - 1 : 0;      //the key next to the child goes with it
+        if (parent == holder)
+            holder = NULL;
+        memmove(&parent->prefix[k], &parent->prefix[k + 1], (parent->count - k - 1) * sizeof(uint64_t));
+        memmove(&parent->id[k], &parent->id[k + 1], (parent->count - k - 1) * sizeof(t_id));
+        memmove(&parent->children[i], &parent->children[i + 1], (parent->count - i) * sizeof(t_btreeNode*));
+        parent->count--;
+        if (holder != NULL) {   //the subtree right of the separator goes on with the next leaf
+            holder->prefix[at] = next->prefix[0];
+            holder->id[at] = next->id[0];
+        }
+        while (!rel->root->leaf && rel->root->count == 0) {    //a root with a single child is dropped
+            node = rel->root;
+            rel->root = node->children[0];
+            freeNode(&rel->arena, SLAB_BTREE_NODE, node);
+        }
+        return;
+    }
+    rel->root = NULL;   //that was the last leaf
+}
+
+/*
+ * droprel goes through the leaves in order, the nodes go away with the arena
+ */
+static void detachInstances(t_relation *rel) {
+    t_btreeNode *leaf;
+    int i;
+
+    for (leaf = btreeFirstLeaf(rel->root); leaf != NULL; leaf = leaf->next)
+        for (i = 0; i < leaf->count; i++)
+            detachInstance(rel, leaf->instances[i]);
+#if NODE_ALLOCATOR == NODE_ALLOCATOR_MALLOC
+    btreeFree(&rel->arena, rel->root);
+#endif
+}
+
+static t_btreeNode *newBtreeNode(t_relation *rel, bool leaf) {
+    t_btreeNode *node = allocNode(&rel->arena, SLAB_BTREE_NODE);
+
+    node->count = 0;
+    node->leaf = leaf;
+    if (leaf) {
+        node->next = NULL;
+        node->prev = NULL;
+    }
+    return node;
+}
+
+/*
+ * the first key of the node that is not less than key, found is set if it is equal. The prefixes
+ * settle most comparisons without touching the names
+ */
+static int btreeLowerBound(const t_btreeNode *node, t_treeKey key, bool *found) {
+    int low = 0, high = node->count, middle, cmp;
+
+    *found = false;
+    while (low < high) {
+        middle = (low + high) / 2;
+        cmp = compareEntities(key.prefix, key.id, node->prefix[middle], node->id[middle]);
+        if (cmp == 0) {
+            *found = true;
+            return middle;
+        }
+        if (cmp < 0)
+            high = middle;
+        else
+            low = middle + 1;
+    }
+    return low;
+}
+
+/*
+ * t_btreeNode *btreeInsert(t_id rel, t_btreeNode* node, t_treeKey key, t_relInstance** instance, t_treeKey* separator)
+ *
+ * --- DESCRIPTION ---
+ * finds the key under node, adding a new instance for it if absent. A node that gets one key too
+ * many splits: a leaf keeps the lower half and chains the upper one after itself, an inner node
+ * moves its middle key up
+ *
+ * --- PARAMETERS ---
+ * rel: the relation, whose arena the nodes come from
+ * node: the subtree to insert in
+ * key: the key of the recipient
+ * instance: returns the instance of the recipient
+ * separator: returns the first key of the new node, if there is one
+ *
+ * --- RETURN VALUES ---
+ * the node split off from node, to be added to its parent after separator; NULL if none
+ */
+static t_btreeNode *btreeInsert(t_id rel, t_btreeNode *node, t_treeKey key, t_relInstance **instance, t_treeKey *separator) {
+    uint64_t prefix[BTREE_KEYS + 1];
+    t_id id[BTREE_KEYS + 1];
+    void *pointers[BTREE_KEYS + 2];     //instances of a leaf, children of an inner node
+    t_btreeNode *split, *right;
+    int i, total, half;
+    bool found;
+
+    i = btreeLowerBound(node, key, &found);
+    if (node->leaf) {
+        if (found) {
+            *instance = node->instances[i];
+            return NULL;
+        }
+        *instance = newInstance(rel, key.id);
+        split = (t_btreeNode*)*instance;
+    }
+    else {
+        split = btreeInsert(rel, node->children[found ? i + 1 : i], key, instance, separator);
+        if (split == NULL)
+            return NULL;
+        key = *separator;
+        i = found ? i + 1 : i;
+    }
+
+    if (node->count < BTREE_KEYS) {     //room for one more
+        memmove(&node->prefix[i + 1], &node->prefix[i], (node->count - i) * sizeof(uint64_t));
+        memmove(&node->id[i + 1], &node->id[i], (node->count - i) * sizeof(t_id));
+        node->prefix[i] = key.prefix;
+        node->id[i] = key.id;
+        if (node->leaf) {
+            memmove(&node->instances[i + 1], &node->instances[i], (node->count - i) * sizeof(t_relInstance*));
+            node->instances[i] = *instance;
+        }
+        else {
+            memmove(&node->children[i + 2], &node->children[i + 1], (node->count - i) * sizeof(t_btreeNode*));
+            node->children[i + 1] = split;
+        }
+        node->count++;
+        return NULL;
+    }
+
+    //full: the keys and pointers are laid out with the new one, then shared between two nodes
+    total = BTREE_KEYS + 1;
+    memcpy(prefix, node->prefix, i * sizeof(uint64_t));
+    memcpy(id, node->id, i * sizeof(t_id));
+    prefix[i] = key.prefix;
+    id[i] = key.id;
+    memcpy(&prefix[i + 1], &node->prefix[i], (BTREE_KEYS - i) * sizeof(uint64_t));
+    memcpy(&id[i + 1], &node->id[i], (BTREE_KEYS - i) * sizeof(t_id));
+    right = newBtreeNode(RELATION(rel), node->leaf);
+    half = total / 2;
+    if (node->leaf) {
+        memcpy(pointers, node->instances, i * sizeof(void*));
+        pointers[i] = *instance;
+        memcpy(&pointers[i + 1], &node->instances[i], (BTREE_KEYS - i) * sizeof(void*));
+        node->count = total - half;
+        right->count = half;
+        memcpy(node->prefix, prefix, node->count * sizeof(uint64_t));
+        memcpy(node->id, id, node->count * sizeof(t_id));
+        memcpy(node->instances, pointers, node->count * sizeof(void*));
+        memcpy(right->prefix, &prefix[node->count], half * sizeof(uint64_t));
+        memcpy(right->id, &id[node->count], half * sizeof(t_id));
+        memcpy(right->instances, &pointers[node->count], half * sizeof(void*));
+        right->next = node->next;
+        right->prev = node;
+        if (node->next != NULL)
+            node->next->prev = right;
+        node->next = right;
+        separator->prefix = right->prefix[0];
+        separator->id = right->id[0];
+    }
+    else {      //the middle key goes up, each side keeps the children around its keys
+        memcpy(pointers, node->children, (i + 1) * sizeof(void*));
+        pointers[i + 1] = split;
+        memcpy(&pointers[i + 2], &node->children[i + 1], (BTREE_KEYS - i) * sizeof(void*));
+        node->count = half;
+        right->count = total - half - 1;
+        memcpy(node->prefix, prefix, half * sizeof(uint64_t));
+        memcpy(node->id, id, half * sizeof(t_id));
+        memcpy(node->children, pointers, (half + 1) * sizeof(void*));
+        separator->prefix = prefix[half];
+        separator->id = id[half];
+        memcpy(right->prefix, &prefix[half + 1], right->count * sizeof(uint64_t));
+        memcpy(right->id, &id[half + 1], right->count * sizeof(t_id));
+        memcpy(right->children, &pointers[half + 1], (right->count + 1) * sizeof(void*));
+    }
+    return right;
+}
+
+static t_btreeNode *btreeFirstLeaf(t_btreeNode *node) {
+    while (node != NULL && !node->leaf)
+        node = node->children[0];
+    return node;
+}
+
+#if NODE_ALLOCATOR == NODE_ALLOCATOR_MALLOC     //the slabs free the nodes with the arena
+static void btreeFree(t_arena *arena, t_btreeNode *node) {
+    int i;
+
+    if (node == NULL)
+        return;
+    if (!node->leaf)
+        for (i = 0; i <= node->count; i++)
+            btreeFree(arena, node->children[i]);
+    freeNode(arena, SLAB_BTREE_NODE, node);
+}
+#endif
+
+/*
+ * the recipients of the bucket in order, straight from the leaves: when the bucket holds a good
+ * part of the instances this beats sorting it. Returns how many were found
+ */
+static t_id scanBucket(t_relation *rel, t_countBucket *bucket) {
+    t_btreeNode *leaf;
+    t_id found = 0;
+    int i;
+
+    for (leaf = btreeFirstLeaf(rel->root); leaf != NULL && found < bucket->size; leaf = leaf->next)
+        for (i = 0; i < leaf->count; i++)
+            if (leaf->instances[i]->bucket == bucket)
+                bucket->sorted[found++] = leaf->instances[i]->recipient;
+    return found;
+}
+#endif
+
+
+//Count buckets
+
+/*
+ * void updateBucket(t_relation *rel, t_relInstance *instance)
+ *
+ * --- DESCRIPTION ---
+ * moves the recipient of an instance whose sender count has changed to the bucket of the new
+ * count, creating it if needed; a bucket left empty is freed. The buckets of a relation form a
+ * list sorted by count and the search starts from the current bucket, so the usual change by one
+ * only looks at a neighbour, and the recipients of a bucket are a plain list: moving one takes
+ * constant time, the order by name is only needed by the report. Leaving or joining the top
+ * bucket makes the relation dirty
+ *
+ * --- PARAMETERS ---
+ * rel: the relation the instance belongs to
+ * instance: the instance, its sender set already has the new size
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void updateBucket(t_relation *rel, t_relInstance *instance) {
+    t_countBucket *from = instance->bucket, *to = NULL, *cursor;
+    int count = instance->senders.size;
+
+    if (from != NULL && from->count == count)
+        return;
+    if (from != NULL && from == rel->top)
+        touchRelation(rel);
+
+    if (count > 0) {
+        cursor = from != NULL ? from : rel->bottom;
+        if (cursor == NULL)
+            to = newBucket(rel, count, NULL, NULL);
+        else {
+            while (cursor->count < count && cursor->higher != NULL && cursor->higher->count <= count)
+                cursor = cursor->higher;
+            while (cursor->count > count && cursor->lower != NULL && cursor->lower->count >= count)
+                cursor = cursor->lower;
+
+            if (cursor->count == count)
+                to = cursor;
+            else if (cursor->count < count)
+                to = newBucket(rel, count, cursor, cursor->higher);
+            else
+                to = newBucket(rel, count, cursor->lower, cursor);
+        }
+    }
+
+    if (from != NULL) {
+        if (instance->prevInBucket != NULL)
+            instance->prevInBucket->nextInBucket = instance->nextInBucket;
+        else
+            from->first = instance->nextInBucket;
+        if (instance->nextInBucket != NULL)
+            instance->nextInBucket->prevInBucket = instance->prevInBucket;
+        from->size--;
+        from->isSorted = false;
+        if (from->size == 0)
+            freeBucket(rel, from);
+    }
+    if (to != NULL) {
+        instance->prevInBucket = NULL;
+        instance->nextInBucket = to->first;
+        if (to->first != NULL)
+            to->first->prevInBucket = instance;
+        to->first = instance;
+        to->size++;
+        to->isSorted = false;
+        if (to == rel->top)
+            touchRelation(rel);
+    }
+    instance->bucket = to;
+}
+
+/*
+ * links an empty bucket between lower and higher, either can be NULL at the ends of the list
+ */
+static t_countBucket *newBucket(t_relation *rel, int count, t_countBucket *lower, t_countBucket *higher) {
+    t_countBucket *bucket = allocNode(&rel->arena, SLAB_BUCKET);
+
+    bucket->count = count;
+    bucket->first = NULL;
+    bucket->size = 0;
+    bucket->sorted = NULL;
+    bucket->isSorted = false;
+    bucket->lower = lower;
+    bucket->higher = higher;
+    if (lower != NULL)
+        lower->higher = bucket;
+    else
+        rel->bottom = bucket;
+    if (higher != NULL)
+        higher->lower = bucket;
+    else
+        rel->top = bucket;
+    return bucket;
+}
+
+static void freeBucket(t_relation *rel, t_countBucket *bucket) {
+    if (bucket->lower != NULL)
+        bucket->lower->higher = bucket->higher;
+    else
+        rel->bottom = bucket->higher;
+    if (bucket->higher != NULL)
+        bucket->higher->lower = bucket->lower;
+    else
+        rel->top = bucket->lower;
+    free(bucket->sorted);
+    freeNode(&rel->arena, SLAB_BUCKET, bucket);
+}
+
+/*
+ * sorts the recipients of the bucket by name, unless they are already since its last change
+ */
+static void sortBucket(t_relation *rel, t_countBucket *bucket) {
+    t_relInstance *instance;
+    t_id i;
+
+    if (bucket->isSorted)
+        return;
+    bucket->sorted = realloc(bucket->sorted, bucket->size * sizeof(t_id));
+#if INSTANCE_INDEX == INSTANCE_INDEX_BTREE
+    if ((size_t)bucket->size * BTREE_SCAN_RATIO >= rel->numInstances)
+        scanBucket(rel, bucket);
+    else
+#else
+    (void)rel;
+#endif
+    {
+        for (i = 0, instance = bucket->first; instance != NULL; instance = instance->nextInBucket)
+            bucket->sorted[i++] = instance->recipient;
+        qsort(bucket->sorted, bucket->size, sizeof(t_id), compareRecipients);
+    }
+    bucket->isSorted = true;
+}
+static int compareRecipients(const void *a, const void *b) {
+    t_id first = *(const t_id*)a, second = *(const t_id*)b;
+    return compareEntities(ENTITY(first)->key.prefix, first, ENTITY(second)->key.prefix, second);
+}
+
+
+
+//Compaction
+
+/*
+ * void compact(int budget)
+ *
+ * --- DESCRIPTION ---
+ * the instances and sender sets are freed as soon as they die, what is left behind are the
+ * records: a deleted entity keeps its slot and its name in entityTable, a relation whose instances
+ * are all gone stays in the arrays and in the tree walked by every report. The compactor sweeps
+ * both arrays a few records at a time, after each command, and puts the dead ones on a free list
+ * the next addent or addrel takes from. A reclaimed name is simply unknown again, the string stays
+ * interned since the dictionary of a binary input may still refer to it
+ *
+ * --- PARAMETERS ---
+ * budget: how many records to look at, the sweep goes on from there at the next call
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void compact(int budget) {
+    while (budget-- > 0) {
+        if (db->compactor.nextEntity < db->numEntities) {
+            if (reclaimEntity(db->compactor.nextEntity))
+                db->compactor.entities++;
+            db->compactor.nextEntity++;
+        }
+        else if (db->compactor.nextRelation < db->numRelations) {
+            if (reclaimRelation(db->compactor.nextRelation))
+                db->compactor.relations++;
+            db->compactor.nextRelation++;
+        }
+        else {  //nothing left to look at, start over at the next command
+            db->compactor.nextEntity = 0;
+            db->compactor.nextRelation = 0;
+            db->compactor.passes++;
+            return;
+        }
+        db->compactor.scanned++;
+    }
+}
+
+/*
+ * a deleted entity has no edges and no relations left, see disableEntity. A reclaimed record has
+ * no name; the stale edges of other entities may still point to it, see edgeInstance
+ */
+static bool reclaimEntity(t_id entity) {
+    t_entity *ent = ENTITY(entity);
+
+    if (ent->name == NO_ID || ent->version % 2 == 0)
+        return false;
+    db->entityTable[ent->name] = NO_ID;
+    ent->name = NO_ID;
+    pushId(&db->freeEntities, entity);
+    return true;
+}
+
+/*
+ * a relation with no instances has no buckets either, and no entity has it among its relations.
+ * One reportdiff hasn't looked at yet is kept: its name and its last fragment are still needed;
+ * so is one whose instances are still in the snapshot
+ */
+static bool reclaimRelation(t_id relation) {
+    t_relation *rel = RELATION(relation);
+
+    if (rel->name == NO_ID || rel->root != NULL || rel->changed || rel->stored != NULL)
+        return false;
+    releaseRelation(relation);
+    return true;
+}
+
+/*
+ * the relation must have no instances left; its arena, which may still hold freed nodes, is
+ * given back too
+ */
+static void releaseRelation(t_id relation) {
+    t_relation *rel = RELATION(relation);
+
+    releaseArena(&rel->arena);
+    free(rel->fragment.data);
+    memset(&rel->fragment, 0, sizeof(t_byteBuffer));
+    delFromRelTree(&db->relRoot, relation);
+    db->relTable[rel->name] = NO_ID;
+    rel->name = NO_ID;
+    pushId(&db->freeRelations, relation);
+}
+
+static void pushId(t_idStack *stack, t_id id) {
+    if (stack->count == stack->capacity) {
+        stack->capacity = stack->capacity == 0 ? 64 : stack->capacity * 2;
+        stack->ids = realloc(stack->ids, stack->capacity * sizeof(t_id));
+    }
+    stack->ids[stack->count++] = id;
+}
+
+static t_id popId(t_idStack *stack) {
+    return stack->count == 0 ? NO_ID : stack->ids[--stack->count];
+}
+
+static void printCompactionStats(FILE *out) {
+    fprintf(out, "compaction budget: %d records per command\nrecords scanned: %llu\nsweeps: %llu\n"
+            "entities reclaimed: %llu (%u free)\nrelations reclaimed: %llu (%u free)\nbytes reclaimed: %llu\n",
+            COMPACT_BUDGET, db->compactor.scanned, db->compactor.passes, db->compactor.entities, db->freeEntities.count,
+            db->compactor.relations, db->freeRelations.count,
+            db->compactor.entities * sizeof(t_entity) + db->compactor.relations * (sizeof(t_relation) + sizeof(t_relationTree)));
+}
+
+
+//Node allocation
+
+/*
+ * void *allocNode(t_arena* arena, t_slabType type)
+ *
+ * --- DESCRIPTION ---
+ * every tree node, edge and bucket comes from an arena: the one of its relation, or treeArena
+ * for the relation trees. An arena hands out the nodes of the type freed last first, then
+ * carves new ones from its last chunk. Chunks are only given back when the whole arena is
+ * released, see releaseArena. With NODE_ALLOCATOR_MALLOC the nodes go through malloc instead,
+ * the counters are kept the same way
+ *
+ * --- PARAMETERS ---
+ * arena: where the node is taken from
+ * type: the kind of node, which is also its size
+ *
+ * --- RETURN VALUES ---
+ * the node, not initialized
+ */
+static void *allocNode(t_arena *arena, t_slabType type) {
+    size_t size = slabs[type].size;
+    void *node;
+
+    arena->live[type]++;
+#if NODE_ALLOCATOR == NODE_ALLOCATOR_MALLOC
+    node = malloc(size);
+#else
+    if (arena->free[type] != NULL) {
+        node = arena->free[type];
+        arena->free[type] = *(void**)node;
+        arena->freed[type]--;
+        return node;
+    }
+    if ((size_t)(arena->end[type] - arena->next[type]) < size)
+        growArena(arena, type);
+    node = arena->next[type];
+    arena->next[type] += size;
+#endif
+    return node;
+}
+
+static void freeNode(t_arena *arena, t_slabType type, void *node) {
+    arena->live[type]--;
+#if NODE_ALLOCATOR == NODE_ALLOCATOR_MALLOC
+    free(node);
+#else
+    *(void**)node = arena->free[type];
+    arena->free[type] = node;
+    arena->freed[type]++;
+#endif
+}
+
+#if NODE_ALLOCATOR == NODE_ALLOCATOR_SLAB
+/*
+ * each type has chunks of its own, so the nodes walked together stay close. Small arenas stay
+ * small, a chunk is twice the previous one of the same type. Chunks of a huge page try reserved
+ * huge pages first, then transparent ones, malloc if even mmap fails. The rest of the previous
+ * chunk is too small for the node and stays unused
+ */
+static void growArena(t_arena *arena, t_slabType type) {
+    size_t size = arena->chunkSize[type] == 0 ? ARENA_FIRST_CHUNK : arena->chunkSize[type] * 2;
+    t_chunk *chunk = MAP_FAILED;
+
+    if (size >= SLAB_CHUNK_SIZE) {
+        size = SLAB_CHUNK_SIZE;
+        chunk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (chunk == MAP_FAILED) {
+            chunk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+            if (chunk != MAP_FAILED)
+                madvise(chunk, size, MADV_HUGEPAGE);
+#endif
+        }
+    }
+    if (chunk == MAP_FAILED) {
+        chunk = malloc(size);
+        chunk->mapped = false;
+    }
+    else
+        chunk->mapped = true;
+    chunk->size = size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->chunkSize[type] = size;
+    arena->reserved += size;
+    arena->next[type] = (char*)chunk + sizeof(t_chunk);
+    arena->end[type] = (char*)chunk + size;
+}
+#endif
+
+/*
+ * gives back every chunk, whatever nodes are still in them
+ */
+static void releaseArena(t_arena *arena) {
+    t_chunk *chunk, *next;
+
+    for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        if (chunk->mapped)
+            munmap(chunk, chunk->size);
+        else
+            free(chunk);
+    }
+    memset(arena, 0, sizeof(t_arena));
+}
+
+/*
+ * what the memstats command prints: for each kind of node how many are in use, how many are
+ * free to be reused and the bytes they take, summed over all the arenas, then the bytes the
+ * arenas reserved. Entities and relations live in arrays, their free records are the ones
+ * reclaimed by the compactor; the edges are in arrays too, one per sender, where the stale ones
+ * count as free. The containers of the sender sets are malloced, they come last
+ */
+static void printMemStats(FILE *out) {
+    size_t live[NUM_SLABS], freed[NUM_SLABS], reserved = 0, edges = 0, edgeSlots = 0;
+    t_arena *arena;
+    t_id i;
+    int type;
+
+    memset(live, 0, sizeof(live));
+    memset(freed, 0, sizeof(freed));
+    for (i = 0; i <= db->numRelations; i++) {
+        arena = i < db->numRelations ? &RELATION(i)->arena : &db->treeArena;
+        for (type = 0; type < NUM_SLABS; type++) {
+            live[type] += arena->live[type];
+            freed[type] += arena->freed[type];
+        }
+        reserved += arena->reserved;
+    }
+    for (i = 0; i < db->numEntities; i++) {
+        edges += ENTITY(i)->numOutgoing - ENTITY(i)->staleOutgoing;
+        edgeSlots += ENTITY(i)->capacityOutgoing;
+    }
+
+    fprintf(out, "%s: %u live, %u free, %zu bytes each, %zu bytes\n", "entities", db->numEntities - db->freeEntities.count,
+            db->freeEntities.count, sizeof(t_entity), db->capacityEntities * sizeof(t_entity));
+    fprintf(out, "%s: %u live, %u free, %zu bytes each, %zu bytes\n", "relations", db->numRelations - db->freeRelations.count,
+            db->freeRelations.count, sizeof(t_relation), db->capacityRelations * sizeof(t_relation));
+    for (type = 0; type < NUM_SLABS; type++)
+        fprintf(out, "%s: %zu live, %zu free, %zu bytes each, %zu bytes\n", slabs[type].name, live[type],
+                freed[type], slabs[type].size, (live[type] + freed[type]) * slabs[type].size);
+    fprintf(out, "%s: %zu live, %zu free, %zu bytes each, %zu bytes\n", "edges", edges, edgeSlots - edges,
+            sizeof(t_edge), edgeSlots * sizeof(t_edge));
+    fprintf(out, "arenas: %zu bytes reserved\n", reserved);
+    fprintf(out, "sender sets: %zu containers, %zu of them bitmaps, %zu bytes\n", db->senderStats.containers,
+            db->senderStats.bitmaps, db->senderStats.bytes);
+    if (db->snapshot.map != NULL)
+        fprintf(out, "snapshot: %u relations not loaded, %zu bytes mapped\n", db->snapshot.pending, db->snapshot.size);
+}
+
+/*
+ * the bytes the database holds, as one number: the arrays, the names and their index, the arenas
+ * (their nodes, with the malloc allocator), the edges, the sender sets, the rendered reports, the
+ * snapshot still mapped and the group of the log. It walks the records like printMemStats, and the radix tree too
+ */
+static size_t heldBytes() {
+    size_t bytes = db->capacityEntities * sizeof(t_entity) + db->capacityRelations * sizeof(t_relation);
+    t_arena *arena;
+    t_id i;
+#if NAME_INDEX == NAME_INDEX_ART
+    size_t nodes[4] = {0, 0, 0, 0};
+#endif
+#if NODE_ALLOCATOR == NODE_ALLOCATOR_MALLOC
+    int type;
+#endif
+
+    bytes += db->pool.capacity + db->pool.capacityIds * (sizeof(size_t) + 2 * sizeof(t_id));
+#if NAME_INDEX == NAME_INDEX_ART
+    artCountNodes(db->pool.root, nodes);
+    bytes += nodes[ART_NODE4] * sizeof(t_artNode4) + nodes[ART_NODE16] * sizeof(t_artNode16) +
+             nodes[ART_NODE48] * sizeof(t_artNode48) + nodes[ART_NODE256] * sizeof(t_artNode256);
+#else
+    if (db->pool.table.slots != NULL)
+        bytes += (db->pool.table.mask + 1) * sizeof(t_nameSlot);
+    if (db->pool.old.slots != NULL)
+        bytes += (db->pool.old.mask + 1) * sizeof(t_nameSlot);
+#endif
+    for (i = 0; i <= db->numRelations; i++) {
+        arena = i < db->numRelations ? &RELATION(i)->arena : &db->treeArena;
+#if NODE_ALLOCATOR == NODE_ALLOCATOR_MALLOC
+        for (type = 0; type < NUM_SLABS; type++)
+            bytes += (arena->live[type] + arena->freed[type]) * slabs[type].size;
+#else
+        bytes += arena->reserved;
+#endif
+        if (i < db->numRelations)
+            bytes += RELATION(i)->fragment.capacity;
+    }
+    for (i = 0; i < db->numEntities; i++)
+        bytes += ENTITY(i)->capacityOutgoing * sizeof(t_edge);
+    return bytes + db->senderStats.bytes + db->lastReport.capacity + db->diffReport.capacity + db->snapshot.size +
+           db->log.group.capacity;
+}
+
+
+
+//Balanced trees
+
+static t_treeKey entityKey(t_id entity) {
+    t_treeKey key = {ENTITY(entity)->key.prefix, entity};
+    return key;
+}
+
+static t_treeKey relationKey(t_id relation) {
+    t_treeKey key = {RELATION(relation)->key.prefix, relation};
+    return key;
+}
+
+#if INSTANCE_INDEX == INSTANCE_INDEX_AVL
+static int compareInstance(t_treeKey key, const t_relInstance *node) {
+    return compareEntities(key.prefix, key.id, node->prefix, node->recipient);
+}
+#endif
+
+static int compareRelationNode(t_treeKey key, const t_relationTree *node) {
+    return compareRelations(key.prefix, key.id, node->prefix, node->relation);
+}
+
+/*
+ * adds the relation to the tree if it isn't there
+ */
+static void addToRelTree(t_relationTree **root, t_id rel) {
+    relationTreePath path;
+    t_relationTree *node;
+
+    if (relationTreeLocate(root, relationKey(rel), &path) != NULL)
+        return;
+    node = allocNode(&db->treeArena, SLAB_RELATION_TREE);
+    node->prefix = RELATION(rel)->key.prefix;
+    node->relation = rel;
+    relationTreeInsertAt(&path, node);
+}
+
+/*
+ * removes the relation from the tree, if it is there
+ */
+static void delFromRelTree(t_relationTree **root, t_id rel) {
+    t_relationTree *node = relationTreeRemove(root, relationKey(rel));
+
+    if (node != NULL)
+        freeNode(&db->treeArena, SLAB_RELATION_TREE, node);
+}
+
+/*
+ * frees the whole tree, returns NULL to store in its root
+ */
+static t_relationTree *rel_delTree(t_relationTree *node) {
+    if (node == NULL)
+        return NULL;
+    node->leftChild = rel_delTree(node->leftChild);
+    node->rightChild = rel_delTree(node->rightChild);
+    freeNode(&db->treeArena, SLAB_RELATION_TREE, node);
+    return NULL;
+}
+
+/*
+ * names are stored without quotes, the report prints them in the same format they came in
+ */
+static void putName(t_byteBuffer *buffer, t_id name) {
+    putBytes(buffer, "\"", 1);
+    putBytes(buffer, poolName(name), poolLength(name));
+    putBytes(buffer, "\" ", 2);
+}
+
+//misc
+
+/*
+ * uint64_t hash(t_slice string, uint64_t seed)
+ *
+ * --- DESCRIPTION ---
+ * a wyhash-style hash: the name is read 16 bytes at a time, and every read is folded into the
+ * state with a 64x64->128 bit multiplication, xoring the two halves of the product. Names up to
+ * 16 bytes (most of them) take a couple of overlapping reads and three multiplications
+ *
+ * --- PARAMETERS ---
+ * string: the name to hash, without quotes
+ * seed: changes every hash value, so colliding names can't be chosen in advance
+ *
+ * --- RETURN VALUES ---
+ * the 64-bit hash of the name
+ */
+static uint64_t hash(t_slice string, uint64_t seed) {
+    const uint64_t secret0 = 0xa0761d6478bd642full, secret1 = 0xe7037ed1a0b428dbull;
+    const unsigned char *p = (const unsigned char*)string.ptr;
+    size_t left = string.len;
+    uint64_t a, b, state = seed ^ mix(seed ^ secret0, secret1);
+
+    if (left <= 16) {
+        if (left >= 4) {
+            a = (read32(p) << 32) | read32(p + ((left >> 3) << 2));
+            b = (read32(p + left - 4) << 32) | read32(p + left - 4 - ((left >> 3) << 2));
+        }
+        else if (left > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[left >> 1] << 8) | p[left - 1];
+            b = 0;
+        }
+        else
+            a = b = 0;
+    }
+    else {
+        for (; left > 16; left -= 16, p += 16)
+            state = mix(read64(p) ^ secret1, read64(p + 8) ^ state);
+        a = read64(p + left - 16);  //the last 16 bytes, some may have been read already
+        b = read64(p + left - 8);
+    }
+    return mix(secret1 ^ string.len, mix(a ^ secret1, b ^ state));
+}
+
+static uint64_t mix(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/*
+ * adds the fragment of the relation to the report, rendering it first if it is out of date. A
+ * relation still in the snapshot has the fragment it was saved with
+ */
+static int printSingleReport(t_relation *relation) {
+    if (relation->top == NULL && relation->stored == NULL) {
+        relation->fragment.size = 0;    //not printed, for reportdiff
+        return 0;
+    }
+    if (relation->dirty)
+        renderRelation(relation, &relation->fragment);
+    putBytes(&db->lastReport, relation->fragment.data, relation->fragment.size);
+    return 1;
+}
+
+static void renderRelation(t_relation *relation, t_byteBuffer *fragment) {
+    char count[16];
+    t_id i;
+
+    fragment->size = 0;
+    putName(fragment, relation->name);
+    sortBucket(relation, relation->top);
+    for (i = 0; i < relation->top->size; i++)
+        putName(fragment, ENTITY(relation->top->sorted[i])->name);
+    putBytes(fragment, count, snprintf(count, sizeof(count), "%d; ", relation->top->count));
+    relation->dirty = false;
+}
+
+/*
+ * the part of the report about the relation changed, or it is no longer part of it; the first
+ * time since the last report the relation is listed for reportdiff
+ */
+static void touchRelation(t_relation *relation) {
+    relation->dirty = true;
+    if (currentShard == NULL)
+        db->reportChanged = true;   //else mergeShards does it
+    if (!relation->changed) {
+        relation->changed = true;
+        pushId(currentShard != NULL ? &currentShard->touched : &db->changedRelations, RELATION_ID(relation));
+    }
+}
+
+
+
+//Worker pool
+
+/*
+ * the number of threads of the pool, counting the thread running the round; they are started the
+ * first time it's asked, by whichever database asks first
+ */
+static int poolThreads() {
+    pthread_once(&workerPool.started, startPool);
+    return workerPool.numThreads;
+}
+
+/*
+ * if some threads can't be created the others do without them
+ */
+static void startPool() {
+    int numThreads = WORKER_THREADS > 0 ? WORKER_THREADS : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    workerPool.numThreads = 1;
+    if (numThreads < 2)
+        return;
+    workerPool.threads = malloc((size_t)(numThreads - 1) * sizeof(pthread_t));
+    for (i = 0; i < numThreads - 1; i++) {
+        if (pthread_create(&workerPool.threads[i], NULL, poolWorker, NULL) != 0)
+            break;
+        pthread_detach(workerPool.threads[i]);
+        workerPool.numThreads++;
+    }
+}
+
+/*
+ * void runRound(void (*run)(t_id), t_id numTasks)
+ *
+ * --- DESCRIPTION ---
+ * calls run(0) ... run(numTasks - 1) on the threads of the pool and returns when they are all
+ * done. The tasks are handed out in order from a shared counter: a thread that finishes one takes
+ * the next, the main thread too, so putting the longest ones first evens out the end of the round.
+ * Whatever the tasks wrote is seen by the main thread afterwards, and the tasks work on its
+ * database. With a single thread they are all run here. The pool runs one round at a time, a
+ * thread with a round for another database waits for this one to end
+ *
+ * --- PARAMETERS ---
+ * run: the task, given its number; tasks with different numbers must not write the same memory
+ * numTasks: how many there are
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void runRound(void (*run)(t_id), t_id numTasks) {
+    int numThreads = poolThreads();
+
+    pthread_mutex_lock(&workerPool.busy);
+    atomic_store(&workerPool.next, 0);
+    workerPool.db = db;
+    workerPool.run = run;
+    workerPool.numTasks = numTasks;
+    if (numThreads > 1) {
+        pthread_mutex_lock(&workerPool.lock);
+        workerPool.round++;
+        workerPool.working = workerPool.numThreads - 1;
+        pthread_cond_broadcast(&workerPool.start);
+        pthread_mutex_unlock(&workerPool.lock);
+    }
+
+    runTasks();
+    if (numThreads > 1) {
+        pthread_mutex_lock(&workerPool.lock);
+        while (workerPool.working > 0)
+            pthread_cond_wait(&workerPool.done, &workerPool.lock);
+        pthread_mutex_unlock(&workerPool.lock);
+    }
+    pthread_mutex_unlock(&workerPool.busy);
+}
+
+/*
+ * waits for a round of tasks, takes its share, tells the main thread when the last one is done
+ */
+static void *poolWorker(void *arg) {
+    uint32_t round = 0;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&workerPool.lock);
+        while (workerPool.round == round)
+            pthread_cond_wait(&workerPool.start, &workerPool.lock);
+        round = workerPool.round;
+        useDb(workerPool.db);
+        pthread_mutex_unlock(&workerPool.lock);
+
+        runTasks();
+        pthread_mutex_lock(&workerPool.lock);
+        if (--workerPool.working == 0)
+            pthread_cond_signal(&workerPool.done);
+        pthread_mutex_unlock(&workerPool.lock);
+    }
+    return NULL;
+}
+
+static void runTasks() {
+    unsigned task;
+
+    while ((task = atomic_fetch_add(&workerPool.next, 1)) < workerPool.numTasks)
+        workerPool.run(task);
+}
+
+/*
+ * void renderChanged()
+ *
+ * --- DESCRIPTION ---
+ * renders the fragments a report needs again on the worker pool, before the report is put
+ * together. Those are the relations in the report touched since it was last rendered, all of
+ * them in changedRelations; the costliest (the biggest top buckets, which may need sorting) are
+ * handed out first. Each relation is rendered by one thread into its own fragment; printRelations
+ * then adds the fragments in the order of the relations, on the main thread, so the report is the
+ * same as a serial one. With one thread, or too few names to render for waking the others to pay
+ * off, nothing is done here and printSingleReport renders them as it goes
+ *
+ * --- PARAMETERS ---
+ * none
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void renderChanged() {
+    t_relation *rel;
+    size_t work = 0;
+    t_id i;
+
+    if (poolThreads() < 2)
+        return;
+    db->renderList.count = 0;
+    for (i = 0; i < db->changedRelations.count; i++) {
+        rel = RELATION(db->changedRelations.ids[i]);
+        if (rel->top == NULL || !rel->dirty)
+            continue;
+        pushId(&db->renderList, db->changedRelations.ids[i]);
+        work += rel->top->size;
+    }
+    if (work < PARALLEL_RENDER_MIN)
+        return;
+    qsort(db->renderList.ids, db->renderList.count, sizeof(t_id), compareRenderCost);
+    runRound(renderTask, db->renderList.count);
+}
+
+static void renderTask(t_id task) {
+    t_relation *rel = RELATION(db->renderList.ids[task]);
+    renderRelation(rel, &rel->fragment);
+}
+static int compareRenderCost(const void *a, const void *b) {
+    t_id first = RELATION(*(const t_id*)a)->top->size, second = RELATION(*(const t_id*)b)->top->size;
+    return first > second ? -1 : first < second;
+}
+
+
+
+//Relation shards
+
+/*
+ * void shardCommand(db_op_t op, t_id first, t_id second, t_id relation)
+ *
+ * --- DESCRIPTION ---
+ * what db_apply calls with DB_SHARDS in place of runCommand. addrel and delrel only change the
+ * relation they name, but for a few things shared with the other relations, so they are queued
+ * in the shard of the relation and run in parallel with the other shards at the next barrier, see
+ * runShards. The entities are looked up and the relation created here, as runCommand would: no
+ * command in the queues can change them. Every other command is a barrier: the queues are run
+ * first, then the command
+ *
+ * --- PARAMETERS ---
+ * op, first, second, relation: the command, as for runCommand
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void shardCommand(db_op_t op, t_id first, t_id second, t_id relation) {
+    t_id sender = findEntity(first), recipient = findEntity(second), rel;
+
+    switch (op) {
+        case DB_ADDREL:
+            if (isValid(sender) && isValid(recipient) && relation != NO_ID)
+                queueCommand(DB_ADDREL, getRelation(relation, true), sender, recipient);
+            break;
+        case DB_DELREL:
+            if (sender != NO_ID && recipient != NO_ID && relation != NO_ID && (rel = getRelation(relation, false)) != NO_ID)
+                queueCommand(DB_DELREL, rel, sender, recipient);
+            break;
+        default:
+            runShards();
+            runCommand(op, first, second, relation);
+            break;
+    }
+}
+
+static void queueCommand(db_op_t op, t_id relation, t_id sender, t_id recipient) {
+    t_shard *shard = &db->shards[relation % COMMAND_SHARDS];
+
+    if (shard->numCommands == shard->capacityCommands) {
+        shard->capacityCommands = shard->capacityCommands == 0 ? 256 : shard->capacityCommands * 2;
+        shard->commands = realloc(shard->commands, shard->capacityCommands * sizeof(t_shardCommand));
+    }
+    shard->commands[shard->numCommands++] = (t_shardCommand){op, relation, sender, recipient};
+    db->queuedCommands++;
+}
+
+/*
+ * void runShards()
+ *
+ * --- DESCRIPTION ---
+ * runs the commands queued in the shards, each shard on one thread of the pool, then merges what
+ * they left for the main thread, see mergeShards. The commands of a relation are all in its
+ * shard, in the order they came, so each relation ends up as if they had been run one by one;
+ * the relations don't see each other. Few commands are run here, without waking the threads.
+ * The compactor, which must not reclaim what the queues point to, catches up after
+ *
+ * --- PARAMETERS ---
+ * none
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void runShards() {
+    t_id i;
+
+    if (db->queuedCommands == 0)
+        return;
+    if (db->queuedCommands < PARALLEL_SHARD_MIN) {
+        for (i = 0; i < COMMAND_SHARDS; i++)
+            runShard(i);
+    }
+    else
+        runRound(runShard, COMMAND_SHARDS);
+    mergeShards();
+    for (; db->queuedCommands > 0; db->queuedCommands--)
+        compact(COMPACT_BUDGET);
+}
+
+/*
+ * a task of the pool: the commands of one shard. What they would change outside of the relation
+ * goes in the events of the shard, see logShardEvent; what they change of the memory of the
+ * sender sets is kept in the shard too
+ */
+static void runShard(t_id task) {
+    t_shard *shard = &db->shards[task];
+    t_senderStats *stats = senderStats;
+    t_shardCommand *command;
+    uint32_t i;
+
+    memset(&shard->stats, 0, sizeof(t_senderStats));
+    currentShard = shard;
+    senderStats = &shard->stats;
+    for (i = 0; i < shard->numCommands; i++) {
+        command = &shard->commands[i];
+        if (command->op == DB_ADDREL)
+            linkEntities(command->relation, command->sender, command->recipient);
+        else
+            unlinkEntities(command->relation, command->sender, command->recipient);
+    }
+    currentShard = NULL;
+    senderStats = stats;
+    shard->numCommands = 0;
+}
+
+static void logShardEvent(t_shardEventType type, t_id entity, t_id relation, t_id recipient) {
+    t_shard *shard = currentShard;
+
+    if (shard->numEvents == shard->capacityEvents) {
+        shard->capacityEvents = shard->capacityEvents == 0 ? 256 : shard->capacityEvents * 2;
+        shard->events = realloc(shard->events, shard->capacityEvents * sizeof(t_shardEvent));
+    }
+    shard->events[shard->numEvents++] = (t_shardEvent){type, entity, relation, recipient};
+}
+
+/*
+ * void mergeShards()
+ *
+ * --- DESCRIPTION ---
+ * makes the changes to the entities the shards left in their events, on the main thread. The
+ * trees of the relations of the recipients get the events in the order they came, which is the
+ * order of the commands of each relation. The edges are trickier: a purge drops every stale edge
+ * and zeroes the stale count, so the count must be right whenever an edge is added. So the stale
+ * counts are done first for all the shards: one more for each link removed, one less for each
+ * edge of a link both added and removed in this run, which isn't added at all. Then the edges of
+ * the links still there are added. A link removed and added again counts as stale before its
+ * second edge is in the array, so a purge on the way may free nothing; addEdge grows it then. The relations touched go to changedRelations, the sender set
+ * memory to the one of the database
+ *
+ * --- PARAMETERS ---
+ * none
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void mergeShards() {
+    t_shard *shard;
+    t_shardEvent *event;
+    t_edge edge;
+    t_id i, j;
+
+    for (i = 0; i < COMMAND_SHARDS; i++) {
+        shard = &db->shards[i];
+        for (j = 0; j < shard->numEvents; j++) {
+            event = &shard->events[j];
+            switch (event->type) {
+                case EVENT_STALE_EDGE:
+                    ENTITY(event->entity)->staleOutgoing++;
+                    break;
+                case EVENT_ADD_EDGE:
+                    edge.relation = event->relation;
+                    edge.recipient = event->recipient;
+                    if (edgeInstance(&edge, event->entity) == NULL) {
+                        ENTITY(event->entity)->staleOutgoing--;
+                        event->type = EVENT_SKIPPED;
+                    }
+                    break;
+                case EVENT_JOIN_RELATION:
+                    addToRelTree(&ENTITY(event->entity)->relations, event->relation);
+                    break;
+                case EVENT_LEAVE_RELATION:
+                    delFromRelTree(&ENTITY(event->entity)->relations, event->relation);
+                    break;
+                default:
+                    break;
+            }
+        }
+        for (j = 0; j < shard->touched.count; j++)
+            pushId(&db->changedRelations, shard->touched.ids[j]);
+        if (shard->touched.count > 0)
+            db->reportChanged = true;
+        shard->touched.count = 0;
+        db->senderStats.containers += shard->stats.containers;
+        db->senderStats.bitmaps += shard->stats.bitmaps;
+        db->senderStats.bytes += shard->stats.bytes;
+    }
+
+    for (i = 0; i < COMMAND_SHARDS; i++) {
+        shard = &db->shards[i];
+        for (j = 0; j < shard->numEvents; j++) {
+            event = &shard->events[j];
+            if (event->type == EVENT_ADD_EDGE)
+                addEdge(event->entity, event->relation, event->recipient);
+        }
+        shard->numEvents = 0;
+    }
+}
+
+
+//Snapshots
+
+/*
+ * int saveSnapshot(const char* path)
+ *
+ * --- DESCRIPTION ---
+ * writes db to a snapshot file, for db_restore to map back. The header says where each section
+ * starts, as an offset from the start of the file, so nothing in it depends on where it is
+ * mapped: the names as they are in the pool, their offsets and the slots of the hash table;
+ * entityTable and relTable; the entity and relation records by ID, reclaimed ones too, and the
+ * free lists, so every ID stays what it was; then for each relation its fragment of the report,
+ * the recipients with the most senders, and its instances, see putInstances. Edges, relation
+ * trees, buckets and index nodes aren't stored, loadRelation builds them again from the
+ * instances; a relation not loaded since the restore is copied as it is. A logged database
+ * stores where its log is, see db_recover. The file is written
+ * next to path and renamed over it once complete, a crash while saving leaves the previous one
+ *
+ * --- PARAMETERS ---
+ * path: the file to write
+ *
+ * --- RETURN VALUES ---
+ * 0, or the errno of what failed
+ */
+static int saveSnapshot(const char *path) {
+    t_snapshotHeader header;
+    t_storedRelation *records = calloc(db->numRelations + 1, sizeof(t_storedRelation));
+    t_storedEntity *entities = malloc((db->numEntities + 1) * sizeof(t_storedEntity));
+    t_byteBuffer block = {NULL, 0, 0};
+    t_relation *rel;
+    char *temp;
+    uint64_t end = 0, checksum = 0;
+    FILE *out;
+    bool dirty;
+    int error = 0;
+    t_id i;
+
+    if (records == NULL || entities == NULL || asprintf(&temp, "%s.tmp", path) < 0) {
+        free(records);
+        free(entities);
+        return ENOMEM;
+    }
+    if ((out = fopen(temp, "wb")) == NULL) {
+        error = errno;
+        free(temp);
+        free(records);
+        free(entities);
+        return error;
+    }
+#if NAME_INDEX == NAME_INDEX_HASH
+    if (db->pool.old.slots != NULL)     //only the table being moved to is stored
+        migrateNames(db->pool.old.mask + 1);
+#endif
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+    header.version = SNAPSHOT_VERSION;
+    header.wordSize = sizeof(size_t);
+    header.numNames = db->pool.count;
+    header.poolSize = db->pool.size;
+    header.numEntities = db->numEntities;
+    header.numRelations = db->numRelations;
+    header.freeEntities = db->freeEntities.count;
+    header.freeRelations = db->freeRelations.count;
+    putSection(out, &end, &header, sizeof(header), NULL);   //again at the end, with the offsets
+    header.names = putSection(out, &end, db->pool.chars, db->pool.size, &checksum);
+    header.offsets = putSection(out, &end, db->pool.offsets, db->pool.count * sizeof(size_t), &checksum);
+#if NAME_INDEX == NAME_INDEX_HASH
+    if (db->pool.table.slots != NULL) {
+        header.seed = db->pool.seed;
+        header.tableSlots = (uint32_t)(db->pool.table.mask + 1);
+        header.table = putSection(out, &end, db->pool.table.slots, header.tableSlots * sizeof(t_nameSlot), &checksum);
+    }
+#endif
+    header.entityTable = putSection(out, &end, db->entityTable, db->pool.count * sizeof(t_id), &checksum);
+    header.relTable = putSection(out, &end, db->relTable, db->pool.count * sizeof(t_id), &checksum);
+    for (i = 0; i < db->numEntities; i++) {
+        entities[i].name = ENTITY(i)->name;
+        entities[i].version = ENTITY(i)->version;
+    }
+    header.entities = putSection(out, &end, entities, db->numEntities * sizeof(t_storedEntity), &checksum);
+    header.freeEntityIds = putSection(out, &end, db->freeEntities.ids, db->freeEntities.count * sizeof(t_id), &checksum);
+    header.freeRelationIds = putSection(out, &end, db->freeRelations.ids, db->freeRelations.count * sizeof(t_id),
+                                        &checksum);
+
+    for (i = 0; i < db->numRelations; i++) {
+        rel = RELATION(i);
+        records[i].name = rel->name;
+        if (rel->stored != NULL) {
+            records[i].fragmentSize = (uint32_t)rel->fragment.size;
+            records[i].fragment = putSection(out, &end, rel->fragment.data, rel->fragment.size, &checksum);
+            records[i].instancesSize = rel->storedSize;
+            records[i].instancesChecksum = rel->storedChecksum;     //checked once loaded
+            records[i].instances = putSection(out, &end, rel->stored, rel->storedSize, NULL);
+        }
+        else if (rel->top != NULL) {
+            dirty = rel->dirty;
+            renderRelation(rel, &block);    //not in its fragment, which is what reportdiff compares with
+            rel->dirty = dirty;
+            records[i].fragmentSize = (uint32_t)block.size;
+            records[i].fragment = putSection(out, &end, block.data, block.size, &checksum);
+            block.size = 0;
+            putInstances(&block, rel);
+            records[i].instancesSize = block.size;
+            records[i].instancesChecksum = hash((t_slice){(const char*)block.data, block.size}, 0);
+            records[i].instances = putSection(out, &end, block.data, block.size, NULL);
+        }
+    }
+    header.relations = putSection(out, &end, records, db->numRelations * sizeof(t_storedRelation), &checksum);
+    if (db->log.active) {
+        header.logGeneration = db->log.generation;
+        header.logOffset = db->log.size;
+    }
+    header.size = end;
+    header.checksum = hash((t_slice){(const char*)&header, sizeof(header)}, checksum);
+    rewind(out);
+    fwrite(&header, sizeof(header), 1, out);
+
+    if (fflush(out) != 0 || ferror(out) || fsync(fileno(out)) != 0)
+        error = errno != 0 ? errno : EIO;
+    if (fclose(out) != 0 && error == 0)
+        error = errno;
+    if (error == 0 && rename(temp, path) != 0)
+        error = errno;
+    if (error != 0)
+        unlink(temp);
+    free(block.data);
+    free(records);
+    free(entities);
+    free(temp);
+    return error;
+}
+
+/*
+ * writes a section at the first offset from end aligned to SNAPSHOT_ALIGN, returns that offset;
+ * end is where the file ends, after the section. The section goes into the checksum if one is
+ * given, see chainSection
+ */
+static uint64_t putSection(FILE *out, uint64_t *end, const void *data, size_t size, uint64_t *checksum) {
+    static const char padding[SNAPSHOT_ALIGN];
+    uint64_t offset = (*end + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+
+    if (offset > *end)
+        fwrite(padding, 1, offset - *end, out);
+    if (size > 0)
+        fwrite(data, 1, size, out);
+    if (checksum != NULL)
+        *checksum = chainSection(*checksum, data, 0, size);
+    *end = offset + size;
+    return offset;
+}
+
+/*
+ * the instances of the relation, from its top bucket down: for each one the varints of the
+ * recipient, of its number of senders and of the senders, see putSenders. Going down the counts,
+ * loadRelation only ever puts an instance in the bottom bucket or in a new one under it
+ */
+static void putInstances(t_byteBuffer *block, t_relation *rel) {
+    t_countBucket *bucket;
+    t_relInstance *instance;
+
+    for (bucket = rel->top; bucket != NULL; bucket = bucket->lower)
+        for (instance = bucket->first; instance != NULL; instance = instance->nextInBucket) {
+            putVarint(block, instance->recipient);
+            putVarint(block, instance->senders.size);
+            putSenders(block, &instance->senders);
+        }
+}
+
+/*
+ * the senders in increasing order, each one as the difference from the previous one: the IDs are
+ * dense, most take a byte
+ */
+static void putSenders(t_byteBuffer *block, const t_senderSet *set) {
+    const t_container *container;
+    t_id previous = 0, sender;
+    uint64_t word;
+    uint32_t i, j;
+
+    if (set->numContainers == 0) {
+        for (i = 0; i < set->size; i++) {
+            putVarint(block, set->ids[i] - previous);
+            previous = set->ids[i];
+        }
+        return;
+    }
+    for (i = 0; i < set->numContainers; i++) {
+        container = &set->containers[i];
+        if (!container->bitmap) {
+            for (j = 0; j < container->cardinality; j++) {
+                sender = (t_id)container->high << 16 | container->array[j];
+                putVarint(block, sender - previous);
+                previous = sender;
+            }
+            continue;
+        }
+        for (j = 0; j < CONTAINER_WORDS; j++)
+            for (word = container->words[j]; word != 0; word &= word - 1) {
+                sender = (t_id)container->high << 16 | (j * 64 + (t_id)__builtin_ctzll(word));
+                putVarint(block, sender - previous);
+                previous = sender;
+            }
+    }
+}
+
+/*
+ * bool restoreSnapshot(void* map, size_t size)
+ *
+ * --- DESCRIPTION ---
+ * fills db, a new database, from a snapshot mapped in memory, see saveSnapshot. The file is
+ * checked whole before anything is allocated, see checkSnapshot. The names, the
+ * tables and the free lists are copied; so is the hash table, unless the file comes from a build
+ * with the radix tree or this one has it, then the index is built again from the names. The
+ * entity and relation records are filled in from theirs, with no edges and no instances; a
+ * relation with instances keeps its fragment of the report and points to its block, for
+ * loadRelation. The relations are added to relRoot as they come
+ *
+ * --- PARAMETERS ---
+ * map: the file
+ * size: its size, at least the one of the header
+ *
+ * --- RETURN VALUES ---
+ * false if the file isn't a whole snapshot, db is left as it was then
+ */
+static bool restoreSnapshot(void *map, size_t size) {
+    const unsigned char *file = map;
+    const t_snapshotHeader *header = map;
+    const t_storedEntity *entities;
+    const t_storedRelation *records;
+    t_entity *ent;
+    t_relation *rel;
+    t_id i;
+#if NAME_INDEX == NAME_INDEX_HASH
+    size_t slots;
+#endif
+
+    if (!checkSnapshot(file, size))
+        return false;
+    records = (const t_storedRelation*)(file + header->relations);
+
+    db->pool.chars = copySection(file, header->names, header->poolSize);
+    db->pool.size = db->pool.capacity = header->poolSize;
+    db->pool.offsets = copySection(file, header->offsets, header->numNames * sizeof(size_t));
+    db->pool.count = db->pool.capacityIds = header->numNames;
+    db->entityTable = copySection(file, header->entityTable, header->numNames * sizeof(t_id));
+    db->relTable = copySection(file, header->relTable, header->numNames * sizeof(t_id));
+#if NAME_INDEX == NAME_INDEX_ART
+    for (i = 0; i < db->pool.count; i++)
+        artInsert(&db->pool.root, (t_slice){poolName(i), poolLength(i)}, i, 0);
+#else
+    if (header->tableSlots > 0) {
+        db->pool.seed = header->seed;
+        db->pool.table.slots = copySection(file, header->table, header->tableSlots * sizeof(t_nameSlot));
+        db->pool.table.mask = header->tableSlots - 1;
+        db->pool.table.count = db->pool.count;
+    }
+    else if (db->pool.count > 0) {  //saved by a build with the radix tree
+        db->pool.seed = HASH_SEED != 0 ? HASH_SEED : read64((const unsigned char*)getauxval(AT_RANDOM));
+        for (slots = HASH_TABLE_SIZE; (db->pool.count + 1) * 8 > slots * HASH_MAX_LOAD; slots *= 2)
+            ;
+        initNameTable(&db->pool.table, slots);
+        for (i = 0; i < db->pool.count; i++)
+            tableInsert(&db->pool.table, (uint32_t)hash((t_slice){poolName(i), poolLength(i)}, db->pool.seed), i);
+    }
+#endif
+
+    entities = (const t_storedEntity*)(file + header->entities);
+    db->numEntities = db->capacityEntities = header->numEntities;
+    db->entities = header->numEntities > 0 ? malloc(header->numEntities * sizeof(t_entity)) : NULL;
+    for (i = 0; i < db->numEntities; i++) {
+        ent = ENTITY(i);
+        ent->name = entities[i].name;
+        ent->key = ent->name != NO_ID ? makeKey(poolName(ent->name)) : (t_key){0, 0};
+        ent->version = (unsigned short)entities[i].version;
+        ent->relations = NULL;
+        ent->outgoing = NULL;
+        ent->numOutgoing = 0;
+        ent->capacityOutgoing = 0;
+        ent->staleOutgoing = 0;
+    }
+    db->numRelations = db->capacityRelations = header->numRelations;
+    db->relations = header->numRelations > 0 ? calloc(header->numRelations, sizeof(t_relation)) : NULL;
+    for (i = 0; i < db->numRelations; i++) {
+        rel = RELATION(i);
+        if ((rel->name = records[i].name) == NO_ID)
+            continue;
+        rel->key = makeKey(poolName(rel->name));
+        if (records[i].fragmentSize > 0)
+            putBytes(&rel->fragment, file + records[i].fragment, records[i].fragmentSize);
+        if (records[i].instancesSize > 0) {
+            rel->stored = file + records[i].instances;
+            rel->storedSize = records[i].instancesSize;
+            rel->storedChecksum = records[i].instancesChecksum;
+            db->snapshot.pending++;
+        }
+        addToRelTree(&db->relRoot, i);
+    }
+    db->freeEntities.ids = copySection(file, header->freeEntityIds, header->freeEntities * sizeof(t_id));
+    db->freeEntities.count = db->freeEntities.capacity = header->freeEntities;
+    db->freeRelations.ids = copySection(file, header->freeRelationIds, header->freeRelations * sizeof(t_id));
+    db->freeRelations.count = db->freeRelations.capacity = header->freeRelations;
+
+    db->log.generation = header->logGeneration;    //for recoverLog
+    db->log.size = header->logOffset;
+    db->snapshot.map = map;
+    db->snapshot.size = size;
+    if (db->snapshot.pending == 0)
+        closeSnapshot();
+    return true;
+}
+
+/*
+ * bool checkSnapshot(const unsigned char* file, size_t size)
+ *
+ * --- DESCRIPTION ---
+ * whether restoreSnapshot can take the file without reading out of anything or making up a
+ * database the commands would trip on. The header, then the bounds of every section and block,
+ * then the checksum, then what the sections say about each other: the names are one after the
+ * other, each ending with its only NUL, and none comes twice; the hash table finds each of them,
+ * see checkNameTable; the names of the records are names, and the tables point back to them; a
+ * record without a name was reclaimed, an entity once deleted, and is on its free list once; a
+ * relation has a fragment of the report if it has instances, and only then. The blocks of
+ * instances are only bounds-checked, loadRelation skips the IDs in them that aren't entities
+ *
+ * --- PARAMETERS ---
+ * file: the file mapped
+ * size: its size, at least the one of the header
+ *
+ * --- RETURN VALUES ---
+ * true if it is a snapshot of this build
+ */
+static bool checkSnapshot(const unsigned char *file, size_t size) {
+    const t_snapshotHeader *header = (const t_snapshotHeader*)file;
+    const t_storedRelation *records;
+    const t_storedEntity *entities;
+    const size_t *offsets;
+    const t_id *entityTable, *relTable;
+    const char *names;
+    uint64_t end;
+    t_id i;
+
+    if (!checkBounds(file, size) || snapshotChecksum(file) != header->checksum)
+        return false;
+    records = (const t_storedRelation*)(file + header->relations);
+    names = (const char*)file + header->names;
+    offsets = (const size_t*)(file + header->offsets);
+    for (i = 0; i < header->numNames; i++) {
+        end = i + 1 < header->numNames ? offsets[i + 1] : header->poolSize;
+        if (offsets[i] >= end || end > header->poolSize ||
+                memchr(names + offsets[i], '\0', end - offsets[i]) != names + end - 1)
+            return false;
+    }
+    if (!distinctNames(names, offsets, header->numNames, header->poolSize))
+        return false;
+    if (header->tableSlots > 0 && !checkNameTable(header, file))
+        return false;
+
+    entities = (const t_storedEntity*)(file + header->entities);
+    entityTable = (const t_id*)(file + header->entityTable);
+    relTable = (const t_id*)(file + header->relTable);
+    for (i = 0; i < header->numEntities; i++)
+        if (entities[i].name == NO_ID ? entities[i].version % 2 == 0 :
+                entities[i].name >= header->numNames || entityTable[entities[i].name] != i)
+            return false;
+    for (i = 0; i < header->numRelations; i++)
+        if ((records[i].name != NO_ID && (records[i].name >= header->numNames || relTable[records[i].name] != i)) ||
+                (records[i].fragmentSize == 0) != (records[i].instancesSize == 0))
+            return false;
+    for (i = 0; i < header->numNames; i++)
+        if ((entityTable[i] != NO_ID && (entityTable[i] >= header->numEntities || entities[entityTable[i]].name != i)) ||
+                (relTable[i] != NO_ID && (relTable[i] >= header->numRelations || records[relTable[i]].name != i)))
+            return false;
+    return checkFreeIds((const t_id*)(file + header->freeEntityIds), header->freeEntities, (const unsigned char*)entities,
+                        header->numEntities, sizeof(t_storedEntity)) &&
+           checkFreeIds((const t_id*)(file + header->freeRelationIds), header->freeRelations,
+                        (const unsigned char*)records, header->numRelations, sizeof(t_storedRelation));
+}
+
+/*
+ * the header is the one of a snapshot of this build, and every section and block is in the file
+ */
+static bool checkBounds(const unsigned char *file, size_t size) {
+    const t_snapshotHeader *header = (const t_snapshotHeader*)file;
+    const t_storedRelation *records;
+    t_id i;
+
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 4) != 0 || header->version != SNAPSHOT_VERSION ||
+            header->wordSize != sizeof(size_t) || header->size != size || header->numNames == NO_ID ||
+            (header->tableSlots & (header->tableSlots - 1)) != 0 ||
+            (header->tableSlots > 0 && header->tableSlots <= header->numNames) ||
+            !inSnapshot(header->names, header->poolSize, size) ||
+            !inSnapshot(header->offsets, (uint64_t)header->numNames * sizeof(size_t), size) ||
+            !inSnapshot(header->table, (uint64_t)header->tableSlots * sizeof(t_nameSlot), size) ||
+            !inSnapshot(header->entityTable, (uint64_t)header->numNames * sizeof(t_id), size) ||
+            !inSnapshot(header->relTable, (uint64_t)header->numNames * sizeof(t_id), size) ||
+            !inSnapshot(header->entities, (uint64_t)header->numEntities * sizeof(t_storedEntity), size) ||
+            !inSnapshot(header->freeEntityIds, (uint64_t)header->freeEntities * sizeof(t_id), size) ||
+            !inSnapshot(header->freeRelationIds, (uint64_t)header->freeRelations * sizeof(t_id), size) ||
+            !inSnapshot(header->relations, (uint64_t)header->numRelations * sizeof(t_storedRelation), size))
+        return false;
+    records = (const t_storedRelation*)(file + header->relations);
+    for (i = 0; i < header->numRelations; i++)
+        if (!inSnapshot(records[i].fragment, records[i].fragmentSize, size) ||
+                !inSnapshot(records[i].instances, records[i].instancesSize, size))
+            return false;
+    return true;
+}
+
+/*
+ * the checksum of a snapshot within bounds, as saveSnapshot computed it: the sections in the
+ * order they were written, but the blocks of instances, then the header with its checksum as 0
+ */
+static uint64_t snapshotChecksum(const unsigned char *file) {
+    const t_snapshotHeader *header = (const t_snapshotHeader*)file;
+    const t_storedRelation *records = (const t_storedRelation*)(file + header->relations);
+    t_snapshotHeader copy;
+    uint64_t checksum = 0;
+    t_id i;
+
+    checksum = chainSection(checksum, file, header->names, header->poolSize);
+    checksum = chainSection(checksum, file, header->offsets, header->numNames * sizeof(size_t));
+    checksum = chainSection(checksum, file, header->table, header->tableSlots * sizeof(t_nameSlot));
+    checksum = chainSection(checksum, file, header->entityTable, header->numNames * sizeof(t_id));
+    checksum = chainSection(checksum, file, header->relTable, header->numNames * sizeof(t_id));
+    checksum = chainSection(checksum, file, header->entities, header->numEntities * sizeof(t_storedEntity));
+    checksum = chainSection(checksum, file, header->freeEntityIds, header->freeEntities * sizeof(t_id));
+    checksum = chainSection(checksum, file, header->freeRelationIds, header->freeRelations * sizeof(t_id));
+    for (i = 0; i < header->numRelations; i++)
+        checksum = chainSection(checksum, file, records[i].fragment, records[i].fragmentSize);
+    checksum = chainSection(checksum, file, header->relations, header->numRelations * sizeof(t_storedRelation));
+    memcpy(&copy, header, sizeof(copy));
+    copy.checksum = 0;
+    return hash((t_slice){(const char*)&copy, sizeof(copy)}, checksum);
+}
+
+/*
+ * no two names of the pool are the same: the indexes would hold one of them, the radix tree
+ * wouldn't even find where to split. They go through a set of their own, whatever the index
+ */
+static bool distinctNames(const char *names, const size_t *offsets, t_id count, uint64_t poolSize) {
+    size_t slots = 16, mask, slot, length, otherLength;
+    t_id *set, i, other;
+
+    while (slots < (size_t)count * 2)
+        slots *= 2;
+    mask = slots - 1;
+    if ((set = malloc(slots * sizeof(t_id))) == NULL)
+        return false;
+    memset(set, 0xff, slots * sizeof(t_id));    //NO_ID
+    for (i = 0; i < count; i++) {
+        length = storedLength(offsets, count, poolSize, i);
+        for (slot = hash((t_slice){names + offsets[i], length}, 0) & mask; (other = set[slot]) != NO_ID;
+                slot = (slot + 1) & mask) {
+            otherLength = storedLength(offsets, count, poolSize, other);
+            if (length == otherLength && memcmp(names + offsets[i], names + offsets[other], length) == 0)
+                break;
+        }
+        if (other != NO_ID)
+            break;
+        set[slot] = i;
+    }
+    free(set);
+    return i == count;
+}
+
+/*
+ * bool checkNameTable(const t_snapshotHeader* header, const unsigned char* file)
+ *
+ * --- DESCRIPTION ---
+ * whether the hash table of the snapshot finds every name, as tableLookup would look for it: each
+ * name is in one slot, and so a slot stays free; the slot has the hash of the name with the seed
+ * of the file; and the probe from where that hash points reaches the slot, going past names no
+ * closer to their start than it has gone. A lookup of a name the table wouldn't find would add
+ * it again, with another ID
+ *
+ * --- PARAMETERS ---
+ * header: the header of the file, whose names are checked already
+ * file: the file mapped
+ *
+ * --- RETURN VALUES ---
+ * true if the table can be taken as it is
+ */
+static bool checkNameTable(const t_snapshotHeader *header, const unsigned char *file) {
+    const t_nameSlot *slots = (const t_nameSlot*)(file + header->table);
+    const size_t *offsets = (const size_t*)(file + header->offsets);
+    const char *names = (const char*)file + header->names;
+    size_t mask = header->tableSlots - 1, pos, probe, distance;
+    unsigned char *seen = calloc(header->numNames / 8 + 1, 1);
+    t_slice string;
+    t_id name, used = 0;
+
+    for (pos = 0; pos <= mask; pos++) {
+        if ((name = slots[pos].name) == NO_ID)
+            continue;
+        if (name >= header->numNames || seen[name / 8] & 1 << name % 8)
+            break;
+        string = (t_slice){names + offsets[name], storedLength(offsets, header->numNames, header->poolSize, name)};
+        if (slots[pos].hash != (uint32_t)hash(string, header->seed))
+            break;
+        seen[name / 8] |= (unsigned char)(1 << name % 8);
+        used++;
+        for (probe = slots[pos].hash & mask, distance = 0; probe != pos; probe = (probe + 1) & mask, distance++)
+            if (slots[probe].name == NO_ID || ((probe - slots[probe].hash) & mask) < distance)
+                break;
+        if (probe != pos)
+            break;
+    }
+    free(seen);
+    return pos > mask && used == header->numNames;
+}
+
+/*
+ * the length of a name of the snapshot, from where the next one starts
+ */
+static size_t storedLength(const size_t *offsets, t_id count, uint64_t poolSize, t_id name) {
+    return (name + 1 < count ? offsets[name + 1] : poolSize) - offsets[name] - 1;
+}
+
+/*
+ * the free list holds every record without a name once, and nothing else; the records are
+ * stride bytes apart, each starting with its name
+ */
+static bool checkFreeIds(const t_id *ids, uint32_t count, const unsigned char *records, uint32_t numRecords, size_t stride) {
+    unsigned char *seen;
+    t_id name;
+    uint32_t i, reclaimed = 0;
+
+    for (i = 0; i < numRecords; i++) {
+        memcpy(&name, records + i * stride, sizeof(t_id));
+        reclaimed += name == NO_ID;
+    }
+    if (reclaimed != count)
+        return false;
+    seen = calloc(numRecords / 8 + 1, 1);
+    for (i = 0; i < count; i++) {
+        if (ids[i] >= numRecords || seen[ids[i] / 8] & 1 << ids[i] % 8)
+            break;
+        memcpy(&name, records + (size_t)ids[i] * stride, sizeof(t_id));
+        if (name != NO_ID)
+            break;
+        seen[ids[i] / 8] |= (unsigned char)(1 << ids[i] % 8);
+    }
+    free(seen);
+    return i == count;
+}
+
+/*
+ * the checksum so far, with the section at offset in file going on from it; empty sections
+ * leave it as it is
+ */
+static uint64_t chainSection(uint64_t checksum, const unsigned char *file, uint64_t offset, size_t size) {
+    return size > 0 ? hash((t_slice){(const char*)file + offset, size}, checksum) : checksum;
+}
+
+/*
+ * the section is all in the file, and aligned as putSection left it
+ */
+static bool inSnapshot(uint64_t offset, uint64_t bytes, size_t size) {
+    return offset % SNAPSHOT_ALIGN == 0 && offset <= size && bytes <= size - offset;
+}
+
+/*
+ * a malloced copy of a section of the file, NULL if it is empty
+ */
+static void *copySection(const unsigned char *file, uint64_t offset, size_t size) {
+    void *copy;
+
+    if (size == 0)
+        return NULL;
+    copy = malloc(size);
+    memcpy(copy, file + offset, size);
+    return copy;
+}
+
+/*
+ * void loadRelation(t_id relation)
+ *
+ * --- DESCRIPTION ---
+ * builds the instances of a relation from its block in the snapshot, the first time a command
+ * needs them, see readInstances. The block is checked against its checksum first, the header
+ * only covers the rest of the file: a damaged one isn't read, the relation is left with no
+ * instances and its saved fragment leaves the report, and db_snapshot_error tells. The file is
+ * unmapped once the last relation is loaded
+ *
+ * --- PARAMETERS ---
+ * relation: the relation, nothing is done if it isn't in the snapshot
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+static void loadRelation(t_id relation) {
+    t_relation *rel = RELATION(relation);
+    const unsigned char *block = rel->stored;
+    size_t size = rel->storedSize;
+
+    if (block == NULL)
+        return;
+    rel->stored = NULL;
+    rel->storedSize = 0;
+    if (hash((t_slice){(const char*)block, size}, 0) == rel->storedChecksum)
+        readInstances(relation, block, block + size);
+    else {
+        db->snapshotError = EBADMSG;
+        touchRelation(rel);     //reportdiff says it's gone
+    }
+    if (--db->snapshot.pending == 0)
+        closeSnapshot();
+}
+
+/*
+ * the instances of the block, with their edges and relation trees. Nothing counts as changed, the
+ * fragment from the file is still the report of the relation: the buckets filling up touch it,
+ * which is undone after. IDs that aren't entities end the block, a file can't make it read past
+ * its end
+ */
+static void readInstances(t_id relation, const unsigned char *cursor, const unsigned char *end) {
+    t_relation *rel = RELATION(relation);
+    bool reportChanged = db->reportChanged;
+    t_relInstance *instance;
+    uint32_t recipient, count, sender, delta;
+
+    rel->changed = true;    //keeps touchRelation from listing it
+    while (getVarint(&cursor, end, &recipient) && getVarint(&cursor, end, &count)) {
+        if (recipient >= db->numEntities || !isValid(recipient))
+            break;
+        instance = getInstance(relation, recipient);
+        for (sender = 0; count > 0 && getVarint(&cursor, end, &delta); count--) {
+            sender += delta;
+            if (sender < db->numEntities && isValid(sender) && addSender(&instance->senders, sender))
+                addEdge(sender, relation, recipient);
+        }
+        if (instance->senders.size == 0) {
+            delInstance(rel, instance);
+            continue;
+        }
+        addToRelTree(&ENTITY(recipient)->relations, relation);
+        updateBucket(rel, instance);
+    }
+    rel->changed = false;
+    rel->dirty = false;
+    db->reportChanged = reportChanged;
+}
+
+static void loadRelations() {
+    t_id i;
+
+    for (i = 0; i < db->numRelations && db->snapshot.pending > 0; i++)
+        loadRelation(i);
+}
+
+static void closeSnapshot() {
+    if (db->snapshot.map != NULL)
+        munmap(db->snapshot.map, db->snapshot.size);
+    memset(&db->snapshot, 0, sizeof(t_snapshot));
+}
+
+
+//Write-ahead log
+
+/*
+ * int recoverLog()
+ *
+ * --- DESCRIPTION ---
+ * replays the log that goes on from the checkpoint db was restored from, then opens it for the
+ * next commands. restoreSnapshot left the generation of that log and where the checkpoint is in
+ * it, both 0 without a checkpoint. The groups are replayed up to the first one that isn't whole,
+ * which a crash cut, and the file is cut there. A log of the generation before was left by a
+ * crash during a checkpoint, after the snapshot and before the log replacing it: what it holds
+ * is in the snapshot, so a new log is started, as when there is none. A checkpoint pointing into
+ * a log that is gone is taken again, with a log of its own
+ *
+ * --- PARAMETERS ---
+ * none
+ *
+ * --- RETURN VALUES ---
+ * 0, or the errno of what failed; EINVAL for a log that doesn't go on from the checkpoint
+ */
+static int recoverLog() {
+    t_log *log = &db->log;
+    unsigned char header[LOG_HEADER_SIZE];
+    uint64_t generation, offset = log->size < LOG_HEADER_SIZE ? LOG_HEADER_SIZE : log->size, size;
+    struct stat info;
+    void *map;
+    int error;
+
+    if ((log->fd = open(log->logPath, O_RDWR)) < 0) {
+        if (errno != ENOENT)
+            return errno;
+        if ((error = startLog()) != 0 || offset == LOG_HEADER_SIZE)
+            return error;
+        return checkpointLog();     //the checkpoint points into a log that is gone
+    }
+    if (fstat(log->fd, &info) != 0)
+        return errno;
+    size = (uint64_t)info.st_size;
+    if (pread(log->fd, header, LOG_HEADER_SIZE, 0) != LOG_HEADER_SIZE || memcmp(header, LOG_MAGIC, 4) != 0 ||
+            read32(header + 4) != LOG_VERSION)
+        return EINVAL;
+    generation = read64(header + 8);
+    if (generation + 1 == log->generation) {
+        close(log->fd);
+        log->fd = -1;
+        return startLog();
+    }
+    if (generation != log->generation || offset > size)
+        return EINVAL;
+    if ((map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, log->fd, 0)) == MAP_FAILED)
+        return errno;
+    offset = replayLog(map, offset, size);
+    munmap(map, size);
+    if (offset < size && ftruncate(log->fd, (off_t)offset) != 0)
+        return errno;
+    settle();
+    log->size = offset;
+    log->names = db->pool.count;
+    putBytes(&log->group, header, LOG_FRAME_HEADER);    //room for the frame header
+    log->active = true;
+    return 0;
+}
+
+/*
+ * replays the groups of the log from offset, returns where the last whole one ends
+ */
+static uint64_t replayLog(const unsigned char *file, uint64_t offset, uint64_t size) {
+    uint32_t records;
+
+    while (size - offset >= LOG_FRAME_HEADER) {
+        records = (uint32_t)read32(file + offset);
+        if (records == 0 || records > size - offset - LOG_FRAME_HEADER ||
+                read32(file + offset + 4) != (uint32_t)hash((t_slice){(const char*)file + offset + LOG_FRAME_HEADER, records}, 0))
+            break;
+        if (!replayGroup(file + offset + LOG_FRAME_HEADER, records))
+            break;
+        offset += LOG_FRAME_HEADER + records;
+    }
+    return offset;
+}
+
+/*
+ * runs the records of a group through db_apply. The names are interned in the order they were
+ * logged, which gives them the IDs they had; false for a record that doesn't make sense
+ */
+static bool replayGroup(const unsigned char *cursor, size_t size) {
+    const unsigned char *end = cursor + size;
+    uint32_t ids[3], length;
+    t_id count;
+    int names, i;
+    db_op_t op;
+
+    while (cursor < end) {
+        switch (*cursor++) {
+            case LOG_NAME:
+                count = db->pool.count;
+                if (!getVarint(&cursor, end, &length) || length > (size_t)(end - cursor) ||
+                        internName((t_slice){(const char*)cursor, length}, true) != count || db->pool.count != count + 1)
+                    return false;
+                cursor += length;
+                continue;
+            case LOG_ADDENT: op = DB_ADDENT; names = 1; break;
+            case LOG_DELENT: op = DB_DELENT; names = 1; break;
+            case LOG_ADDREL: op = DB_ADDREL; names = 3; break;
+            case LOG_DELREL: op = DB_DELREL; names = 3; break;
+            case LOG_DROPREL: op = DB_DROPREL; names = 1; break;
+            default:
+                return false;
+        }
+        for (i = 0; i < names; i++)
+            if (!getVarint(&cursor, end, &ids[i]) || ids[i] >= db->pool.count)
+                return false;
+        if (op == DB_DROPREL)
+            db_apply(db, op, DB_NO_NAME, DB_NO_NAME, ids[0]);
+        else
+            db_apply(db, op, ids[0], names == 3 ? ids[1] : DB_NO_NAME, names == 3 ? ids[2] : DB_NO_NAME);
+    }
+    return true;
+}
+
+/*
+ * int startLog()
+ *
+ * --- DESCRIPTION ---
+ * replaces the log with an empty one of db->log.generation: it is written next to it, fsynced
+ * and renamed over it, so a crash leaves one log or the other. Then the commands go to it
+ *
+ * --- PARAMETERS ---
+ * none
+ *
+ * --- RETURN VALUES ---
+ * 0, or the errno of what failed
+ */
+static int startLog() {
+    t_log *log = &db->log;
+    unsigned char header[LOG_HEADER_SIZE];
+    uint32_t version = LOG_VERSION;
+    char *temp;
+    int fd, error = 0;
+
+    if (asprintf(&temp, "%s.tmp", log->logPath) < 0)
+        return ENOMEM;
+    memcpy(header, LOG_MAGIC, 4);
+    memcpy(header + 4, &version, 4);
+    memcpy(header + 8, &log->generation, 8);
+    if ((fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        free(temp);
+        return errno;
+    }
+    if (pwrite(fd, header, LOG_HEADER_SIZE, 0) != LOG_HEADER_SIZE || fdatasync(fd) != 0 ||
+            rename(temp, log->logPath) != 0)
+        error = errno != 0 ? errno : EIO;
+    else
+        error = syncDirectory(log->logPath);
+    free(temp);
+    if (error != 0) {
+        close(fd);
+        return error;
+    }
+    if (log->fd >= 0)
+        close(log->fd);
+    log->fd = fd;
+    log->size = LOG_HEADER_SIZE;
+    log->names = db->pool.count;
+    log->unsynced = false;
+    log->group.size = 0;
+    putBytes(&log->group, header, LOG_FRAME_HEADER);    //room for the frame header
+    log->active = true;
+    return 0;
+}
+
+/*
+ * bool logCommand(db_op_t op, t_id first, t_id second, t_id relation)
+ *
+ * --- DESCRIPTION ---
+ * adds a command to the group being filled, before db_apply runs it: its opcode and the
+ * varints of its names, after the names interned since the last command. A command with a name
+ * missing does nothing, and isn't logged. The group is written once full, or late, or after each
+ * command with DB_SYNC_ALWAYS; it is fsynced then, unless DB_SYNC_NONE. A late group is written
+ * by the next command, or by the flusher if none comes, see flushLog
+ *
+ * --- PARAMETERS ---
+ * op, first, second, relation: as for db_apply
+ *
+ * --- RETURN VALUES ---
+ * true if the log is due for a checkpoint, which db_apply takes once the command ran
+ */
+static bool logCommand(db_op_t op, t_id first, t_id second, t_id relation) {
+    static const unsigned char opcodes[] = {
+        [DB_ADDENT] = LOG_ADDENT, [DB_DELENT] = LOG_DELENT, [DB_ADDREL] = LOG_ADDREL,
+        [DB_DELREL] = LOG_DELREL, [DB_DROPREL] = LOG_DROPREL
+    };
+    t_log *log = &db->log;
+    bool pair = op == DB_ADDREL || op == DB_DELREL, due;
+
+    if (op == DB_DROPREL ? relation == NO_ID : first == NO_ID || (pair && (second == NO_ID || relation == NO_ID)))
+        return false;
+    pthread_mutex_lock(&log->lock);
+    if (log->error != 0) {
+        pthread_mutex_unlock(&log->lock);
+        return false;
+    }
+    if (log->group.size == LOG_FRAME_HEADER && log->durability.groupMicros > 0) {
+        log->groupStart = logClock();
+        if (log->flushing)
+            pthread_cond_signal(&log->wake);
+    }
+    logNames();
+    putBytes(&log->group, &opcodes[op], 1);
+    putVarint(&log->group, op == DB_DROPREL ? relation : first);
+    if (pair) {
+        putVarint(&log->group, second);
+        putVarint(&log->group, relation);
+    }
+    log->commands++;
+    if (log->durability.sync == DB_SYNC_ALWAYS || log->group.size - LOG_FRAME_HEADER >= log->durability.groupBytes ||
+            (log->durability.groupMicros > 0 && logClock() - log->groupStart >= log->durability.groupMicros))
+        writeGroup(log, log->durability.sync != DB_SYNC_NONE);
+    due = log->error == 0 && log->durability.checkpointBytes > 0 && log->size >= log->durability.checkpointBytes;
+    pthread_mutex_unlock(&log->lock);
+    return due;
+}
+
+/*
+ * the names interned since the last ones logged, in order
+ */
+static void logNames() {
+    t_log *log = &db->log;
+    unsigned char opcode = LOG_NAME;
+
+    if (log->error != 0)
+        return;
+    for (; log->names < db->pool.count; log->names++) {
+        putBytes(&log->group, &opcode, 1);
+        putVarint(&log->group, (uint32_t)poolLength(log->names));
+        putBytes(&log->group, poolName(log->names), poolLength(log->names));
+    }
+}
+
+/*
+ * writes the group being filled at the end of the log, with its length and the checksum of its
+ * records in front, then fsyncs the log if asked and something was written since the last time.
+ * Called with the lock of the log held, or once the flusher is gone
+ */
+static void writeGroup(t_log *log, bool sync) {
+    uint32_t frame[2];
+    size_t written = 0;
+    ssize_t n;
+
+    if (log->error != 0)
+        return;
+    if (log->group.size > LOG_FRAME_HEADER) {
+        frame[0] = (uint32_t)(log->group.size - LOG_FRAME_HEADER);
+        frame[1] = (uint32_t)hash((t_slice){(const char*)log->group.data + LOG_FRAME_HEADER, frame[0]}, 0);
+        memcpy(log->group.data, frame, LOG_FRAME_HEADER);
+        while (written < log->group.size) {
+            n = pwrite(log->fd, log->group.data + written, log->group.size - written, (off_t)(log->size + written));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                log->error = n < 0 ? errno : EIO;
+                return;
+            }
+            written += (size_t)n;
+        }
+        log->size += log->group.size;
+        log->group.size = LOG_FRAME_HEADER;
+        log->groups++;
+        log->unsynced = true;
+    }
+    if (sync && log->unsynced) {
+        if (fdatasync(log->fd) != 0) {
+            log->error = errno;
+            return;
+        }
+        log->unsynced = false;
+        log->syncs++;
+    }
+}
+
+/*
+ * the thread db_recover starts when groups have a window: it sleeps until the group being filled
+ * is late and writes it, so that an idle database doesn't keep its last commands in memory. It
+ * doesn't use db, only the log given
+ */
+static void *flushLog(void *argument) {
+    t_log *log = argument;
+    struct timespec until;
+    uint64_t deadline;
+
+    pthread_mutex_lock(&log->lock);
+    while (!log->stopping) {
+        if (log->error != 0 || log->group.size <= LOG_FRAME_HEADER) {
+            pthread_cond_wait(&log->wake, &log->lock);
+            continue;
+        }
+        deadline = log->groupStart + log->durability.groupMicros;
+        if (logClock() >= deadline) {
+            writeGroup(log, log->durability.sync != DB_SYNC_NONE);
+            continue;
+        }
+        until.tv_sec = (time_t)(deadline / 1000000);
+        until.tv_nsec = (long)(deadline % 1000000) * 1000;
+        pthread_cond_timedwait(&log->wake, &log->lock, &until);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+/*
+ * int checkpointLog()
+ *
+ * --- DESCRIPTION ---
+ * saves the database to the checkpoint file and starts the log over: what it holds is in the
+ * snapshot. The snapshot says the log going on from it is the next generation, so recovery
+ * knows to skip the old one if a crash comes before it is replaced, see recoverLog
+ *
+ * --- PARAMETERS ---
+ * none
+ *
+ * --- RETURN VALUES ---
+ * 0, or the errno of what failed; the log is left as it was if the snapshot couldn't be
+ * written, and stops taking commands if the new log couldn't be started
+ */
+static int checkpointLog() {
+    t_log *log = &db->log;
+    uint64_t size;
+    int error;
+
+    pthread_mutex_lock(&log->lock);
+    logNames();
+    writeGroup(log, true);
+    if ((error = log->error) != 0) {
+        pthread_mutex_unlock(&log->lock);
+        return error;
+    }
+    settle();
+    size = log->size;
+    log->generation++;
+    log->size = LOG_HEADER_SIZE;
+    if ((error = saveSnapshot(log->path)) == 0)
+        error = syncDirectory(log->path);
+    if (error != 0) {
+        log->generation--;
+        log->size = size;
+    }
+    else {
+        if ((error = startLog()) != 0)
+            log->error = error;     //the commands would go to the old log, which recovery skips now
+        log->checkpoints++;
+    }
+    pthread_mutex_unlock(&log->lock);
+    return error;
+}
+
+/*
+ * writes what is left and closes the log, as the durability says
+ */
+static void closeLog() {
+    t_log *log = &db->log;
+
+    if (log->flushing) {
+        pthread_mutex_lock(&log->lock);
+        log->stopping = true;
+        pthread_cond_signal(&log->wake);
+        pthread_mutex_unlock(&log->lock);
+        pthread_join(log->flusher, NULL);
+    }
+    if (log->active)
+        writeGroup(log, log->durability.sync != DB_SYNC_NONE);
+    if (log->fd >= 0)
+        close(log->fd);
+    if (log->logPath != NULL) {     //db_recover got as far as the lock
+        pthread_mutex_destroy(&log->lock);
+        pthread_cond_destroy(&log->wake);
+    }
+    free(log->path);
+    free(log->logPath);
+    free(log->group.data);
+    memset(log, 0, sizeof(t_log));
+    log->fd = -1;
+}
+
+static void printLogStats(FILE *out) {
+    t_log *log = &db->log;
+
+    pthread_mutex_lock(&log->lock);
+    fprintf(out, "log: %llu commands, %llu groups, %llu fsyncs, %llu checkpoints; generation %llu, %llu bytes%s%s\n",
+            (unsigned long long)log->commands, (unsigned long long)log->groups, (unsigned long long)log->syncs,
+            (unsigned long long)log->checkpoints, (unsigned long long)log->generation, (unsigned long long)log->size,
+            log->error != 0 ? ", stopped: " : "", log->error != 0 ? strerror(log->error) : "");
+    pthread_mutex_unlock(&log->lock);
+}
+
+/*
+ * fsyncs the directory of path, so that a rename in it is on the disk too
+ */
+static int syncDirectory(const char *path) {
+    char *copy = strdup(path);
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY), error = 0;
+
+    free(copy);
+    if (fd < 0)
+        return errno;
+    if (fsync(fd) != 0)
+        error = errno;
+    close(fd);
+    return error;
+}
+
+static uint64_t logClock() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
@@ -0,0 +1,127 @@
+// --- DATABASE LIBRARY ---
+/*
+ * The engine behind main.c, to be linked into other programs: entities, relations between them
+ * and reports on who receives each relation the most. Everything lives in a database, opened with
+ * db_open and freed with db_close; any number of them can be open at once, each used by one
+ * thread at a time. Names are passed as a pointer and a length, they don't need to be
+ * null-terminated and are copied when kept.
+ *
+ * The calls do what the commands of the same name do, see README.md:
+ *   db_addent, db_delent           add or delete an entity
+ *   db_addrel, db_delrel           add or delete a relation from a sender to a recipient
+ *   db_droprel                     delete every instance of a relation
+ *   db_report, db_reportdiff       the text of a report or a reportdiff, newline included; it
+ *                                  stays valid until the next call on the database
+ *   db_report_iter                 the same report, a recipient at a time
+ *   db_scan_entities               the entities whose name starts with a prefix, in the order
+ *                                  strcmp gives
+ *   db_memstats, db_stats          memory usage; that plus the name index and the compactor
+ *   db_memory                      the bytes the database holds, in one number
+ *   db_save                        writes the database to a snapshot file
+ *   db_sync, db_checkpoint         flush the write-ahead log; checkpoint it, see below
+ *   db_snapshot_error              whether the instances read from a snapshot were damaged
+ *
+ * db_restore opens a database from a snapshot: the file is mapped and only the names and the
+ * records are read right away, the instances of each relation the first time a command needs
+ * them, so the first command runs at once whatever the size of the file. The reports print what
+ * was saved; reportdiff starts from there, as if a report had just been printed. db_save returns
+ * 0 or an errno, db_restore NULL with errno set, EINVAL for a file that isn't a whole snapshot
+ * of this build, or whose checksum or contents don't hold up. The instances of each relation
+ * have a checksum of their own, checked when they are read: a relation whose instances don't
+ * match it comes back empty, and db_snapshot_error returns EBADMSG from then on.
+ *
+ * db_recover opens a database that survives crashes: the snapshot at path, if any, is restored,
+ * then the write-ahead log path.wal replays the commands that came after it, and logs the next
+ * ones. Only addent, delent, addrel, delrel and droprel are logged, a byte of opcode and the
+ * varints of the name IDs, each name once before its first use. The records go to the file in
+ * groups, each with its length and checksum; a group cut by a crash is dropped at recovery. The
+ * durability says when a group is written and fsynced; with a window, a thread of the database
+ * writes a late group that no command came to write. A checkpoint saves the database to path
+ * and starts the log over, when it grows past checkpointBytes or at db_checkpoint. db_sync writes
+ * and fsyncs the group being filled, whatever the durability; both return 0 or the errno of the
+ * first write that failed, after which nothing more is logged. db_recover returns NULL with errno
+ * set, EINVAL when the log doesn't go on from the snapshot at path.
+ *
+ * Names can also be interned once with db_intern, which gives them a db_name_t, and the commands
+ * given by name through db_apply: no hashing at each call. That's how the binary input of main.c
+ * is run. db_find returns DB_NO_NAME for a name never interned, which db_apply ignores. A name
+ * holding a NUL byte is never interned: db_intern and db_find return DB_NO_NAME for it, and the
+ * calls taking names do nothing with it.
+ */
+#ifndef DB_H
+#define DB_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _db db_t;
+typedef uint32_t db_name_t;
+
+#define DB_NO_NAME UINT32_MAX
+
+//flags of db_open
+#define DB_BATCH 1      //keeps only the net effect of the commands between two reports, see --batch
+#define DB_SHARDS 2     //runs addrel and delrel of different relations in parallel, see --shards
+
+//when db_recover writes the groups of the log to the disk
+#define DB_SYNC_NONE 0      //written when full or late and never fsynced, the system flushes them when it wants
+#define DB_SYNC_GROUP 1     //written and fsynced when full or late: a crash loses at most the group being filled
+#define DB_SYNC_ALWAYS 2    //written and fsynced after every command
+
+typedef enum _dbOp {
+    DB_ADDENT,      //entity
+    DB_DELENT,      //entity
+    DB_ADDREL,      //sender, recipient, relation
+    DB_DELREL,      //sender, recipient, relation
+    DB_DROPREL      //relation, as the third name
+} db_op_t;
+
+typedef struct _dbDurability {
+    int sync;                   //DB_SYNC_xxx
+    size_t groupBytes;          //a group is full with this many bytes of records
+    unsigned groupMicros;       //written this long after its first command at the latest, 0 only when full
+    size_t checkpointBytes;     //the log is checkpointed once this big, 0 only at db_checkpoint
+} db_durability_t;
+
+//called by db_report_iter for each recipient of the report, in order
+typedef void (*db_report_fn)(void *context, const char *relation, size_t relationLen, const char *recipient,
+                             size_t recipientLen, uint32_t count);
+
+//called by db_scan_entities for each entity it finds, in order; it mustn't change the database
+typedef void (*db_entity_fn)(void *context, const char *name, size_t len);
+
+db_t *db_open(unsigned flags);
+db_t *db_restore(const char *path, unsigned flags);
+db_t *db_recover(const char *path, unsigned flags, const db_durability_t *durability);
+void db_close(db_t *db);
+
+db_name_t db_intern(db_t *db, const char *name, size_t len);
+db_name_t db_find(db_t *db, const char *name, size_t len);
+const char *db_name(db_t *db, db_name_t name, size_t *len);
+size_t db_names(db_t *db);
+void db_apply(db_t *db, db_op_t op, db_name_t first, db_name_t second, db_name_t relation);
+
+void db_addent(db_t *db, const char *name, size_t len);
+void db_delent(db_t *db, const char *name, size_t len);
+void db_addrel(db_t *db, const char *sender, size_t senderLen, const char *recipient, size_t recipientLen,
+               const char *relation, size_t relationLen);
+void db_delrel(db_t *db, const char *sender, size_t senderLen, const char *recipient, size_t recipientLen,
+               const char *relation, size_t relationLen);
+void db_droprel(db_t *db, const char *relation, size_t len);
+
+const char *db_report(db_t *db, size_t *len);
+const char *db_reportdiff(db_t *db, size_t *len);
+void db_report_iter(db_t *db, db_report_fn visit, void *context);
+void db_scan_entities(db_t *db, const char *prefix, size_t len, db_entity_fn visit, void *context);
+
+size_t db_memory(db_t *db);
+int db_save(db_t *db, const char *path);
+int db_sync(db_t *db);
+int db_checkpoint(db_t *db);
+int db_snapshot_error(db_t *db);
+void db_memstats(db_t *db, FILE *out);
+void db_stats(db_t *db, FILE *out);
+void db_batch_stats(db_t *db, FILE *out);
+
+#endif
@@ -1,1050 +1,1455 @@
 // --- LIBRARIES ---
+/*
+ * the command line program: reads the commands from stdin, as text or binary, and prints the
+ * reports on stdout. The database itself is the library of db.h
+ */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "buffer.h"
+#include "db.h"
 
 // --- CONSTANTS ---
 
-#define HASH_SIZE_ENT 271
-#define HASH_SIZE_REL 271
-#define HASH_MULTIPLIER 31
-#define  MAX_STRING_SIZE 100
+#ifndef INPUT_BLOCK_SIZE
+#define INPUT_BLOCK_SIZE (1 << 20)    //bytes requested to read() at a time when the input is not mappable
+#endif
+#ifndef OUTPUT_BUFFER_SIZE
+#define OUTPUT_BUFFER_SIZE (1 << 16)  //reports are collected up to this many bytes before a write()
+#endif
+
+//--pipeline: commands the parser hands over at a time, batches and output buffers in flight
+#ifndef PIPELINE_BATCH
+#define PIPELINE_BATCH 256
+#endif
+#ifndef PIPELINE_SLOTS
+#define PIPELINE_SLOTS 8
+#endif
+#define PIPELINE_NAME_BYTES (1 << 14)   //names copied in a batch, when the input is a pipe
+#define PIPELINE_SPIN 64    //yields before a thread waiting on a ring goes to sleep
+//--files: threads running the files, 0 for one per online CPU
+#ifndef RUNNER_THREADS
+#define RUNNER_THREADS 0
+#endif
+//--wal: the durability of the log, see db_durability_t
+#ifndef WAL_SYNC
+#define WAL_SYNC DB_SYNC_GROUP
+#endif
+#ifndef WAL_GROUP_BYTES
+#define WAL_GROUP_BYTES (1 << 16)
+#endif
+#ifndef WAL_GROUP_MICROS
+#define WAL_GROUP_MICROS 2000
+#endif
+#ifndef WAL_CHECKPOINT_BYTES
+#define WAL_CHECKPOINT_BYTES (64 << 20)
+#endif
+#define MEMORY_SAMPLE (1 << 16)     //commands between two looks at the memory of a database
+
+#define MAX_LINE_QUOTES 6   //three names at most, two quotes each
+
+//tokenizer kernels, pick one with -DSCAN_KERNEL=SCAN_KERNEL_xxx (the default chooses at runtime)
+#define SCAN_KERNEL_AUTO 0
+#define SCAN_KERNEL_SCALAR 1
+#define SCAN_KERNEL_SSE2 2
+#define SCAN_KERNEL_AVX2 3
+#ifndef SCAN_KERNEL
+#define SCAN_KERNEL SCAN_KERNEL_AUTO
+#endif
+#if !defined(__SSE2__) || !(defined(__x86_64__) || defined(__i386__))
+#undef SCAN_KERNEL
+#define SCAN_KERNEL SCAN_KERNEL_SCALAR
+#endif
+
+//the first 6 bytes of a line, read as a little-endian integer
+#define COMMAND_KEY(a, b, c, d, e, f) \
+    ((uint64_t)(unsigned char)(a) | (uint64_t)(unsigned char)(b) << 8 | (uint64_t)(unsigned char)(c) << 16 | \
+     (uint64_t)(unsigned char)(d) << 24 | (uint64_t)(unsigned char)(e) << 32 | (uint64_t)(unsigned char)(f) << 40)
+//first ^ fifth character: a perfect hash of the eight command names into 16 slots
+#define COMMAND_SLOT(key) ((unsigned)((key) ^ ((key) >> 32)) & 15)
+
+//binary protocol: a header, then records made of a varint length, a 1-byte opcode and the payload
+#define BIN_MAGIC "\x89RDB"
+#define BIN_MAGIC_SIZE 4
+#define BIN_VERSION 1
+#define BIN_HEADER_SIZE (BIN_MAGIC_SIZE + 1)
+#define BIN_NAME 0x01       //payload: the name; defines the next dictionary ID, starting from 0
+#define BIN_ADDENT 0x02     //payload: varint entity ID
+#define BIN_DELENT 0x03     //payload: varint entity ID
+#define BIN_ADDREL 0x04     //payload: varint sender ID, varint recipient ID, varint relation ID
+#define BIN_DELREL 0x05     //payload: same as BIN_ADDREL
+#define BIN_REPORT 0x06     //no payload
+#define BIN_END 0x07        //no payload
+#define BIN_MEMSTATS 0x08   //no payload
+#define BIN_DROPREL 0x09    //payload: varint relation ID
+#define BIN_REPORTDIFF 0x0A //no payload
+#define BIN_SAVE 0x0B       //payload: the path of the snapshot
 
 
 // --- DATA TYPES DEFINITIONS ---
 
-typedef struct _entity {
-    char name[MAX_STRING_SIZE];
-    unsigned short int version;   //odd if valid, even otherwise
-    struct _relationTree *relations;
-    struct _entity *next;
-} t_entity, *t_entityAddr;
-
-typedef struct _senderList {
-    t_entity *address;
-    unsigned short int version;
-    struct _senderList *next;
-} t_senderList;
-
-typedef struct _entityTree {
-    struct _entityTree *rightChild;
-    struct _entityTree *leftChild;
-    int height;
-
-    t_entity *entity;
-    int version;
-} t_entityTree;
-
-typedef struct _relInstance {
-    struct _relInstance *rightChild;
-    struct _relInstance *leftChild;
-    int height;
-
-    t_entity *recipient;
-    int numSenders;
-    unsigned short int recVersion;
-    t_entityTree *senderList;
-} t_relInstance;
-
-typedef struct _relation {
-    char name[MAX_STRING_SIZE];
-    t_relInstance *root;
-    int maxSenders;
-    bool recalc;
-    t_entityTree *recipients;
-    struct _relation *next;
-} t_relation, *t_relAddr;
-
-typedef struct _relationTree {
-    struct _relationTree *rightChild;
-    struct _relationTree *leftChild;
-    int height;
-
-    t_relation *relation;
-} t_relationTree;
-
+typedef struct _slice {     //a name as found in the input buffer, without quotes
+    const char *ptr;
+    size_t len;
+} t_slice;
+
+typedef struct _input {
+    char *buffer;
+    size_t size;        //valid bytes in the buffer
+    size_t capacity;
+    size_t pos;         //first byte not consumed yet
+    int fd;
+    bool mapped;        //the whole file is mapped, no more reads needed
+    bool eof;
+} t_input;
+
+typedef enum _opcode {
+    CMD_NONE,       //unknown or malformed line, ignored
+    CMD_ADDENT,
+    CMD_DELENT,
+    CMD_ADDREL,
+    CMD_DELREL,
+    CMD_REPORT,
+    CMD_MEMSTATS,
+    CMD_DROPREL,
+    CMD_REPORTDIFF,
+    CMD_SAVE,
+    CMD_END
+} t_opcode;
+
+typedef struct _command {
+    t_opcode opcode;
+    t_slice ent1;
+    t_slice ent2;
+    t_slice rel;
+} t_command;
+
+typedef struct _commandSlot {
+    uint64_t key;
+    t_opcode opcode;
+    int names;      //how many quoted names follow the command
+} t_commandSlot;
+
+typedef struct _dictionary {    //the name each binary dictionary ID has been interned to
+    db_name_t *names;
+    uint32_t size;
+    uint32_t capacity;
+} t_dictionary;
+
+typedef struct _binCommand {    //same as t_command, with dictionary IDs in place of the names
+    t_opcode opcode;
+    uint32_t ent1;
+    uint32_t ent2;
+    uint32_t rel;
+    t_slice path;   //save, in the input buffer
+} t_binCommand;
+
+//finds '"' and '\n' in [start, end), see scanLineScalar
+typedef const char *(*t_scanKernel)(const char*, const char*, const char**, int*);
+
+typedef struct _ring {          //a single-producer single-consumer ring, only the positions: the slots are the user's
+    atomic_size_t head;         //slots published by the producer
+    atomic_size_t tail;         //slots given back by the consumer
+    atomic_int sleepers;        //threads waiting on wake, see waitRing
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} t_ring;
+
+typedef struct _commandBatch {
+    t_command *commands;        //PIPELINE_BATCH of them
+    uint32_t count;
+    bool end;                   //the last batch, the input is over after its commands
+    t_byteBuffer names;         //where the names of the commands point, unless the input is mapped
+} t_commandBatch;
+
+typedef struct _pipeline {      //--pipeline: the parser and the writer threads around the main one
+    t_input *input;             //NULL if the main thread parses
+    pthread_t parser;
+    pthread_t writer;
+    bool running;               //writeOutput hands the output to the writer
+    t_ring commands;            //parser to main thread
+    t_commandBatch batches[PIPELINE_SLOTS];
+    uint32_t next;              //next command of the batch at the tail of commands
+    bool holding;               //the main thread has the batch at the tail
+    t_ring output;              //main thread to writer
+    t_byteBuffer buffers[PIPELINE_SLOTS];   //empty ones are the writer's signal to stop
+} t_pipeline;
+
+typedef struct _fileRun {       //a file of --files, and what running it took
+    const char *path;
+    int error;                  //errno of the open that failed, 0 if it ran
+    size_t commands;
+    double seconds;
+    size_t peakBytes;           //the most db_memory said, see runFile
+} t_fileRun;
+
+typedef struct _fileRunner {
+    t_fileRun *runs;
+    size_t numRuns;
+    atomic_size_t next;         //first file not taken yet
+} t_fileRunner;
 
 
 // --- GLOBAL VARIABLES ---
 
-t_entityAddr entityTable[HASH_SIZE_ENT];
-t_relAddr relTable[HASH_SIZE_REL];
-t_relationTree *relRoot;
+t_pipeline pipeline = {.commands = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER},
+                       .output = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER}};
+__thread t_byteBuffer output;      //bytes for the output not written yet, see writeOutput
+__thread int outputFd = STDOUT_FILENO;  //the files of --files each have their own, and their own database
+__thread db_t *database;
+t_scanKernel scanLine;
+const t_commandSlot commandTable[16] = {
+    [COMMAND_SLOT(COMMAND_KEY('a','d','d','e','n','t'))] = {COMMAND_KEY('a','d','d','e','n','t'), CMD_ADDENT, 1},
+    [COMMAND_SLOT(COMMAND_KEY('d','e','l','e','n','t'))] = {COMMAND_KEY('d','e','l','e','n','t'), CMD_DELENT, 1},
+    [COMMAND_SLOT(COMMAND_KEY('a','d','d','r','e','l'))] = {COMMAND_KEY('a','d','d','r','e','l'), CMD_ADDREL, 3},
+    [COMMAND_SLOT(COMMAND_KEY('d','e','l','r','e','l'))] = {COMMAND_KEY('d','e','l','r','e','l'), CMD_DELREL, 3},
+    [COMMAND_SLOT(COMMAND_KEY('r','e','p','o','r','t'))] = {COMMAND_KEY('r','e','p','o','r','t'), CMD_REPORT, 0},
+    [COMMAND_SLOT(COMMAND_KEY('m','e','m','s','t','a'))] = {COMMAND_KEY('m','e','m','s','t','a'), CMD_MEMSTATS, 0},
+    [COMMAND_SLOT(COMMAND_KEY('d','r','o','p','r','e'))] = {COMMAND_KEY('d','r','o','p','r','e'), CMD_DROPREL, 1},
+    [COMMAND_SLOT(COMMAND_KEY('s','a','v','e',' ','"'))] = {COMMAND_KEY('s','a','v','e',' ','"'), CMD_SAVE, 1},
+};
 
 // --- FUNCTIONS PROTOTYPES ---
 
+//Input buffering
+void openInput(t_input*, int);
+void closeInput(t_input*);
+int fillInput(t_input*);
+int nextLine(t_input*, const char**, const char**, const char**, int*);
+
+//Output buffering
+void writeOutput(const void*, size_t);
+void passOutput(void);
+void flushOutput(void);
+void writeAll(const void*, size_t);
+
+//Tokenizer kernels
+void selectScanKernel(void);
+const char *scanTail(const char*, const char*, const char**, int*);
+const char *scanLineScalar(const char*, const char*, const char**, int*);
+#if SCAN_KERNEL != SCAN_KERNEL_SCALAR
+const char *scanLineSSE2(const char*, const char*, const char**, int*);
+#endif
+#if SCAN_KERNEL == SCAN_KERNEL_AUTO || SCAN_KERNEL == SCAN_KERNEL_AVX2
+const char *scanLineAVX2(const char*, const char*, const char**, int*);
+#endif
+
 //Command parsing and execution
-int getCommand(char*, char*, char*, char*);
-void executeCommand(char*, char*, char*, char*);
-void addEntity(char*);
-void deleteEntity(char*);
-void addRelation(char*, char*, char*);
-void deleteRelation(char*, char*, char*);
-void printReport(void);
-
-//Relation insertion and deletion
-t_entity *getEntityAddr(t_entity*, char*);
-t_relInstance *addRelationInstance(t_relation*, t_relInstance*, t_entity*, t_entity*);
-void delRelationInstance(t_relation*, t_relInstance*, t_entity*, t_entity*);
-
-//Queue management
-t_entityTree *addToRecipientTree(t_entityTree*, t_entity*);
-t_entityTree *delItem(t_entityTree*, t_entity*);
-t_entityTree *delTree(t_entityTree *node);
-
-//Report printing and support
-int countInstanceSenders(t_relation*, t_relInstance*);
-void recalcRecipients(t_relation*, t_relInstance*);
-int printSingleReport(t_relation*);
-int printRelations(t_relationTree*);
-
-
-//AVL support
-int getBalance(t_relInstance*);
-int getHeight(t_relInstance*);
-
-int ent_getBalance(t_entityTree*);
-int ent_getHeight(t_entityTree*);
-
-int rel_getBalance(t_relationTree*);
-int rel_getHeight(t_relationTree*);
-
-t_entityTree *ent_minValueNode(t_entityTree*);
-void ent_printTree (t_entityTree*);
-
-t_relationTree *addToRelTree(t_relationTree*, t_relation*);
-
-// AVL rotation
-t_relInstance *doubleRotateLeft(t_relInstance*);
-t_relInstance *doubleRotateRight(t_relInstance*);
-t_relInstance *rotateLeft(t_relInstance*);
-t_relInstance *rotateRight(t_relInstance*);
-
-t_entityTree *ent_doubleRotateLeft(t_entityTree*);
-t_entityTree *ent_doubleRotateRight(t_entityTree*);
-t_entityTree *ent_rotateLeft(t_entityTree*);
-t_entityTree *ent_rotateRight(t_entityTree*);
-
-t_relationTree *rel_doubleRotateLeft(t_relationTree*);
-t_relationTree *rel_doubleRotateRight(t_relationTree*);
-t_relationTree *rel_rotateLeft(t_relationTree*);
-t_relationTree *rel_rotateRight(t_relationTree*);
-
-//misc
-int max(int, int);
-unsigned int hash(const char*, int, int);
-void refreshFlags(t_relationTree *node);
-
-t_entityTree *addSender(t_entityTree*, t_entity*, int*);
-t_entityTree *delSender(t_entityTree*, t_entity*, int*);
-int countTreeNodes (t_entityTree*);
-
-int main(){
-    char command[7],
-            entName1[MAX_STRING_SIZE],
-            entName2[MAX_STRING_SIZE],
-            relName[MAX_STRING_SIZE];
+t_opcode getCommand(t_input*, t_command*);
+void executeCommand(t_command*);
+void printCommand(t_opcode);
+void saveCommand(const char*, size_t);
+
+//Binary protocol
+bool ensureInput(t_input*, size_t);
+bool isBinaryInput(t_input*);
+void addDictionaryEntry(t_dictionary*, const unsigned char*, size_t);
+t_opcode getBinaryCommand(t_input*, t_dictionary*, t_binCommand*);
+void executeBinaryCommand(t_dictionary*, t_binCommand*);
+
+//Text to binary conversion
+void convertInput(t_input*, FILE*);
+void putRecord(t_byteBuffer*, unsigned char, const t_byteBuffer*);
+
+//Pipeline
+void startPipeline(t_input*);
+void stopPipeline(void);
+t_opcode pipelineCommand(t_command*);
+void *parseWorker(void*);
+t_commandBatch *nextBatch(void);
+bool batchNames(t_commandBatch*, t_command*);
+void *writeWorker(void*);
+size_t waitRing(t_ring*, size_t, size_t);
+void advanceRing(t_ring*, bool);
+
+//Multiple files
+int runFiles(char**, int);
+void *fileWorker(void*);
+void runFile(t_fileRun*);
+double now(void);
+
+int main(int argc, char **argv){
+    t_command command;
+    t_binCommand binCommand;
+    t_dictionary dictionary = {NULL, 0, 0};
+    t_input input;
+    const db_durability_t durability = {WAL_SYNC, WAL_GROUP_BYTES, WAL_GROUP_MICROS, WAL_CHECKPOINT_BYTES};
+    const char *snapshot = NULL, *checkpoint = NULL;
+    bool batching = false, sharding = false, pipelining = false, converting = false, stats = false;
+    int error, i;
     //freopen("TestCases/3_Mixup/batch3.1.in", "r", stdin);      //redirecting standard input, used for debugging in CLion
 
-    while(getCommand(command, entName1, entName2, relName) != 1) {
-        executeCommand(command, entName1, entName2, relName);
+    selectScanKernel();
+    if (argc > 2 && strcmp(argv[1], "--files") == 0)    //the files given, in parallel, see runFiles
+        return runFiles(argv + 2, argc - 2);
+    for (i = 1; i < argc; i++) {    //in this order, anything else is a usage error
+        if (i == 1 && argc == 2 && strcmp(argv[i], "--convert") == 0)      //alone: text commands in, binary out
+            converting = true;
+        else if (i == 1 && i + 1 < argc && strcmp(argv[i], "--restore") == 0)  //the commands go on from a snapshot
+            snapshot = argv[++i];
+        else if (i == 1 && i + 1 < argc && strcmp(argv[i], "--wal") == 0)      //recovers from the log, logs the commands
+            checkpoint = argv[++i];
+        else if (!batching && !sharding && !stats && !pipelining && strcmp(argv[i], "--batch") == 0)
+            batching = true;        //same output, see DB_BATCH
+        else if (!batching && !sharding && !stats && !pipelining && strcmp(argv[i], "--shards") == 0)
+            sharding = true;        //same output, see DB_SHARDS
+        else if (!batching && !sharding && !stats && !pipelining && strcmp(argv[i], "--stats") == 0)
+            stats = true;           //the index stats on stderr at the end
+        else if (!stats && !pipelining && strcmp(argv[i], "--pipeline") == 0)
+            pipelining = true;      //last, can follow --batch or --shards
+        else {
+            fprintf(stderr, "%s: unexpected argument %s\n"
+                    "usage: %s [--restore snapshot | --wal path] [--batch | --shards | --stats] [--pipeline]\n"
+                    "       %s --convert\n"
+                    "       %s --files file...\n", argv[0], argv[i], argv[0], argv[0], argv[0]);
+            return 2;
+        }
+    }
+
+    if (checkpoint != NULL)
+        database = db_recover(checkpoint, batching ? DB_BATCH : sharding ? DB_SHARDS : 0, &durability);
+    else if (snapshot != NULL)
+        database = db_restore(snapshot, batching ? DB_BATCH : sharding ? DB_SHARDS : 0);
+    else
+        database = db_open(batching ? DB_BATCH : sharding ? DB_SHARDS : 0);
+    if (database == NULL) {
+        fprintf(stderr, "%s: %s\n", checkpoint != NULL ? checkpoint : snapshot, strerror(errno));
+        return 1;
+    }
+    openInput(&input, STDIN_FILENO);
+
+    if (converting)
+        convertInput(&input, stdout);
+    else if (isBinaryInput(&input)) {
+        if (pipelining)
+            startPipeline(NULL);    //the dictionary interns names, the main thread parses
+        while(getBinaryCommand(&input, &dictionary, &binCommand) != CMD_END)
+            executeBinaryCommand(&dictionary, &binCommand);
+    }
+    else {
+        if (pipelining)
+            startPipeline(&input);
+        while((pipelining ? pipelineCommand(&command) : getCommand(&input, &command)) != CMD_END)
+            executeCommand(&command);
     }
+    if (pipelining)
+        stopPipeline();
+    closeInput(&input);
+    flushOutput();
+    if (batching)
+        db_batch_stats(database, stderr);
+    if (stats)      //the index once the input ran, text or binary
+        db_stats(database, stderr);
+    if (checkpoint != NULL && (error = db_sync(database)) != 0) {
+        fprintf(stderr, "%s.wal: %s\n", checkpoint, strerror(error));
+        return 1;
+    }
+    if ((error = db_snapshot_error(database)) != 0) {   //the relations damaged were run without their instances
+        fprintf(stderr, "%s: %s\n", checkpoint != NULL ? checkpoint : snapshot, strerror(error));
+        return 1;
+    }
+    free(dictionary.names);     //the database goes with the process, closing it would only take time
     return 0;
 }
 
 
 // --- FUNCTIONS IMPLEMENTATION ---
 
-//Command parsing and execution
+//Input buffering
 
 /*
- * int getCommand(char* command, char* ent1, char* ent2, char* rel)
- *
- * probably the worst parser you'll ever see
+ * void openInput(t_input* in, int fd)
  *
  * --- DESCRIPTION ---
- * this function parses the input file, one row at a time
- * returns an integer, 1 if the last line read is the 'end' command,
- * 0 otherwise. The 4 parameters are used to return the attributes needed to
- * execute the required operations:
+ * prepares the input layer on an already open file descriptor. Regular files are memory-mapped
+ * as a whole, so the parser never copies a single byte; anything else (pipes, terminals, or a
+ * file mmap refuses) is read in blocks of INPUT_BLOCK_SIZE bytes into a growable buffer
  *
  * --- PARAMETERS ---
- * command: can assume the values 'addrel', 'addent', 'delrel', 'delent', 'report' (without quotes)
- * ent1: the first entity found, used in addrel, addent, delrel, delent
- * ent2: the second entity fount, used in addrel and delrel
- * rel: the relationship between ent1 and ent2, used in addrel and delrel
+ * in: the input descriptor to initialize
+ * fd: the file descriptor to read the commands from
  *
  * --- RETURN VALUES ---
- * 1: if the function is parsing the last line, containing only the string 'end'
- * 0: in any other case
+ * none
  */
-int getCommand(char *command, char *ent1, char *ent2, char *rel) {
-    int i = 0;
+void openInput(t_input *in, int fd) {
+    struct stat info;
+
+    in->fd = fd;
+    in->pos = 0;
+    in->eof = false;
+    in->mapped = false;
+
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void *map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)info.st_size, MADV_SEQUENTIAL);
+            in->buffer = map;
+            in->size = in->capacity = (size_t)info.st_size;
+            in->mapped = true;
+            in->eof = true;
+            return;
+        }
+    }
 
-    for(i = 0; i < 6; i++)  //reading the first 6 chatacters, containing the command
-        command[i] = (char)getc_unlocked(stdin);
-    command[6] = '\0';
+    in->buffer = malloc(INPUT_BLOCK_SIZE);
+    in->capacity = INPUT_BLOCK_SIZE;
+    in->size = 0;
+}
 
-    if(command[0] == 'e' &&   //if it encounters the last line, it cannot compare strings with
-       command[1] == 'n' &&   //strcmp due to segfault, so it compares the first three characters
-       command[2] == 'd')     //of the command string
-        return 1;
+void closeInput(t_input *in) {
+    if (in->mapped)
+        munmap(in->buffer, in->capacity);
+    else
+        free(in->buffer);
+    in->buffer = NULL;
+}
 
+/*
+ * reads the next block from the descriptor, after moving the unconsumed bytes (a line cut by the
+ * previous block) to the beginning of the buffer. The buffer only grows if a single line doesn't fit.
+ * Returns the number of bytes read, 0 once there is nothing left
+ */
+int fillInput(t_input *in) {
+    ssize_t bytesRead;
 
-    ent1[0] = '\0'; //assigning NULL strings to avoid garbage in the parameters
-    ent2[0] = '\0';
-    rel[0] = '\0';
-
-
-    if(strcmp(command, "report") != 0){ //if the command is not a report, it requires at least one attribute to work
-        getc_unlocked(stdin);  //dump the space and quote before the attribute
-        getc_unlocked(stdin);  //not very elegant, but it works
-        i = 1;
-        ent1[0] = '"';
-        do {
-            ent1[i] = (char)getc_unlocked(stdin);
-            i++;
-        } while(ent1[i-1] != '"');
-        ent1[i-1] = '"';
-        ent1[i] = ' ';
-        ent1[i+1] = '\0';
-
-        if ((strcmp(command, "addrel") == 0) || (strcmp(command, "delrel") == 0)) { //if the command works on relatonships, it needs all three attributes
-            getc_unlocked(stdin);
-            getc_unlocked(stdin);
-            i = 1;
-            ent2[0] = '"';
-            do {
-                ent2[i] = (char)getc_unlocked(stdin);
-                i++;
-            } while(ent2[i-1] != '"');
-            ent2[i-1] = '"';
-            ent2[i] = ' ';
-            ent2[i+1] = '\0';
-
-            getc_unlocked(stdin);
-            getc_unlocked(stdin);
-            i = 1;
-            rel[0] = '"';
-            do {
-                rel[i] = (char)getc_unlocked(stdin);
-                i++;
-            } while(rel[i-1] != '"');
-            rel[i-1] = '"';
-            rel[i] = ' ';
-            rel[i+1] = '\0';
-        }
+    if (in->eof)
+        return 0;
+
+    if (in->pos > 0) {
+        memmove(in->buffer, in->buffer + in->pos, in->size - in->pos);
+        in->size -= in->pos;
+        in->pos = 0;
+    }
+    if (in->size == in->capacity) {
+        in->capacity *= 2;
+        in->buffer = realloc(in->buffer, in->capacity);
     }
 
-    while((char)getc_unlocked(stdin) != '\n'){}  //dump any other character. You don't wanna remove this
-    return 0;
+    do {
+        bytesRead = read(in->fd, in->buffer + in->size, in->capacity - in->size);
+    } while (bytesRead < 0 && errno == EINTR);
+
+    if (bytesRead <= 0) {
+        in->eof = true;
+        return 0;
+    }
+    in->size += (size_t)bytesRead;
+    return (int)bytesRead;
 }
+
 /*
- * void executeCommand(char* command, char* ent1, char* ent2, char* rel)
+ * int nextLine(t_input* in, const char** start, const char** end, const char** quotes, int* numQuotes)
  *
  * --- DESCRIPTION ---
- * executes different commands based on the request, called in the main for every input line parsed
- * not everytime all the parameters are used, it depends on the requested command
+ * finds the next complete line in the input buffer, reading more blocks if the line straddles
+ * the end of the current one. While looking for the end of the line, the tokenizer kernel also
+ * records where the quotes are, so the names can be sliced without looking at the line again.
+ * The returned pointers stay valid until the next call
  *
  * --- PARAMETERS ---
- * command: a 6-char-long string containing the command name, as parsed from the file
- * ent1: the first entity name
- * ent2: the second entity name
- * rel: the relation name
+ * in: the input to read from
+ * start: returns the first character of the line
+ * end: returns the position of the '\n' terminating the line (or the end of the input, if the last
+ *      line has no terminator)
+ * quotes: returns the positions of the first MAX_LINE_QUOTES quotes in the line
+ * numQuotes: returns how many of them have been found
  *
  * --- RETURN VALUES ---
- * none
+ * 1: if a line has been found
+ * 0: if the input is over
  */
-void executeCommand(char* command, char* ent1, char* ent2, char* rel) {
-    if (strcmp(command, "addent") == 0) {
-        addEntity(ent1);
-        return;
-    } else if (strcmp(command, "addrel") == 0) {
-        addRelation(ent1, ent2, rel);
-        return;
-    } else if (strcmp(command, "delent") == 0) {
-        deleteEntity(ent1);
-        return;
-    } else if (strcmp(command, "delrel") == 0) {
-        deleteRelation(ent1, ent2, rel);
-        return;
-    } else if (strcmp(command, "report") == 0) {
-        printReport();
-        return;
-    }
-}
-/*
- * adds a new entity to the table, if absent
- */
-void addEntity(char* entName) {
-    unsigned long hashValue = hash(entName, HASH_MULTIPLIER, HASH_SIZE_ENT);
-    t_entity *temp = entityTable[hashValue];
-
-    while (temp != NULL) {
-        if (strcmp(temp->name, entName) == 0) {   //element already exists
-            if (temp->version % 2 != 0)
-                temp->version++;
-            return;
+int nextLine(t_input *in, const char **start, const char **end, const char **quotes, int *numQuotes) {
+    const char *newline;
+    size_t scanned = 0, offsets[MAX_LINE_QUOTES];
+    int i, more;
+
+    *numQuotes = 0;
+    while ((newline = scanLine(in->buffer + in->pos + scanned, in->buffer + in->size, quotes, numQuotes)) == NULL) {
+        scanned = in->size - in->pos;
+        for (i = 0; i < *numQuotes; i++)    //fillInput moves the line around, keep the quotes as offsets meanwhile
+            offsets[i] = (size_t)(quotes[i] - (in->buffer + in->pos));
+        more = fillInput(in);
+        for (i = 0; i < *numQuotes; i++)
+            quotes[i] = in->buffer + in->pos + offsets[i];
+
+        if (more == 0) {
+            if (in->pos == in->size)
+                return 0;
+            *start = in->buffer + in->pos;
+            *end = in->buffer + in->size;
+            in->pos = in->size;
+            return 1;
         }
-        temp = temp->next;
     }
 
-    t_entity *newEnt = (t_entity*)malloc(sizeof(t_entity));
-    strcpy(newEnt->name, entName);
-    newEnt->version = 0;
-    newEnt->next = entityTable[hashValue];
-    newEnt->relations = NULL;
-    entityTable[hashValue] = newEnt;
-}
-/*
- * looks for an entity. If found, it marks it as deleted changing i
- * its name to "\0", to avoid possible collisions with the other entities names
- */
-void deleteEntity(char* entName){
-    unsigned long hashValue = hash(entName, HASH_MULTIPLIER, HASH_SIZE_ENT);
-    t_entity *temp = entityTable[hashValue];
-
-    while (temp != NULL) {
-        if (strcmp(temp->name, entName) == 0) {    //element exists
-            if(temp->version % 2 == 0) {
-                temp->version++;
-                refreshFlags(temp->relations);
-            }
-            return;
-        }
-        temp = temp->next;
-    }
+    *start = in->buffer + in->pos;
+    *end = newline;
+    in->pos = (size_t)(newline - in->buffer) + 1;
+    return 1;
 }
 
-void addRelation(char* orig, char* dest, char* relName) {
-    unsigned long hashValue;
 
-    hashValue = hash(orig, HASH_MULTIPLIER, HASH_SIZE_ENT);
-    t_entity *senderAddr = getEntityAddr(entityTable[hashValue], orig);
-    hashValue = hash(dest, HASH_MULTIPLIER, HASH_SIZE_ENT);
-    t_entity *recipientAddr = getEntityAddr(entityTable[hashValue], dest);
+//Output buffering
 
-    if(senderAddr != NULL && recipientAddr != NULL) {   //checks if the entities have been created
-        if (senderAddr->version % 2 == 0 &&
-            recipientAddr->version % 2 == 0) {    //checks if the entities have not been deleted
-
-            hashValue = hash(relName, HASH_MULTIPLIER, HASH_SIZE_REL);
-            t_relation *temp = relTable[hashValue];
-
-            while (temp != NULL) {
-                if (strcmp(temp->name, relName) == 0) {   //element already exists
-                    temp->root = addRelationInstance(temp, temp->root, senderAddr, recipientAddr);
-                    return;
-                }
-                temp = temp->next;
-            }
-
-            //adds a new relation type in the hash table
-            t_relation *newRel = (t_relation*)malloc(sizeof(t_relation));
-            strcpy(newRel->name, relName);
-            newRel->next = relTable[hashValue];
-            relTable[hashValue] = newRel;
-
-            newRel->root = NULL;
-            newRel->maxSenders = -1;
-            newRel->recipients = NULL;
-            newRel->recalc = false;
-            newRel->root = addRelationInstance(newRel, newRel->root, senderAddr, recipientAddr);
-
-            relRoot = addToRelTree(relRoot, newRel);
-        }
-    }
+/*
+ * stdout doesn't go through stdio: a report is put together in memory and handed over whole.
+ * Reports are collected in the output buffer until it would go over OUTPUT_BUFFER_SIZE, so a
+ * stream of small ones costs one write() every few thousand; a report that big is written
+ * straight from where it is, with a single write() unless the kernel takes it in parts
+ */
+void writeOutput(const void *data, size_t len) {
+    if (output.size + len > OUTPUT_BUFFER_SIZE)
+        passOutput();
+    if (len >= OUTPUT_BUFFER_SIZE && !pipeline.running)
+        writeAll(data, len);
+    else
+        putBytes(&output, data, len);   //the writer thread needs a copy
 }
 
-void deleteRelation(char* orig, char* dest, char* relName) {
-    unsigned long hashValue;
-
-    hashValue= hash(orig, HASH_MULTIPLIER, HASH_SIZE_ENT);
-    t_entity *senderAddr = getEntityAddr(entityTable[hashValue], orig);
-    hashValue = hash(dest, HASH_MULTIPLIER, HASH_SIZE_ENT);
-    t_entity *recipientAddr = getEntityAddr(entityTable[hashValue], dest);
-
-    if(senderAddr != NULL && recipientAddr != NULL) {   //checks if the entities have been created
-
-        hashValue = hash(relName, HASH_MULTIPLIER, HASH_SIZE_REL);
-        t_relation *temp = relTable[hashValue];
+/*
+ * writes the output buffer; with --pipeline, gives it to the writer thread and takes a written one back
+ */
+void passOutput(void) {
+    t_byteBuffer written;
+    size_t slot;
 
-        while (temp != NULL) {
-            if (strcmp(temp->name, relName) == 0) {   //element exists
-                delRelationInstance(temp, temp->root, senderAddr, recipientAddr);
-                return;
-            }
-            temp = temp->next;
-        }
+    if (!pipeline.running) {
+        writeAll(output.data, output.size);
+        output.size = 0;
+        return;
     }
+    if (output.size == 0)
+        return;
+    waitRing(&pipeline.output, 0, PIPELINE_SLOTS - 1);
+    slot = atomic_load(&pipeline.output.head) % PIPELINE_SLOTS;
+    written = pipeline.buffers[slot];
+    pipeline.buffers[slot] = output;
+    output = written;
+    advanceRing(&pipeline.output, true);
 }
 
-void printReport() {
-    int count = 0;
-    count = printRelations(relRoot);
-    if (count == 0)
-        fputs_unlocked("none", stdout);
-    fputs_unlocked("\n", stdout);
+/*
+ * same, but returns once everything is written
+ */
+void flushOutput(void) {
+    passOutput();
+    if (pipeline.running)
+        waitRing(&pipeline.output, 0, 0);
 }
 
-int printRelations(t_relationTree *node) {
-    if (node == NULL)
-        return 0;
-    int count = 0;
-    printRelations(node->leftChild);
+void writeAll(const void *data, size_t len) {
+    ssize_t written;
 
-    if (node->relation->recalc == true) {
-        node->relation->maxSenders = -1;
-        recalcRecipients(node->relation, node->relation->root);
-        node->relation->recalc = false;
+    while (len > 0) {
+        written = write(outputFd, data, len);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)   //nobody is reading, nothing else to do
+            return;
+        data = (const char*)data + written;
+        len -= written;
     }
-
-    count+=printSingleReport(node->relation);
-    printRelations(node->rightChild);
-    return count;
 }
 
+//Tokenizer kernels
 
-//Relation insertion and deletion
-
-t_entity *getEntityAddr(t_entity *source, char *entName) {
-    t_entity *temp = source;
-
-    while (temp != NULL) {
-        if (strcmp(temp->name, entName) == 0)    //element already exists
-            return temp;
-        temp = temp->next;
-    }
-    return NULL;
+/*
+ * void selectScanKernel(void)
+ *
+ * --- DESCRIPTION ---
+ * chooses the tokenizer kernel used by nextLine. Unless one has been forced at build time with
+ * SCAN_KERNEL, AVX2 is used when the CPU supports it, SSE2 (always there on x86-64) otherwise;
+ * other architectures fall back to the scalar loop
+ *
+ * --- PARAMETERS ---
+ * none
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+void selectScanKernel(void) {
+#if SCAN_KERNEL == SCAN_KERNEL_SCALAR
+    scanLine = scanLineScalar;
+#elif SCAN_KERNEL == SCAN_KERNEL_SSE2
+    scanLine = scanLineSSE2;
+#elif SCAN_KERNEL == SCAN_KERNEL_AVX2
+    scanLine = scanLineAVX2;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scanLine = scanLineAVX2;
+    else
+        scanLine = scanLineSSE2;
+#endif
 }
 
-t_relInstance *addRelationInstance(t_relation *rel, t_relInstance *node, t_entity *sender, t_entity *recipient) {
-    if (node == NULL) { //the node doesn't exist
-        t_relInstance *newNode = (t_relInstance*)malloc(sizeof(t_relInstance));
-        newNode->rightChild = NULL;
-        newNode->leftChild = NULL;
-        newNode->recipient = recipient;
-        newNode->height = 1;
-        newNode->numSenders = 0;
-        newNode->senderList = NULL;
-        newNode->recVersion = recipient->version;
-
-        int hasBeenAdded = 0;
-        newNode->senderList = addSender(newNode->senderList, sender, &hasBeenAdded);
-
-        newNode->numSenders++;
-        recipient->relations = addToRelTree(recipient->relations, rel);
-        sender->relations = addToRelTree(sender->relations, rel);
-
-
-        if (rel->maxSenders == newNode->numSenders)
-            rel->recipients = addToRecipientTree(rel->recipients, recipient);
-        else if (newNode->numSenders > rel->maxSenders) {
-            rel->recipients = delTree(rel->recipients);
-            rel->recipients = NULL;
-            rel->recipients = addToRecipientTree(rel->recipients, recipient);
-            rel->maxSenders = newNode->numSenders;
-        }
-
-        return newNode;
-
-    }
-
-    else if(strcmp(recipient->name, node->recipient->name) < 0)
-        node->leftChild = addRelationInstance(rel, node->leftChild, sender, recipient);
-    else if (strcmp(recipient->name, node->recipient->name) > 0)
-        node->rightChild = addRelationInstance(rel, node->rightChild, sender, recipient);
-
-    else {
-        if (node->recVersion < recipient->version) {
-            node->senderList = delTree(node->senderList);
-            node->senderList = NULL;
-            if(node->numSenders == rel->maxSenders) {
-                rel->recipients = delItem(rel->recipients, recipient);
-                if (rel->recipients == NULL)
-                    rel->recalc = true;
-            }
-            node->numSenders = 0;
-            node->recVersion = recipient->version;
-        }
-
-        int hasBeenAdded = 0;
-        node->senderList = addSender(node->senderList, sender, &hasBeenAdded);
-        if (hasBeenAdded == 1) {
-            node->numSenders++;
-            if (rel->maxSenders == node->numSenders)
-                rel->recipients = addToRecipientTree(rel->recipients, recipient);
-            else if (node->numSenders > rel->maxSenders)/*&&!ecakc*/ {
-                rel->recipients = delTree(rel->recipients);
-                rel->recipients = NULL;
-                rel->recipients = addToRecipientTree(rel->recipients, recipient);
-                rel->maxSenders = node->numSenders;
-            }
-            sender->relations = addToRelTree(sender->relations, rel);
-            recipient->relations = addToRelTree(recipient->relations, rel);
-        }
-        return node;
-    }
-    node->height =  max(getHeight(node->rightChild), getHeight(node->leftChild)) + 1;
+/*
+ * const char* scanTail(const char* p, const char* end, const char** quotes, int* numQuotes)
+ *
+ * --- DESCRIPTION ---
+ * the common core of all the kernels, one byte at a time: walks from p to end, stopping at the first
+ * '\n'. Every '"' found on the way is appended to quotes, as long as there is room (MAX_LINE_QUOTES)
+ *
+ * --- PARAMETERS ---
+ * p: where to start scanning
+ * end: the first byte not to be read
+ * quotes: the quote positions found so far
+ * numQuotes: how many quotes have already been stored, updated on return
+ *
+ * --- RETURN VALUES ---
+ * the position of the '\n', NULL if the line goes on after end
+ */
+const char *scanTail(const char *p, const char *end, const char **quotes, int *numQuotes) {
+    int n = *numQuotes;
 
-    if (getBalance(node) > 1) {
-        if (strcmp(recipient->name, node->leftChild->recipient->name) < 0)
-            return rotateRight(node);
-        else {
-            node->leftChild = rotateLeft(node->leftChild);
-            return rotateRight(node);
+    for (; p < end; p++) {
+        if (*p == '"') {
+            if (n < MAX_LINE_QUOTES)
+                quotes[n++] = p;
         }
+        else if (*p == '\n')
+            break;
     }
-    else if (getBalance(node) < -1) {
-        if (strcmp(recipient->name, node->rightChild->recipient->name) > 0)
-            return rotateLeft(node);
-        else {
-            node->rightChild = rotateRight(node->rightChild);
-            return rotateLeft(node);
-        }
-    }
-
-    return node;
+    *numQuotes = n;
+    return p < end ? p : NULL;
 }
 
-void delRelationInstance(t_relation *rel, t_relInstance *node, t_entity *sender, t_entity *recipient) {
-    if (node == NULL) {
-        return;
-    }
-    if (node->recipient == recipient) {
-        int hasBeenDeleted = 0;
-        node->senderList = delSender(node->senderList, sender, &hasBeenDeleted);
-
-        if (hasBeenDeleted == 1) {
-            if (node->numSenders == rel->maxSenders) {
-                rel->recipients = delItem(rel->recipients, recipient);
-                if (rel->recipients == NULL) {
-                    rel->maxSenders = 0;
-                    rel->recalc = true;
-                }
-            }
-            node->numSenders--;
-        }
-    }
-    else {
-        if (strcmp(recipient->name, node->recipient->name) < 0)
-            delRelationInstance(rel, node->leftChild, sender, recipient);
-        else if (strcmp(recipient->name, node->recipient->name) > 0)
-            delRelationInstance(rel, node->rightChild, sender, recipient);
-    }
-
+const char *scanLineScalar(const char *p, const char *end, const char **quotes, int *numQuotes) {
+    return scanTail(p, end, quotes, numQuotes);
 }
 
-//Queue management
-
-t_entityTree *addToRecipientTree(t_entityTree *node, t_entity *newEntity) {
-    if (node == NULL) {
-        t_entityTree *newItem = (t_entityTree*) malloc(sizeof(t_entityTree));
-        newItem->entity = newEntity;
-        newItem->rightChild = NULL;
-        newItem->leftChild = NULL;
-        newItem->version = newEntity->version;
-        newItem->height = 1;
-        return newItem;
-    }
-    else if (strcmp(newEntity->name, node->entity->name) < 0)
-        node->leftChild = addToRecipientTree(node->leftChild, newEntity);
-    else if (strcmp(newEntity->name, node->entity->name) > 0)
-        node->rightChild = addToRecipientTree(node->rightChild, newEntity);
-
-    node->height =  max(ent_getHeight(node->rightChild), ent_getHeight(node->leftChild)) + 1;
-
-
-    if (ent_getBalance(node) > 1) {
-        if (strcmp(newEntity->name, node->leftChild->entity->name) < 0)
-            return ent_rotateRight(node);
-        else {
-            node->leftChild = ent_rotateLeft(node->leftChild);
-            return ent_rotateRight(node);
+#if SCAN_KERNEL != SCAN_KERNEL_SCALAR
+/*
+ * compares 16 bytes at a time against '"' and '\n'; the two masks tell where the line ends and which
+ * quotes come before that. The last few bytes of the buffer go through scanTail, so the kernel never
+ * reads past end (the input could be an mmap'd file ending right at a page boundary)
+ */
+const char *scanLineSSE2(const char *p, const char *end, const char **quotes, int *numQuotes) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i newline = _mm_set1_epi8('\n');
+    int n = *numQuotes;
+
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)p);
+        unsigned int quoteMask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, quote));
+        unsigned int newlineMask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+
+        if (newlineMask != 0)
+            quoteMask &= (newlineMask & -newlineMask) - 1;     //only the quotes before the '\n'
+        while (quoteMask != 0 && n < MAX_LINE_QUOTES) {
+            quotes[n++] = p + __builtin_ctz(quoteMask);
+            quoteMask &= quoteMask - 1;
         }
-    }
-    else if (ent_getBalance(node) < -1) {
-        if (strcmp(newEntity->name, node->rightChild->entity->name) > 0)
-            return ent_rotateLeft(node);
-        else {
-            node->rightChild = ent_rotateRight(node->rightChild);
-            return ent_rotateLeft(node);
+        if (newlineMask != 0) {
+            *numQuotes = n;
+            return p + __builtin_ctz(newlineMask);
         }
+        p += 16;
     }
-
-    return node;
+    *numQuotes = n;
+    return scanTail(p, end, quotes, numQuotes);
 }
+#endif
 
-t_entityTree *delItem(t_entityTree *node, t_entity *entity) {
-    if (node == NULL)
-        return NULL;
-
-    if(strcmp(entity->name, node->entity->name) < 0)
-        node->leftChild = delItem(node->leftChild, entity);
-    else if(strcmp(entity->name, node->entity->name) > 0)
-        node->rightChild = delItem(node->rightChild, entity);
-    else {
-        if (node->leftChild == NULL || node->rightChild == NULL) {
-            t_entityTree *temp = node->leftChild ? node->leftChild : node->rightChild;
-
-            if (temp == NULL) { //no children
-                temp = node;
-                node = NULL;
-            }
-            else {   //only one child
-                *node = *temp;
-                /*node->entity = temp->entity;
-                node->version = temp->version;*/
-            }
-            free(temp);
+#if SCAN_KERNEL == SCAN_KERNEL_AUTO || SCAN_KERNEL == SCAN_KERNEL_AVX2
+/*
+ * same as scanLineSSE2, 32 bytes at a time. Compiled for AVX2 regardless of the -march in use, it is
+ * only called when selectScanKernel found the instructions on the CPU
+ */
+__attribute__((target("avx2")))
+const char *scanLineAVX2(const char *p, const char *end, const char **quotes, int *numQuotes) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    int n = *numQuotes;
+
+    while (end - p >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)p);
+        unsigned int quoteMask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, quote));
+        unsigned int newlineMask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+
+        if (newlineMask != 0)
+            quoteMask &= (newlineMask & -newlineMask) - 1;
+        while (quoteMask != 0 && n < MAX_LINE_QUOTES) {
+            quotes[n++] = p + __builtin_ctz(quoteMask);
+            quoteMask &= quoteMask - 1;
         }
-        else {
-            t_entityTree *temp = ent_minValueNode(node->rightChild);
-            node->entity = temp->entity;
-            node->version = temp->version;
-            node->rightChild = delItem(node->rightChild, temp->entity);
+        if (newlineMask != 0) {
+            *numQuotes = n;
+            return p + __builtin_ctz(newlineMask);
         }
+        p += 32;
     }
+    *numQuotes = n;
+    return scanLineSSE2(p, end, quotes, numQuotes);
+}
+#endif
 
-    if (node == NULL)
-        return node;
 
-    node->height = max(ent_getHeight(node->rightChild), ent_getHeight(node->leftChild)) + 1;
+//Command parsing and execution
 
-    if (ent_getBalance(node) > 1) {
-        if (ent_getBalance(node->leftChild) >= 0)
-            return ent_rotateRight(node);
-        else {
-            node->leftChild = ent_rotateLeft(node->leftChild);
-            return ent_rotateRight(node);
-        }
+/*
+ * t_opcode getCommand(t_input* in, t_command* command)
+ *
+ * --- DESCRIPTION ---
+ * this function parses the input file, one row at a time. The first 6 bytes of the row are read as a
+ * single integer and looked up in commandTable (no string comparisons), then the names are sliced
+ * out of the quote positions found by the tokenizer. Names are not copied, the slices point into the
+ * input buffer and are valid until the next call
+ *
+ * --- PARAMETERS ---
+ * in: the input to parse
+ * command: returns the parsed command:
+ *          ent1: the first entity found, used in addrel, addent, delrel, delent
+ *          ent2: the second entity found, used in addrel and delrel
+ *          rel: the relationship between ent1 and ent2, used in addrel and delrel
+ *
+ * --- RETURN VALUES ---
+ * the opcode of the command, CMD_END for the 'end' line or when the input is over
+ */
+t_opcode getCommand(t_input *in, t_command *command) {
+    const char *line, *end, *quotes[MAX_LINE_QUOTES];
+    const t_commandSlot *slot;
+    int numQuotes;
+    uint64_t key;
+
+    if (nextLine(in, &line, &end, quotes, &numQuotes) == 0)
+        return command->opcode = CMD_END;
+
+    if (end - line < 6)     //'end', or a line too short to hold any other command
+        return command->opcode = (end - line >= 3 && strncmp(line, "end", 3) == 0) ? CMD_END : CMD_NONE;
+
+    key = COMMAND_KEY(line[0], line[1], line[2], line[3], line[4], line[5]);
+    slot = &commandTable[COMMAND_SLOT(key)];
+    if (slot->key != key || numQuotes < 2 * slot->names)
+        return command->opcode = (strncmp(line, "end", 3) == 0) ? CMD_END : CMD_NONE;
+    if (slot->opcode == CMD_REPORT && end - line >= 10 && memcmp(line + 6, "diff", 4) == 0)
+        return command->opcode = CMD_REPORTDIFF;    //same first 6 bytes as report
+
+    switch (slot->names) {
+        case 3:
+            command->rel.ptr = quotes[4] + 1;
+            command->rel.len = (size_t)(quotes[5] - quotes[4] - 1);
+            command->ent2.ptr = quotes[2] + 1;
+            command->ent2.len = (size_t)(quotes[3] - quotes[2] - 1);
+            //fall through
+        case 1:
+            command->ent1.ptr = quotes[0] + 1;
+            command->ent1.len = (size_t)(quotes[1] - quotes[0] - 1);
+            break;
+        default:
+            break;
     }
-    else if (ent_getBalance(node) < -1) {
-        if (ent_getBalance(node->rightChild) <= 0)
-            return ent_rotateLeft(node);
-        else {
-            node->rightChild = ent_rotateRight(node->rightChild);
-            return ent_rotateLeft(node);
-        }
+    return command->opcode = slot->opcode;
+}
+/*
+ * void executeCommand(t_command* command)
+ *
+ * --- DESCRIPTION ---
+ * executes different commands based on the request, called in the main for every input line parsed
+ * not everytime all the parameters are used, it depends on the requested command. The database
+ * does the rest, see db.h
+ *
+ * --- PARAMETERS ---
+ * command: the opcode and the names, as parsed from the file
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+void executeCommand(t_command *command) {
+    switch (command->opcode) {
+        case CMD_ADDENT:
+            db_addent(database, command->ent1.ptr, command->ent1.len);
+            break;
+        case CMD_ADDREL:
+            db_addrel(database, command->ent1.ptr, command->ent1.len, command->ent2.ptr, command->ent2.len,
+                      command->rel.ptr, command->rel.len);
+            break;
+        case CMD_DELENT:
+            db_delent(database, command->ent1.ptr, command->ent1.len);
+            break;
+        case CMD_DELREL:
+            db_delrel(database, command->ent1.ptr, command->ent1.len, command->ent2.ptr, command->ent2.len,
+                      command->rel.ptr, command->rel.len);
+            break;
+        case CMD_DROPREL:
+            db_droprel(database, command->ent1.ptr, command->ent1.len);    //the only name of the line
+            break;
+        case CMD_SAVE:
+            saveCommand(command->ent1.ptr, command->ent1.len);
+            break;
+        default:
+            printCommand(command->opcode);
+            break;
     }
-    return node;
 }
 
-t_entityTree *delTree(t_entityTree *node) {
-    if (node == NULL)
-        return NULL;
-    node->leftChild = delTree(node->leftChild);
-    node->rightChild = delTree(node->rightChild);
-    free(node);
-    return NULL;
+/*
+ * the commands that print something, text or binary alike
+ */
+void printCommand(t_opcode opcode) {
+    const char *text;
+    char *stats;
+    size_t len;
+    FILE *out;
+
+    switch (opcode) {
+        case CMD_REPORT:
+            text = db_report(database, &len);
+            writeOutput(text, len);
+            break;
+        case CMD_REPORTDIFF:
+            text = db_reportdiff(database, &len);
+            writeOutput(text, len);
+            break;
+        case CMD_MEMSTATS:
+            out = open_memstream(&stats, &len);     //goes through writeOutput, after the reports already buffered
+            db_memstats(database, out);
+            fclose(out);
+            writeOutput(stats, len);
+            free(stats);
+            break;
+        default:
+            break;
+    }
 }
 
+/*
+ * writes the database to a snapshot, see db_save. A failure is only told on stderr, the commands
+ * go on
+ */
+void saveCommand(const char *path, size_t len) {
+    char *name = strndup(path, len);
+    int error = db_save(database, name);
 
-
-int countInstanceSenders(t_relation *rel, t_relInstance *node) {
-    if (rel->recalc == false)
-        return node->numSenders;
-    return countTreeNodes(node->senderList);
-
+    if (error != 0)
+        fprintf(stderr, "%s: %s\n", name, strerror(error));
+    free(name);
 }
 
 
-//AVL support
-
-int getBalance(t_relInstance *node) {
-    if (node == NULL)
-        return 0;
-    return getHeight(node->leftChild) - getHeight(node->rightChild);
-}
+//Binary protocol
 
-int ent_getBalance(t_entityTree *node) {
-    if (node == NULL)
-        return 0;
-    return ent_getHeight(node->leftChild) - ent_getHeight(node->rightChild);
+/*
+ * reads until at least n bytes are available after the current position, returns false if the
+ * input ends first. Any pointer into the buffer is invalidated
+ */
+bool ensureInput(t_input *in, size_t n) {
+    while (in->size - in->pos < n) {
+        if (fillInput(in) == 0)
+            return false;
+    }
+    return true;
 }
 
-int rel_getBalance(t_relationTree *node) {
-    if (node == NULL)
-        return 0;
-    return rel_getHeight(node->leftChild) - rel_getHeight(node->rightChild);
+/*
+ * checks the first bytes of the input for the binary header, and skips it if found. Text inputs
+ * always start with a command name, so they can't be mistaken for binary ones
+ */
+bool isBinaryInput(t_input *in) {
+    if (!ensureInput(in, BIN_HEADER_SIZE) || memcmp(in->buffer + in->pos, BIN_MAGIC, BIN_MAGIC_SIZE) != 0)
+        return false;
+    if (in->buffer[in->pos + BIN_MAGIC_SIZE] != BIN_VERSION) {
+        fprintf(stderr, "unsupported binary input version %d\n", in->buffer[in->pos + BIN_MAGIC_SIZE]);
+        exit(EXIT_FAILURE);
+    }
+    in->pos += BIN_HEADER_SIZE;
+    return true;
 }
 
-int getHeight(t_relInstance *node) {
-    if (node == NULL)
-        return 0;
-    return node->height;
+/*
+ * the next dictionary ID is bound to the name interned in the database: this is the only time the
+ * binary protocol hashes a name, commands are given to db_apply by their interned names
+ */
+void addDictionaryEntry(t_dictionary *dict, const unsigned char *name, size_t len) {
+    if (dict->size == dict->capacity) {
+        dict->capacity = dict->capacity == 0 ? 1024 : dict->capacity * 2;
+        dict->names = realloc(dict->names, dict->capacity * sizeof(db_name_t));
+    }
+    dict->names[dict->size++] = db_intern(database, (const char*)name, len);
 }
 
-int ent_getHeight(t_entityTree *node) {
-    if (node == NULL)
-        return 0;
-    return node->height;
+/*
+ * t_opcode getBinaryCommand(t_input* in, t_dictionary* dict, t_binCommand* command)
+ *
+ * --- DESCRIPTION ---
+ * the binary counterpart of getCommand: reads records until it finds a command, adding the
+ * names it meets on the way to the dictionary. Records with an unknown opcode, malformed
+ * payloads or IDs not defined yet are skipped
+ *
+ * --- PARAMETERS ---
+ * in: the input to parse, positioned after the header
+ * dict: the names defined so far
+ * command: returns the opcode and the dictionary IDs of its names
+ *
+ * --- RETURN VALUES ---
+ * the opcode of the command, CMD_END for the 'end' record or when the input is over
+ */
+t_opcode getBinaryCommand(t_input *in, t_dictionary *dict, t_binCommand *command) {
+    const unsigned char *cursor, *end;
+    unsigned char opcode;
+    uint32_t length;
+    size_t header;
+
+    for (;;) {
+        ensureInput(in, MAX_VARINT_SIZE + 1);   //enough for the length and the opcode, unless the input is about to end
+        cursor = (const unsigned char*)in->buffer + in->pos;
+        end = (const unsigned char*)in->buffer + in->size;
+        if (!getVarint(&cursor, end, &length) || length == 0)
+            return command->opcode = CMD_END;
+        header = (size_t)(cursor - ((const unsigned char*)in->buffer + in->pos));
+        if (!ensureInput(in, header + length))  //truncated record
+            return command->opcode = CMD_END;
+
+        cursor = (const unsigned char*)in->buffer + in->pos + header;
+        end = cursor + length;
+        in->pos += header + length;
+
+        opcode = *cursor++;
+        switch (opcode) {
+            case BIN_NAME:
+                addDictionaryEntry(dict, cursor, (size_t)(end - cursor));
+                break;
+            case BIN_ADDENT:
+            case BIN_DELENT:
+                if (getVarint(&cursor, end, &command->ent1) && command->ent1 < dict->size)
+                    return command->opcode = opcode == BIN_ADDENT ? CMD_ADDENT : CMD_DELENT;
+                break;
+            case BIN_ADDREL:
+            case BIN_DELREL:
+                if (getVarint(&cursor, end, &command->ent1) && command->ent1 < dict->size &&
+                    getVarint(&cursor, end, &command->ent2) && command->ent2 < dict->size &&
+                    getVarint(&cursor, end, &command->rel) && command->rel < dict->size)
+                    return command->opcode = opcode == BIN_ADDREL ? CMD_ADDREL : CMD_DELREL;
+                break;
+            case BIN_REPORT:
+                return command->opcode = CMD_REPORT;
+            case BIN_REPORTDIFF:
+                return command->opcode = CMD_REPORTDIFF;
+            case BIN_MEMSTATS:
+                return command->opcode = CMD_MEMSTATS;
+            case BIN_DROPREL:
+                if (getVarint(&cursor, end, &command->ent1) && command->ent1 < dict->size)
+                    return command->opcode = CMD_DROPREL;
+                break;
+            case BIN_SAVE:
+                command->path.ptr = (const char*)cursor;
+                command->path.len = (size_t)(end - cursor);
+                return command->opcode = CMD_SAVE;
+            case BIN_END:
+                return command->opcode = CMD_END;
+            default:
+                break;
+        }
+    }
 }
 
-int rel_getHeight(t_relationTree *node) {
-    if (node == NULL)
-        return 0;
-    return node->height;
+/*
+ * void executeBinaryCommand(t_dictionary* dict, t_binCommand* command)
+ *
+ * --- DESCRIPTION ---
+ * same as executeCommand. Dictionary IDs are already bound to interned names, so the commands go
+ * to db_apply, without hashing or comparing any string
+ *
+ * --- PARAMETERS ---
+ * dict: the names defined so far
+ * command: the opcode and the dictionary IDs, as parsed from the file
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+void executeBinaryCommand(t_dictionary *dict, t_binCommand *command) {
+    switch (command->opcode) {
+        case CMD_ADDENT:
+            db_apply(database, DB_ADDENT, dict->names[command->ent1], DB_NO_NAME, DB_NO_NAME);
+            break;
+        case CMD_DELENT:
+            db_apply(database, DB_DELENT, dict->names[command->ent1], DB_NO_NAME, DB_NO_NAME);
+            break;
+        case CMD_ADDREL:
+            db_apply(database, DB_ADDREL, dict->names[command->ent1], dict->names[command->ent2],
+                     dict->names[command->rel]);
+            break;
+        case CMD_DELREL:
+            db_apply(database, DB_DELREL, dict->names[command->ent1], dict->names[command->ent2],
+                     dict->names[command->rel]);
+            break;
+        case CMD_DROPREL:
+            db_apply(database, DB_DROPREL, DB_NO_NAME, DB_NO_NAME, dict->names[command->ent1]);
+            break;
+        case CMD_SAVE:
+            saveCommand(command->path.ptr, command->path.len);
+            break;
+        default:
+            printCommand(command->opcode);
+            break;
+    }
 }
 
 
-t_entityTree *ent_minValueNode(t_entityTree *node) {
-    t_entityTree *temp = node;
-    while (temp->leftChild != NULL)
-        temp = temp->leftChild;
-    return temp;
-}
-
-void ent_printTree (t_entityTree *node) {
-    if (node == NULL)
-        return;
-    ent_printTree(node->leftChild);
-    fputs_unlocked(node->entity->name, stdout);
-    ent_printTree(node->rightChild);
-}
+//Text to binary conversion
 
+/*
+ * void convertInput(t_input* in, FILE* out)
+ *
+ * --- DESCRIPTION ---
+ * translates a text command file into the binary protocol. The commands are encoded in memory
+ * while the names are interned, then the file is written as: header, dictionary section (one
+ * BIN_NAME record per distinct name, in order of first appearance), command records. The names
+ * are interned in a database of their own, which numbers them in order of first appearance, so
+ * they are used as dictionary IDs. Lines that aren't valid commands are dropped
+ *
+ * --- PARAMETERS ---
+ * in: the text input
+ * out: where to write the binary file
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+void convertInput(t_input *in, FILE *out) {
+    static const unsigned char binOpcodes[] = {
+        [CMD_ADDENT] = BIN_ADDENT, [CMD_DELENT] = BIN_DELENT, [CMD_ADDREL] = BIN_ADDREL,
+        [CMD_DELREL] = BIN_DELREL, [CMD_REPORT] = BIN_REPORT, [CMD_MEMSTATS] = BIN_MEMSTATS,
+        [CMD_DROPREL] = BIN_DROPREL, [CMD_REPORTDIFF] = BIN_REPORTDIFF, [CMD_SAVE] = BIN_SAVE,
+        [CMD_END] = BIN_END
+    };
+    t_byteBuffer payload = {NULL, 0, 0}, dictionary = {NULL, 0, 0}, commands = {NULL, 0, 0};
+    db_t *names = db_open(0);
+    t_command command;
+    t_opcode opcode;
+    const char *name;
+    size_t i, len;
+
+    do {
+        opcode = getCommand(in, &command);
+        payload.size = 0;
+        switch (opcode) {
+            case CMD_ADDREL:
+            case CMD_DELREL:
+                putVarint(&payload, db_intern(names, command.ent1.ptr, command.ent1.len));
+                putVarint(&payload, db_intern(names, command.ent2.ptr, command.ent2.len));
+                putVarint(&payload, db_intern(names, command.rel.ptr, command.rel.len));
+                break;
+            case CMD_ADDENT:
+            case CMD_DELENT:
+            case CMD_DROPREL:
+                putVarint(&payload, db_intern(names, command.ent1.ptr, command.ent1.len));
+                break;
+            case CMD_SAVE:      //a path, not a name
+                putBytes(&payload, command.ent1.ptr, command.ent1.len);
+                break;
+            case CMD_NONE:
+                continue;
+            default:
+                break;
+        }
+        putRecord(&commands, binOpcodes[opcode], &payload);
+    } while (opcode != CMD_END);
+
+    for (i = 0; i < db_names(names); i++) {
+        payload.size = 0;
+        name = db_name(names, (db_name_t)i, &len);
+        putBytes(&payload, name, len);
+        putRecord(&dictionary, BIN_NAME, &payload);
+    }
 
-//AVL rotation
+    fwrite(BIN_MAGIC, 1, BIN_MAGIC_SIZE, out);
+    fputc(BIN_VERSION, out);
+    fwrite(dictionary.data, 1, dictionary.size, out);
+    fwrite(commands.data, 1, commands.size, out);
+    fflush(out);
 
-t_relInstance *doubleRotateLeft(t_relInstance *node) {
-    node->leftChild = rotateRight(node->leftChild);
-    return rotateLeft(node);
+    free(commands.data);
+    free(payload.data);
+    free(dictionary.data);
+    db_close(names);
 }
 
-t_entityTree *ent_doubleRotateLeft(t_entityTree *node) {
-    node->leftChild = ent_rotateRight(node->leftChild);
-    return ent_rotateLeft(node);
+/*
+ * appends a whole record: length (of opcode and payload), opcode, payload
+ */
+void putRecord(t_byteBuffer *buffer, unsigned char opcode, const t_byteBuffer *payload) {
+    putVarint(buffer, (uint32_t)(payload->size + 1));
+    putBytes(buffer, &opcode, 1);
+    if (payload->size > 0)
+        putBytes(buffer, payload->data, payload->size);
 }
 
-t_relationTree *rel_doubleRotateLeft(t_relationTree *node) {
-    node->leftChild = rel_rotateRight(node->leftChild);
-    return rel_rotateLeft(node);
-}
 
+//Pipeline
 
-t_relInstance *doubleRotateRight(t_relInstance *node) {
-    node->rightChild = rotateLeft(node->rightChild);
-    return rotateRight(node);
-}
+/*
+ * void startPipeline(t_input* in)
+ *
+ * --- DESCRIPTION ---
+ * --pipeline: starts a thread parsing the input, which hands the commands over to the main thread
+ * a batch at a time, and a thread writing the output, which gets it a buffer at a time; each
+ * through a ring of PIPELINE_SLOTS, see waitRing. The main thread is left with the execution, and
+ * only waits on the others when a ring is empty or full. Nothing else moves: the commands are
+ * the ones getCommand returns, in order, and the bytes written the same
+ *
+ * --- PARAMETERS ---
+ * in: the input, NULL to start the writer only
+ *
+ * --- RETURN VALUES ---
+ * none
+ */
+void startPipeline(t_input *in) {
+    int i;
 
-t_entityTree *ent_doubleRotateRight(t_entityTree *node) {
-    node->rightChild = ent_rotateLeft(node->rightChild);
-    return ent_rotateRight(node);
-}
-t_relationTree *rel_doubleRotateRight(t_relationTree *node) {
-    node->rightChild = rel_rotateLeft(node->rightChild);
-    return rel_rotateRight(node);
+    pipeline.input = in;
+    pipeline.running = true;
+    pthread_create(&pipeline.writer, NULL, writeWorker, NULL);
+    if (in == NULL)
+        return;
+    for (i = 0; i < PIPELINE_SLOTS; i++) {
+        pipeline.batches[i].commands = malloc(PIPELINE_BATCH * sizeof(t_command));
+        pipeline.batches[i].names.data = malloc(PIPELINE_NAME_BYTES);
+        pipeline.batches[i].names.capacity = PIPELINE_NAME_BYTES;
+    }
+    pthread_create(&pipeline.parser, NULL, parseWorker, in);
 }
 
-
-t_relInstance *rotateLeft(t_relInstance *node) {
-    t_relInstance *ret = node->rightChild;
-    t_relInstance *temp = ret->leftChild;
-
-    ret->leftChild = node;
-    node->rightChild = temp;
-
-    node->height = max(getHeight(node->leftChild), getHeight(node->rightChild)) + 1;
-    ret->height = max(getHeight(ret->leftChild), getHeight(ret->rightChild)) + 1;
-    return ret;
+/*
+ * waits for the output to be written and both threads to be done. The parser is, once the main
+ * thread has the last batch
+ */
+void stopPipeline() {
+    if (!pipeline.running)  //--convert and --stats don't start it
+        return;
+    flushOutput();
+    pipeline.running = false;
+    waitRing(&pipeline.output, 0, PIPELINE_SLOTS - 1);  //an empty buffer: the writer's signal to stop
+    advanceRing(&pipeline.output, true);
+    pthread_join(pipeline.writer, NULL);
+    if (pipeline.input != NULL)
+        pthread_join(pipeline.parser, NULL);
 }
 
-t_entityTree *ent_rotateLeft(t_entityTree *node) {
-    t_entityTree *ret = node->rightChild;
-    t_entityTree *temp = ret->leftChild;
-
-    ret->leftChild = node;
-    node->rightChild = temp;
-
-    node->height = max(ent_getHeight(node->leftChild), ent_getHeight(node->rightChild)) + 1;
-    ret->height = max(ent_getHeight(ret->leftChild), ent_getHeight(ret->rightChild)) + 1;
-    return ret;
+/*
+ * what the main thread calls in place of getCommand. The names of the command stay valid until
+ * the next call, when the batch they are in may go back to the parser
+ */
+t_opcode pipelineCommand(t_command *command) {
+    t_commandBatch *batch;
+
+    for (;;) {
+        if (pipeline.holding) {
+            batch = &pipeline.batches[atomic_load(&pipeline.commands.tail) % PIPELINE_SLOTS];
+            if (pipeline.next < batch->count) {
+                *command = batch->commands[pipeline.next++];
+                return command->opcode;
+            }
+            if (batch->end)
+                return command->opcode = CMD_END;
+            advanceRing(&pipeline.commands, false);
+        }
+        waitRing(&pipeline.commands, 1, PIPELINE_SLOTS);
+        pipeline.holding = true;
+        pipeline.next = 0;
+    }
 }
 
-t_relationTree *rel_rotateLeft(t_relationTree *node) {
-    t_relationTree *ret = node->rightChild;
-    t_relationTree *temp = ret->leftChild;
-
-    ret->leftChild = node;
-    node->rightChild = temp;
-
-    node->height = max(rel_getHeight(node->leftChild), rel_getHeight(node->rightChild)) + 1;
-    ret->height = max(rel_getHeight(ret->leftChild), rel_getHeight(ret->rightChild)) + 1;
-    return ret;
+/*
+ * the parser thread. A batch is handed over when it is full, and as soon as the input has
+ * nothing left to parse: a pipe may take a while to send more, the main thread shouldn't wait
+ * for it with commands already there. A mapped input stays until the end, the commands can
+ * point into it; otherwise the names are copied into the batch
+ */
+void *parseWorker(void *arg) {
+    t_input *in = arg;
+    t_commandBatch *batch = nextBatch();
+    t_command command;
+
+    while (getCommand(in, &command) != CMD_END) {
+        if (!in->mapped && !batchNames(batch, &command)) {
+            advanceRing(&pipeline.commands, true);
+            batch = nextBatch();
+            batchNames(batch, &command);
+        }
+        batch->commands[batch->count++] = command;
+        if (batch->count == PIPELINE_BATCH || (!in->mapped && in->pos == in->size)) {
+            advanceRing(&pipeline.commands, true);
+            batch = nextBatch();
+        }
+    }
+    batch->end = true;
+    advanceRing(&pipeline.commands, true);
+    return NULL;
 }
 
-
-t_relInstance *rotateRight(t_relInstance *node) {
-    t_relInstance *ret = node->leftChild;
-    t_relInstance *temp = ret->rightChild;
-
-    ret->rightChild = node;
-    node->leftChild = temp;
-
-    node->height = max(getHeight(node->leftChild), getHeight(node->rightChild)) + 1;
-    ret->height = max(getHeight(ret->leftChild), getHeight(ret->rightChild)) + 1;
-    return ret;
+/*
+ * the batch at the head of the ring, once the main thread is done with it
+ */
+t_commandBatch *nextBatch() {
+    t_commandBatch *batch;
+
+    waitRing(&pipeline.commands, 0, PIPELINE_SLOTS - 1);
+    batch = &pipeline.batches[atomic_load(&pipeline.commands.head) % PIPELINE_SLOTS];
+    batch->count = 0;
+    batch->end = false;
+    batch->names.size = 0;
+    return batch;
 }
 
-t_entityTree *ent_rotateRight(t_entityTree *node) {
-    t_entityTree *ret = node->leftChild;
-    t_entityTree *temp = ret->rightChild;
-
-    ret->rightChild = node;
-    node->leftChild = temp;
-
-    node->height = max(ent_getHeight(node->leftChild), ent_getHeight(node->rightChild)) + 1;
-    ret->height = max(ent_getHeight(ret->leftChild), ent_getHeight(ret->rightChild)) + 1;
-    return ret;
+/*
+ * copies the names of the command into the batch and points the command to the copies. The
+ * buffer only grows for a command alone in its batch, so the other commands never lose theirs:
+ * false if the names don't fit
+ */
+bool batchNames(t_commandBatch *batch, t_command *command) {
+    t_slice *names[3] = {&command->ent1, &command->ent2, &command->rel};
+    size_t needed = batch->names.size;
+    int count, i;
+
+    if (command->opcode == CMD_ADDREL || command->opcode == CMD_DELREL)
+        count = 3;
+    else if (command->opcode == CMD_ADDENT || command->opcode == CMD_DELENT || command->opcode == CMD_DROPREL ||
+             command->opcode == CMD_SAVE)
+        count = 1;
+    else
+        return true;
+    for (i = 0; i < count; i++)
+        needed += names[i]->len;
+    if (needed > batch->names.capacity) {
+        if (batch->count > 0)
+            return false;
+        batch->names.capacity = needed;
+        batch->names.data = realloc(batch->names.data, needed);
+    }
+    for (i = 0; i < count; i++) {
+        memcpy(batch->names.data + batch->names.size, names[i]->ptr, names[i]->len);
+        names[i]->ptr = (const char*)batch->names.data + batch->names.size;
+        batch->names.size += names[i]->len;
+    }
+    return true;
 }
 
-t_relationTree *rel_rotateRight(t_relationTree *node) {
-    t_relationTree *ret = node->leftChild;
-    t_relationTree *temp = ret->rightChild;
-
-    ret->rightChild = node;
-    node->leftChild = temp;
-
-    node->height = max(rel_getHeight(node->leftChild), rel_getHeight(node->rightChild)) + 1;
-    ret->height = max(rel_getHeight(ret->leftChild), rel_getHeight(ret->rightChild)) + 1;
-    return ret;
+/*
+ * the writer thread: writes the buffers in order, until an empty one
+ */
+void *writeWorker(void *arg) {
+    t_byteBuffer *buffer;
+
+    (void)arg;
+    for (;;) {
+        waitRing(&pipeline.output, 1, PIPELINE_SLOTS);
+        buffer = &pipeline.buffers[atomic_load(&pipeline.output.tail) % PIPELINE_SLOTS];
+        if (buffer->size == 0) {
+            advanceRing(&pipeline.output, false);
+            return NULL;
+        }
+        writeAll(buffer->data, buffer->size);
+        buffer->size = 0;
+        advanceRing(&pipeline.output, false);
+    }
 }
 
-
-//misc
-
-int max(int x, int y) {
-    if (x > y)
-        return x;
-    return y;
-}
 /*
- * unsigned int hash(char* string, int mult, int mod)
- *
- * just a hash function that hopefully won't need more space than this
+ * size_t waitRing(t_ring* ring, size_t low, size_t high)
  *
  * --- DESCRIPTION ---
- * this is a basic string hashing function, that sums the ASCII values of every single
- * character in the string, each multiplied by the i-th power of a multiplier, where i is the
- * position of the char in the string. Both the multiplayer and the modulus must be prime to
- * ensure an acceptable collision rate, on average
+ * waits until the ring holds between low and high published slots: the producer waits for a
+ * free slot with 0 and size - 1, the consumer for a published one with 1 and size, and 0 and 0
+ * wait for the consumer to catch up. Each side only moves its own position, so the check needs
+ * no lock. A thread that has waited PIPELINE_SPIN yields goes to sleep on the condition
+ * variable, and advanceRing only takes the lock when someone is sleeping: between threads
+ * that keep up, handing a slot over costs two atomic operations
  *
  * --- PARAMETERS ---
- * string: the input string to be analyzed and hashed
- * mult: the multiplier, see above
- * mod: the divider, see below
+ * ring: the ring
+ * low, high: the bounds on the published slots
  *
  * --- RETURN VALUES ---
- * the function returns the remaindr of the division of the weighted sum of the ASCII values and
- * the divider
+ * the published slots, when they are within the bounds
  */
-unsigned int hash(const char* string, int mult, int mod) {
-    unsigned long long result = (int)string[1] - '_';
-    int i = 2;
-    while(string[i] != ' ') {
-        //result = mult * (string[i] - '_' + result); //probably exceeds the maximum integer size, should be tested on large strings
-        result = (mult*result + (int)string[i] - '_');
-        i++;
+size_t waitRing(t_ring *ring, size_t low, size_t high) {
+    size_t filled;
+    int i;
+
+    for (i = 0; i < PIPELINE_SPIN; i++) {
+        filled = atomic_load(&ring->head) - atomic_load(&ring->tail);
+        if (filled >= low && filled <= high)
+            return filled;
+        sched_yield();
     }
-    return result % mod;
+    pthread_mutex_lock(&ring->lock);
+    atomic_fetch_add(&ring->sleepers, 1);   //before the check, or advanceRing could miss it
+    while ((filled = atomic_load(&ring->head) - atomic_load(&ring->tail)) < low || filled > high)
+        pthread_cond_wait(&ring->wake, &ring->lock);
+    atomic_fetch_sub(&ring->sleepers, 1);
+    pthread_mutex_unlock(&ring->lock);
+    return filled;
 }
 
-void recalcRecipients(t_relation *rel, t_relInstance *node) {
-    if (node != NULL) {
-        recalcRecipients(rel, node->rightChild);
-
-        if (node->recVersion == node->recipient->version) {
-            node->numSenders = countInstanceSenders(rel, node);
-            if (node->numSenders > 0) {
-                if (node->numSenders == rel->maxSenders) {
-                    rel->recipients = addToRecipientTree(rel->recipients, node->recipient);
-                }
-                else if (node->numSenders > rel->maxSenders) {
-                    rel->recipients = delTree(rel->recipients);
-                    rel->recipients = NULL;
-                    rel->recipients = addToRecipientTree(rel->recipients, node->recipient);
-                    rel->maxSenders = node->numSenders;
-                }
-            }
-        }
-
-        recalcRecipients(rel, node->leftChild);
+/*
+ * publishes the slot at the head (producer) or gives back the one at the tail (consumer)
+ */
+void advanceRing(t_ring *ring, bool producer) {
+    atomic_fetch_add(producer ? &ring->head : &ring->tail, 1);
+    if (atomic_load(&ring->sleepers) > 0) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_broadcast(&ring->wake);
+        pthread_mutex_unlock(&ring->lock);
     }
 }
 
-int printSingleReport(t_relation *relation) {
-    if (relation->maxSenders == 0)
-        return 0;
-    if (relation->maxSenders < 0)
-        return 1;
-    fputs_unlocked(relation->name, stdout);
-    ent_printTree(relation->recipients);
-    printf("%d; ", relation->maxSenders);
-    return 1;
-}
-
-t_relationTree *addToRelTree(t_relationTree *node, t_relation *newRel) {
-    if (node == NULL) {
-        t_relationTree *newNode = (t_relationTree *) malloc(sizeof(t_relationTree));
-        newNode->rightChild = NULL;
-        newNode->leftChild = NULL;
-        newNode->height = 1;
-        newNode->relation = newRel;
-        return newNode;
-    }
-    else if (strcmp(newRel->name, node->relation->name) < 0)
-        node->leftChild = addToRelTree(node->leftChild, newRel);
-    else if (strcmp(newRel->name, node->relation->name) > 0)
-        node->rightChild = addToRelTree(node->rightChild, newRel);
 
-    node->height = max(rel_getHeight(node->rightChild), rel_getHeight(node->leftChild)) + 1;
+//Multiple files
 
-    if (rel_getBalance(node) > 1) {
-        if (strcmp(newRel->name, node->leftChild->relation->name) < 0)
-            return rel_rotateRight(node);
-        else {
-            node->leftChild = rel_rotateLeft(node->leftChild);
-            return rel_rotateRight(node);
-        }
+/*
+ * int runFiles(char** paths, int count)
+ *
+ * --- DESCRIPTION ---
+ * --files: runs each file as the program would run it on its own, on RUNNER_THREADS threads, and
+ * writes its output next to it, the ".in" at the end of the name replaced by ".out" (or ".out"
+ * added). Each file has a database and an output buffer of its own, so nothing is shared but the
+ * worker pool of the engine; a thread takes the next file once it is done with one. Then it
+ * prints on stderr, for each file in the order given, the commands, the time they took, the
+ * commands per second and the peak memory of the database; last the totals, with the wall time
+ * of the whole run and the peak resident memory of the process
+ *
+ * --- PARAMETERS ---
+ * paths: the files, text or binary
+ * count: how many there are
+ *
+ * --- RETURN VALUES ---
+ * the exit status: 1 if a file couldn't be opened, 0 otherwise
+ */
+int runFiles(char **paths, int count) {
+    t_fileRunner runner = {calloc(count > 0 ? (size_t)count : 1, sizeof(t_fileRun)), (size_t)count, 0};
+    int numThreads = RUNNER_THREADS > 0 ? RUNNER_THREADS : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *threads;
+    struct rusage usage;
+    size_t commands = 0;
+    double start = now(), wall;
+    int i, started = 0, status = 0;
+    t_fileRun *run;
+
+    for (i = 0; i < count; i++)
+        runner.runs[i].path = paths[i];
+    if (numThreads > count)
+        numThreads = count;
+    threads = malloc((numThreads > 1 ? (size_t)numThreads : 1) * sizeof(pthread_t));
+    for (; started < numThreads - 1; started++) {
+        if (pthread_create(&threads[started], NULL, fileWorker, &runner) != 0)
+            break;
     }
-    else if (rel_getBalance(node) < -1) {
-        if (strcmp(newRel->name, node->rightChild->relation->name) > 0)
-            return rel_rotateLeft(node);
-        else {
-            node->rightChild = rel_rotateRight(node->rightChild);
-            return rel_rotateLeft(node);
+    fileWorker(&runner);    //this thread takes files too
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    wall = now() - start;
+
+    for (i = 0; i < count; i++) {
+        run = &runner.runs[i];
+        if (run->error != 0) {
+            fprintf(stderr, "%s: %s\n", run->path, strerror(run->error));
+            status = 1;
+            continue;
         }
+        fprintf(stderr, "%s: %zu commands, %.2f ms, %.0f commands/s, %zu KiB peak\n", run->path, run->commands,
+                run->seconds * 1e3, run->seconds > 0 ? run->commands / run->seconds : 0.0, run->peakBytes >> 10);
+        commands += run->commands;
     }
-
-    return node;
-}
-
-void refreshFlags(t_relationTree *node) {
-    if (node == NULL)
-        return;
-    node->relation->recalc = true;
-    refreshFlags(node->leftChild);
-    refreshFlags(node->rightChild);
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "%d files on %d threads: %zu commands, %.2f ms, %.0f commands/s, %ld KiB resident peak\n",
+            count, started + 1, commands, wall * 1e3, wall > 0 ? commands / wall : 0.0, usage.ru_maxrss);
+    free(threads);
+    free(runner.runs);
+    return status;
 }
 
-t_entityTree *addSender(t_entityTree *node, t_entity *sender, int *flag) {
-    if (node == NULL && *(flag) == 0) { //the node doesn't exist
-        t_entityTree *newSender = (t_entityTree*) malloc(sizeof(t_entityTree));
-        newSender->rightChild = NULL;
-        newSender->leftChild = NULL;
-        newSender->height = 1;
-        newSender->entity = sender;
-        newSender->version = sender->version;
-
-        *(flag) = 1;
-        return newSender;
-    }
-
-    else if(strcmp(sender->name, node->entity->name) < 0)
-        node->leftChild = addSender(node->leftChild, sender, flag);
-    else if (strcmp(sender->name, node->entity->name) > 0)
-        node->rightChild = addSender(node->rightChild, sender, flag);
-
-    else {
-        if (node->version < sender->version) {
-            node->version = sender->version;
-            *(flag) = 1;
-        }
-        return node;
-    }
-
-    node->height = max(ent_getHeight(node->rightChild), ent_getHeight(node->leftChild)) + 1;
+void *fileWorker(void *arg) {
+    t_fileRunner *runner = arg;
+    size_t i;
 
-    if (ent_getBalance(node) > 1) {
-        if (strcmp(sender->name, node->leftChild->entity->name) < 0)
-            return ent_rotateRight(node);
-        else {
-            node->leftChild = ent_rotateLeft(node->leftChild);
-            return ent_rotateRight(node);
-        }
-    }
-    else if (ent_getBalance(node) < -1) {
-        if (strcmp(sender->name, node->rightChild->entity->name) > 0)
-            return ent_rotateLeft(node);
-        else {
-            node->rightChild = ent_rotateRight(node->rightChild);
-            return ent_rotateLeft(node);
-        }
-    }
-
-    return node;
+    while ((i = atomic_fetch_add(&runner->next, 1)) < runner->numRuns)
+        runFile(&runner->runs[i]);
+    free(output.data);
+    memset(&output, 0, sizeof(t_byteBuffer));
+    return NULL;
 }
 
-t_entityTree *delSender(t_entityTree *node, t_entity *sender, int *flag) {
-    if (node == NULL)
-        return node;
-
-
-    if (strcmp(sender->name, node->entity->name) < 0)
-        node->leftChild = delSender(node->leftChild, sender, flag);
-    else if (strcmp(sender->name, node->entity->name) > 0)
-        node->rightChild = delSender(node->rightChild, sender, flag);
-    else {
-        if (*flag == 0) {
-            *flag = -1;
-            if (node->version == node->entity->version && node->version % 2 == 0) {
-                *(flag) = 1;
-            }
-        }
-
-
-        if (node->leftChild == NULL || node->rightChild == NULL) {
-            t_entityTree *temp = node->leftChild ? node->leftChild : node->rightChild;
-            if (temp == NULL) {
-                temp = node;
-                node = NULL;
-            }
-            else
-                *node = *temp;
-
-            free(temp);
-        }
-        else {
-            t_entityTree *temp = ent_minValueNode(node->rightChild);
-            node->entity = temp->entity;
-            node->version = temp->version;
-            node->rightChild = delSender(node->rightChild, temp->entity, flag);
-        }
+/*
+ * runs one file on a new database, the way main does with stdin and stdout; db_memory is asked
+ * every MEMORY_SAMPLE commands and at the end, so a peak between two looks is missed
+ */
+void runFile(t_fileRun *run) {
+    size_t len = strlen(run->path);
+    char *outputPath = malloc(len + 5);
+    t_dictionary dictionary = {NULL, 0, 0};
+    t_binCommand binCommand;
+    t_command command;
+    t_input input;
+    size_t memory;
+    double start;
+    int fd;
+
+    memcpy(outputPath, run->path, len + 1);
+    if (len > 3 && strcmp(outputPath + len - 3, ".in") == 0)
+        len -= 3;
+    strcpy(outputPath + len, ".out");
+    if ((fd = open(run->path, O_RDONLY)) < 0 ||
+        (outputFd = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        run->error = errno;
+        if (fd >= 0)
+            close(fd);
+        outputFd = STDOUT_FILENO;
+        free(outputPath);
+        return;
     }
 
-    if (node == NULL)
-        return node;
-
-    node->height =  max(ent_getHeight(node->rightChild), ent_getHeight(node->leftChild)) + 1;
-
-    if (ent_getBalance(node) > 1) {
-        if (ent_getBalance(node->leftChild) >= 0)
-            return ent_rotateRight(node);
-        else {
-            node->leftChild = ent_rotateLeft(node->leftChild);
-            return ent_rotateRight(node);
+    start = now();
+    openInput(&input, fd);
+    database = db_open(0);
+    if (isBinaryInput(&input)) {
+        while (getBinaryCommand(&input, &dictionary, &binCommand) != CMD_END) {
+            executeBinaryCommand(&dictionary, &binCommand);
+            if (++run->commands % MEMORY_SAMPLE == 0 && (memory = db_memory(database)) > run->peakBytes)
+                run->peakBytes = memory;
         }
     }
-    else if (ent_getBalance(node) < -1) {
-        if (ent_getBalance(node->rightChild) <= 0)
-            return ent_rotateLeft(node);
-        else {
-            node->rightChild = ent_rotateRight(node->rightChild);
-            return ent_rotateLeft(node);
+    else {
+        while (getCommand(&input, &command) != CMD_END) {
+            executeCommand(&command);
+            if (command.opcode != CMD_NONE && ++run->commands % MEMORY_SAMPLE == 0 && (memory = db_memory(database)) > run->peakBytes)
+                run->peakBytes = memory;
         }
     }
-
-    return node;
+    flushOutput();
+    run->seconds = now() - start;
+    if ((memory = db_memory(database)) > run->peakBytes)
+        run->peakBytes = memory;
+
+    db_close(database);
+    database = NULL;
+    closeInput(&input);
+    close(fd);
+    close(outputFd);
+    outputFd = STDOUT_FILENO;
+    free(dictionary.names);
+    free(outputPath);
 }
 
-int countTreeNodes (t_entityTree *node) {
-    if (node == NULL)
-        return 0;
-    int count = 0;
-    if (node->entity->version == node->version && node->version % 2 == 0)
-        count++;
+double now() {
+    struct timespec ts;
 
-    count+=(countTreeNodes(node->leftChild) + countTreeNodes(node->rightChild));
-    return count;
-}
\ No newline at end of file
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -0,0 +1,105 @@
+#!/bin/bash
+# builds main with compile.sh (extra arguments are passed to it) and runs the tests below, in a
+# scratch directory; prints what failed, exits 1 if anything did
+cd "$(dirname "$0")" || exit 1
+bash compile.sh "$@" || exit 1
+main=$PWD/main
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failed=0
+
+fail() {
+    echo "FAIL: $*"
+    failed=1
+}
+
+# every input against the output of the reference implementation, trailing spaces aside, under each
+# way of running it, read from the file and from a pipe; run in the scratch directory, where the
+# snapshots they save go
+modes=("" --batch --shards --pipeline "--batch --pipeline" "--shards --pipeline")
+for input in TestCases/*/batch*.in; do
+    for flags in "${modes[@]}"; do
+        (cd "$work" && exec "$main" $flags 2> /dev/null) < "$input" | sed 's/ $//' |
+            cmp -s - "${input%.in}.py.out" || fail "$input $flags"
+        cat "$input" | (cd "$work" && exec "$main" $flags 2> /dev/null) | sed 's/ $//' |
+            cmp -s - "${input%.in}.py.out" || fail "$input $flags, piped"
+    done
+done
+
+# the same inputs through the converter, run from the binary it writes, with the index stats too
+for input in TestCases/*/batch*.in; do
+    "$main" --convert < "$input" > "$work/binary" || fail "$input not converted"
+    for flags in "" --stats; do
+        (cd "$work" && exec "$main" $flags 2> /dev/null) < "$work/binary" | sed 's/ $//' |
+            cmp -s - "${input%.in}.py.out" || fail "$input converted $flags"
+    done
+done
+
+# all the inputs at once through --files, each as text and converted, every output file against
+# the reference
+mkdir "$work/files"
+for input in TestCases/*/batch*.in; do
+    cp "$input" "$work/files/"
+    "$main" --convert < "$input" > "$work/files/${input##*/}.bin"
+done
+(cd "$work" && exec "$main" --files files/* 2> /dev/null) || fail "--files failed"
+for input in TestCases/*/batch*.in; do
+    for output in "$work/files/${input##*/}" "$work/files/${input##*/}.bin"; do
+        sed 's/ $//' "${output%.in}.out" 2> /dev/null | cmp -s - "${input%.in}.py.out" || fail "$input through --files, ${output##*/}"
+    done
+done
+
+# the rest of an input, restored from the snapshot its batch saved, under each way of running it,
+# as text and converted
+for input in TestCases/*/restore*.in; do
+    snapshot=batch${input##*/restore}
+    "$main" --convert < "$input" > "$work/$snapshot.binary" || fail "$input not converted"
+    for flags in "" --batch --shards; do
+        for commands in "$input" "$work/$snapshot.binary"; do
+            (cd "$work" && exec "$main" --restore "${snapshot%.in}.snap" $flags 2> /dev/null) < "$commands" |
+                sed 's/ $//' | cmp -s - "${input%.in}.py.out" || fail "$commands $flags"
+        done
+    done
+done
+
+# the library exports its interface and nothing else, whatever the flags
+gcc -std=gnu11 -O2 -c -o "$work/db.o" db.c "$@" || fail "db.c doesn't build"
+nm -g --defined-only "$work/db.o" | grep -v ' db_' | grep -q . && fail "db.c exports more than db.h"
+
+# db_scan_entities against the entities the test keeps itself, built like main
+gcc -std=gnu11 -O2 -pthread -o "$work/scan_test" TestCases/scan_test.c db.c -lm "$@" && "$work/scan_test" || fail "scan_test"
+
+# commands with DB_NO_NAME do nothing, whatever the flags of the database; with threads in the
+# pool for the shards to run
+for threads in "" -DWORKER_THREADS=4; do
+    gcc -std=gnu11 -O2 -pthread -o "$work/no_name_test" TestCases/no_name_test.c db.c -lm "$@" $threads &&
+        "$work/no_name_test" || fail "no_name_test $threads"
+done
+
+# a damaged instance block of a snapshot takes its relation out and is told, then a few damaged
+# copies of the snapshot, on the one a batch of the restore tests saved
+gcc -std=gnu11 -O2 -pthread -o "$work/snapshot_fuzz" TestCases/snapshot_fuzz.c -lm "$@" &&
+    "$work/snapshot_fuzz" "$work/batch10.2.snap" 200 > /dev/null || fail "snapshot_fuzz"
+
+# arguments out of place, or unknown, are refused before anything runs
+for args in "--batch --wal x" "--pipeline --batch" "--batch --shards" "--stats --pipeline" "--convert --batch" \
+            "--restore" "--files" "--verbose"; do
+    (cd "$work" && echo end | "$main" $args > /dev/null 2>&1)
+    [ $? = 2 ] || fail "arguments $args accepted"
+done
+
+# a group of the log is written once its window is over, even if no command comes after it: the
+# commands go through a fifo, the process waits for more, and is killed
+mkfifo "$work/fifo"
+(cd "$work" && exec "$main" --wal idle < fifo > /dev/null) &
+pid=$!
+exec 3> "$work/fifo"
+printf 'addent "a"\naddent "b"\naddrel "a" "b" "r"\n' >&3
+sleep 1
+kill -9 $pid
+wait $pid 2> /dev/null
+exec 3>&-
+[ "$(cd "$work" && echo report | "$main" --wal idle)" = '"r" "b" 1; ' ] || fail "idle group lost at kill"
+
+[ $failed = 0 ] && echo "all tests passed"
+exit $failed